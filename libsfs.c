@@ -0,0 +1,5644 @@
+// libsfs: mounting, block I/O, caching, journaling, directories and allocation
+//
+// All the state of a mounted image lives in its sfs_t; the functions below
+// take it as their first argument. The public operations at the end of the
+// file turn the internal conventions (inode numbers, -1 for failure) into
+// status codes.
+//
+// Locking: every public operation holds opLock shared and a commit holds it
+// exclusive, so a commit never sees half an operation. Inodes are locked
+// while a path is walked, each directory before the one below it and never
+// the other way round; reads take them shared and changes exclusive. Below
+// the inodes come the bitmap and share table locks, then the journal and
+// then the cache, which is the innermost lock.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+#include "sfs_disk.h"
+#include "libsfs.h"
+
+#define defaultCacheBlocks 64
+#define maxDirectoryBlocks 3 // a linear directory holds at most 3 blocks of 4 entries; bigger ones are indexed
+#define readAheadBlocks 64   // blocks fetched per read when streaming a file
+#define dentryCacheSize 4096 // name lookups remembered by the dentry cache (power of two)
+#define maxPathLength SFS_PATH_MAX
+#define copyBlocks 256       // blocks moved per write when a file is filled in
+#define pendingHashSize 1024 // hash buckets for the metadata blocks of the open transaction (power of two)
+#define dentryLockCount 64   // dentry cache entries are locked in this many stripes (power of two)
+#define packHashBits 12      // earlier positions remembered by packBytes(), as a power of two
+#define packBound(n) ((n) + (n) / 255 + 16) // most bytes packBytes() makes of n
+#define packedChunkBlocks ((sizeof(_chunk_header) + packBound(chunkBytes) + 1023) / 1024) // room for one chunk
+
+// how resolvePath() leaves an inode locked
+#define lockNone 0
+#define lockShared 1
+#define lockExclusive 2
+
+// how sendBlocks() moves file contents to a host file descriptor; each falls back to the next one
+#define copyRange 0 // copy_file_range(), for a regular file
+#define copySend 1  // sendfile(), for a pipe, a socket or a terminal
+#define copyPlain 2 // read into memory and write()
+
+// how flushDisk() gets written data to stable storage
+#define flushData 0 // fdatasync()
+#define flushAll 1  // fsync(); the file size and times too
+#define flushMap 2  // msync() of the mapped image
+
+// kinds of calls to the image counted with perf on; they index perfCounters
+#define perfRead 0
+#define perfWrite 1
+#define perfFlush 2
+#define perfCopy 3
+#define perfKinds 4
+
+// counters are bumped by threads holding a lock only shared, or none at all
+#define countEvent(counter, n) __atomic_add_fetch(&(counter), (n), __ATOMIC_RELAXED)
+
+// where a directory entry was found
+typedef struct
+{
+    int block; // block holding the entry
+    int slot;  // entry within the block (0-3)
+    int index; // position of the block in a linear directory; -1 for a bucket of an indexed one
+} _entry_location;
+
+// structure of a buffer cache slot
+typedef struct
+{
+    int block;       // disk block held in this slot; -1 = empty slot
+    char dirty;      // 1 = modified in memory, not yet written back
+    char referenced; // CLOCK reference bit
+    int next;        // next slot in the same hash chain; -1 = end of chain
+    char data[1024]; // cached copy of the block
+} _cache_entry;
+
+// structure of a metadata block of the open journal transaction
+typedef struct
+{
+    int block;       // home location of the block
+    int next;        // next pending block in the same hash chain; -1 = end of chain
+    char data[1024]; // contents to commit
+} _pending_block;
+
+// structure of a dentry cache entry; what a name in a directory refers to
+typedef struct
+{
+    int parent;                   // directory holding the name; -1 = empty entry
+    uint32_t generation;          // generation of that directory when the entry was made
+    int inode;                    // inode the name refers to; -1 = the name does not exist
+    char name[maxNameLength + 1]; // the name
+} _dentry;
+
+// where listEntry() passes the entries of a listed directory
+typedef struct
+{
+    sfs_list_fn visit; // the caller's function
+    void *arg;         // and its argument
+} _listing;
+
+// where bufferSource() takes the contents of sfs_create() from
+typedef struct
+{
+    const char *data; // what is left to hand out
+    uint64_t left;    // and how long it is
+} _buffer_source;
+
+// what takeSnapshot() collects while freezing the tree
+typedef struct
+{
+    unsigned char *held;  // blocks the frozen tree holds; kept with the snapshot
+    unsigned char *fresh; // blocks taken for the snapshot so far; freed again if it fails
+} _freeze;
+
+// a file opened by sfs_open()
+struct sfs_file
+{
+    sfs_t *fs;         // the image it is on
+    int inode;         // its inode; counted in the open-file table
+    int flags;         // SFS_O_* it was opened with
+    uint64_t position; // where sfs_fread() and sfs_fwrite() go next
+};
+
+// a mounted image
+struct sfs
+{
+    // SFS metadata; read during mounting
+    _super_block superBlock;      // layout of the image
+    int BLB;                      // total number of blocks
+    int INB;                      // total number of entries in inode table
+    unsigned char *_block_bitmap; // the block bitmap array; one bit per block
+    unsigned char *_inode_bitmap; // the inode bitmap array; one bit per inode
+    _inode_entry *_inode_table;   // the inode table containing INB inode entries
+
+    // useful info
+    int freeDiskBlocks;                          // number of available disk blocks
+    int freeInodeEntries;                        // number of available entries in inode table
+    int *blockGroupFree;                         // free blocks in each group of bitsPerBlock blocks (one bitmap block)
+    int *inodeGroupFree;                         // free inodes in each group of bitsPerBlock inodes
+    int blockHint;                               // where the next block search starts when the caller has no goal
+    int inodeHint;                               // where the next inode search starts
+    int currentDirectoryInode;                   // index of inode entry of the current directory in the inode table
+    uint32_t currentDirectoryGeneration;         // its generation when it was entered
+    char currrentWorkingDirectory[maxPathLength]; // absolute path of current directory
+
+    char *diskPath; // path of the disk image
+    int diskFd;     // THE DISK FILE (File Descriptor); -1 = not open
+    int ioFailed;   // 1 = a read or write of the image failed
+    int mapImage;   // 1 = access the image through mmap instead of pread/pwrite (chosen at mount)
+    char *diskMap;  // the mapped image; NULL = pread/pwrite access
+
+    // locks; see the top of the file for the order they are taken in
+    pthread_rwlock_t opLock;                        // operations shared, commits exclusive; writers go first
+    pthread_rwlock_t *inodeLocks;                   // one per inode
+    int inodeLockCount;                             // entries initialized in inodeLocks
+    pthread_mutex_t cwdLock;                        // current directory
+    pthread_mutex_t blockBitmapLock;                // block bitmap, its group counts and the block hint
+    pthread_mutex_t inodeBitmapLock;                // inode bitmap, its group counts and the inode hint
+    pthread_mutex_t deferLock;                      // deferred metadata writes
+    pthread_mutex_t reclaimLock;                    // reclaim queue
+    pthread_rwlock_t journalLock;                   // open transaction and log position; lookups shared
+    pthread_rwlock_t cacheLock;                     // buffer cache; hits shared
+    pthread_rwlock_t dentryLocks[dentryLockCount]; // dentry cache stripes
+
+    // buffer cache; sits between the operations and the disk file
+    int cacheBlocks;      // number of cache slots; 0 = write-through, no caching
+    _cache_entry *_cache; // the cache slots
+    int *cacheHash;       // hash buckets; block number -> first slot in chain
+    int cacheHashSize;    // number of hash buckets (power of two)
+    int clockHand;        // next slot the CLOCK replacement looks at
+    long cacheHits, cacheMisses, cacheEvictions, cacheWritebacks;
+
+    // metadata journal; with a journal, metadata writes collect in the open transaction and reach
+    // their home blocks only after a commit has logged them
+    char *journalBuffer;      // a record and its images, assembled for a single write
+    _pending_block *_pending; // blocks written since the last commit, in write order
+    int pendingBlocks;        // entries used in _pending
+    int pendingCapacity;      // entries allocated in _pending
+    int *pendingHash;         // hash buckets; block number -> first pending entry in chain
+    _extent *freedRuns;       // runs of blocks freed since the last commit
+    int freedRunCount;        // runs used in freedRuns
+    int freedRunCapacity;     // runs allocated in freedRuns
+    int *journaledSet;        // blocks logged since the last checkpoint (open addressing; -1 = empty)
+    int journaledSetSize;     // slots in journaledSet (power of two)
+    int journalHead;          // next free block of the log, counted from the journal start
+    uint32_t journalSequence; // sequence number of the next commit
+    long journalCommits, journalCheckpoints, journalLogged, journalReplayed;
+
+    // coalesced metadata writes; while deferred, bitmap and inode table blocks are only marked, and
+    // each one is written once when the writes are published
+    int deferDepth;               // nesting of deferMetadata() calls; 0 = write at once
+    unsigned char *deferredDirty; // one flag per block before the data area; 1 = waiting to be written
+    int *deferredBlocks;          // the blocks waiting to be written
+    int deferredCount;            // entries used in deferredBlocks
+
+    // deferred reclaim; sfs_remove() only unlinks, the blocks and inodes are freed by sfs_reclaim()
+    int deferredReclaim; // 1 = removal leaves freeing to sfs_reclaim()
+    int *reclaimQueue;   // orphan inodes waiting to be freed
+    int reclaimCount;    // entries used in reclaimQueue
+    int reclaimCapacity; // entries allocated in reclaimQueue
+    long reclaimedInodes;
+
+    // dentry cache; remembers name lookups, found or not, so resolving a hot path reads no directory blocks
+    _dentry *_dentry_cache;    // direct mapped; a new entry replaces the one hashed to the same place
+    uint32_t *inodeGeneration; // bumped when an inode is freed; entries made under its old life go stale
+    long dentryHits, dentryMisses;
+
+    // open-file table; a file removed while open is only marked as an orphan and freed by its last close
+    int *openCount; // handles open on each inode; changed with the inode locked
+
+    // instrumentation; with perf off a call to the image pays one test for it
+    int perf;                                   // 1 = count and time the calls that reach the image
+    sfs_perf_counter_t perfCounters[perfKinds]; // per perf* kind; bumped with countEvent()
+    int nextDiskBlock;                          // block after the last one read or written, for seeks
+
+    int compress; // 1 = fillFile() packs a file when its first chunk packs into fewer blocks
+
+    // block sharing; with a share table, blocks with the same contents are stored once
+    _share_entry *_share_table; // one entry per block; NULL = the image has no share table
+    int *shareHead;             // hash buckets; fingerprint -> first shared block in chain
+    int *shareNext;             // next shared block in the chain, per block; -1 = last
+    int shareBuckets;           // number of hash buckets (power of two)
+    pthread_mutex_t shareLock;  // share table and its hash chains
+
+    // snapshots; a block some snapshot holds is neither written in place nor freed
+    _snapshot_entry *_snapshot_table; // maxSnapshots entries; NULL = no snapshot was ever taken
+    unsigned char *heldBitmap;        // blocks held by any snapshot, one bit per block; NULL = none
+    char *snapshotName;               // the snapshot mounted read-only in place of the tree; NULL = the tree
+};
+
+// function declarations
+
+// DISK ACCESS
+static sfs_status readRegion(sfs_t *, uint32_t, uint32_t, void *);
+static sfs_status mountMetaData(sfs_t *);
+static int readBlock(sfs_t *, int, char[1024]);
+static int readBlocks(sfs_t *, int, int, char *);
+static int writeBlock(sfs_t *, int, char[1024]);
+static int writeHome(sfs_t *, int, char[1024]);
+static int writeBlocks(sfs_t *, int, int, char *);
+static void writeRun(sfs_t *, int, int, char *);
+static int diskRead(sfs_t *, int, int, char *);
+static void diskWrite(sfs_t *, int, int, char *);
+static void mapRead(sfs_t *, int, int, char *);
+static void mapWrite(sfs_t *, int, int, char *);
+static sfs_status mapDisk(sfs_t *);
+static char *blockData(sfs_t *, int, int, char *);
+static void adviseSequential(sfs_t *, int, int);
+static int sendBlocks(sfs_t *, int, int, int, size_t, size_t, char *, int *);
+static int writeOut(int, const char *, size_t);
+static void flushDisk(sfs_t *, int);
+static uint64_t perfClock();
+static void perfCount(sfs_t *, int, int, int, uint64_t, uint64_t);
+
+// BUFFER CACHE
+static sfs_status initCache(sfs_t *);
+static int cacheLookup(sfs_t *, int);
+static int cachedDirty(sfs_t *, int, int);
+static int cacheSlot(sfs_t *, int);
+static void cacheDrop(sfs_t *, int);
+static int compareSlots(const void *, const void *);
+static void writeBack(sfs_t *);
+
+// JOURNAL
+static sfs_status initJournal(sfs_t *);
+static uint32_t checksumBytes(uint32_t, const char *, size_t);
+static int logSpace(int);
+static int pendingLookup(sfs_t *, int);
+static void logBlock(sfs_t *, int, char *);
+static int overlayPending(sfs_t *, int, int, char *);
+static int pendingIn(sfs_t *, int, int);
+static void rememberFreed(sfs_t *, int, int);
+static int freedSinceCommit(sfs_t *, int);
+static int journaled(sfs_t *, int);
+static void rememberJournaled(sfs_t *, int);
+static void writeJournalHeader(sfs_t *, uint32_t);
+static void commitJournal(sfs_t *);
+static void checkpointJournal(sfs_t *);
+static int readRecord(sfs_t *, uint32_t, uint32_t, _journal_record *, char *);
+static sfs_status replayJournal(sfs_t *);
+
+// METADATA WRITES
+static void writeSuperBlock(sfs_t *, int);
+static void writeBlockBitmap(sfs_t *, int);
+static void writeInodeBitmap(sfs_t *, int);
+static void writeInode(sfs_t *, int);
+static char *metadataSource(sfs_t *, int);
+static void writeMetadata(sfs_t *, int);
+static void deferMetadata(sfs_t *);
+static int compareBlocks(const void *, const void *);
+static void publishMetadata(sfs_t *);
+
+// FILE BLOCK MAPPING
+static int getExtents(sfs_t *, int, _extent **);
+static int appendExtent(sfs_t *, int, int, int);
+static int setExtents(sfs_t *, int, _extent *, int);
+static int addExtent(_extent *, int, uint32_t, uint32_t);
+static void removeLastBlock(sfs_t *, int);
+static void freeExtents(sfs_t *, int);
+static int mapBlock(sfs_t *, int, uint32_t);
+static int directoryBlocks(sfs_t *, int, int *);
+static void dropDirectoryBlock(sfs_t *, int, int, int *, int);
+
+// DIRECTORIES
+static uint32_t nameHash(const char *);
+static void nameEntry(_directory_entry *, const char *);
+static void readSlot(sfs_t *, int, uint32_t, _dir_slot *);
+static void writeSlot(sfs_t *, int, uint32_t, _dir_slot *);
+static int findEntry(sfs_t *, int, char *, _entry_location *);
+static int addEntry(sfs_t *, int, char *, int);
+static int addIndexedEntry(sfs_t *, int, char *, int);
+static int growIndex(sfs_t *, int, _dir_header *);
+static int splitBucket(sfs_t *, int, _dir_header *, uint32_t, _dir_slot *);
+static int indexDirectory(sfs_t *, int);
+static void removeEntry(sfs_t *, int, _entry_location *);
+static void walkDirectory(sfs_t *, int, void (*)(sfs_t *, _directory_entry *, void *), void *);
+static void freeDirectory(sfs_t *, int);
+
+// PATHS
+static sfs_status initDentryCache(sfs_t *);
+static int dentrySlot(int, const char *);
+static void rememberName(sfs_t *, int, char *, int);
+static int lookupName(sfs_t *, int, char *);
+static int normalizePath(const char *, const char *, char *);
+static int currentDirectory(sfs_t *, char *, uint32_t *);
+static int walkMode(const char *, int, int);
+static sfs_status resolvePath(sfs_t *, const char *, int, int, int *, char *, int *);
+static void releasePath(sfs_t *, int, int, int, int);
+
+// LOCKING
+static void initLocks(sfs_t *);
+static sfs_status initInodeLocks(sfs_t *);
+static void destroyLocks(sfs_t *);
+static void lockInode(sfs_t *, int, int);
+static void unlockInode(sfs_t *, int, int);
+
+// BITMAP ACCESS
+static uint64_t bitmapWord(const unsigned char *, int);
+static int countUsed(const unsigned char *, int, int);
+static int *groupFreeCounts(const unsigned char *, int);
+static int sumCounts(const int *, int);
+static int scanFree(const unsigned char *, const int *, int, int);
+static int freeRunLength(const unsigned char *, int, int, int);
+static void markBlocks(sfs_t *, int, int, int);
+static int getBlock(sfs_t *, int);
+static int getBlocks(sfs_t *, int, int, int *);
+static void returnBlock(sfs_t *, int);
+static void returnBlocks(sfs_t *, int, int);
+static void freeBlocks(sfs_t *, int, int);
+static int getInode(sfs_t *);
+static void returnInode(sfs_t *, int);
+
+// FILES
+static int makeEntry(sfs_t *, int, char *, char *);
+static sfs_status makePath(sfs_t *, const char *, char *, int *);
+static long readSource(sfs_source_fn, void *, char *, size_t);
+static sfs_status fillFile(sfs_t *, int, uint64_t, sfs_source_fn, void *);
+static long bufferSource(void *, char *, size_t);
+static void describe(sfs_t *, int, const char *, sfs_entry_t *);
+static void listEntry(sfs_t *, _directory_entry *, void *);
+static void countEntry(sfs_t *, _directory_entry *, void *);
+
+// REMOVAL
+static int removeFile(sfs_t *, int);
+static void removeChild(sfs_t *, _directory_entry *, void *);
+static int removeDirectory(sfs_t *, int);
+static void queueOrphan(sfs_t *, int);
+static void orphanChild(sfs_t *, _directory_entry *, void *);
+static int reclaimOrphans(sfs_t *, int);
+static void outOfMemory();
+
+// OPEN FILES
+static int extentRun(_extent *, int, uint32_t, uint32_t *);
+static int growFile(sfs_t *, int, uint32_t);
+static sfs_status writeRange(sfs_t *, int, const char *, uint64_t, uint64_t, uint64_t *);
+static sfs_status readRange(sfs_t *, int, char *, uint64_t, uint64_t, uint64_t *);
+static sfs_status sendRange(sfs_t *, int, int, uint64_t, uint64_t, uint64_t *);
+static sfs_status truncateFile(sfs_t *, int, uint64_t);
+static sfs_status promoteInline(sfs_t *, int);
+static void releaseOrphan(sfs_t *, int);
+
+// COMPRESSION
+static uint32_t packHash(const unsigned char *);
+static unsigned char *packLength(unsigned char *, size_t);
+static size_t packBytes(const char *, size_t, char *);
+static long unpackBytes(const char *, size_t, char *, size_t);
+static size_t packChunks(const char *, size_t, char *);
+static int readLogical(sfs_t *, _extent *, int, uint32_t, uint32_t, char *);
+static sfs_status readPacked(sfs_t *, int, uint64_t, uint64_t, sfs_sink_fn, void *);
+static sfs_status rewriteFile(sfs_t *, int);
+static int copySink(void *, const char *, size_t);
+static int fdSink(void *, const char *, size_t);
+
+// BLOCK SHARING
+static sfs_status initShares(sfs_t *);
+static void writeShare(sfs_t *, int);
+static void chainShare(sfs_t *, int);
+static void unchainShare(sfs_t *, int);
+static int shareExisting(sfs_t *, const char *, int, int, const char *);
+static void shareNew(sfs_t *, int, const char *);
+static int keepShared(sfs_t *, int);
+static sfs_status unshareRange(sfs_t *, int, uint64_t, uint64_t);
+static int storeShared(sfs_t *, int, char *, int, int *);
+
+// SNAPSHOTS
+static sfs_status readSnapshots(sfs_t *);
+static sfs_status mountSnapshot(sfs_t *);
+static int findSnapshot(sfs_t *, const char *);
+static int isHeld(sfs_t *, int);
+static sfs_status heldBlocks(sfs_t *, int, unsigned char **);
+static sfs_status createSnapshotTable(sfs_t *);
+static int freshBlock(sfs_t *, char *, _freeze *);
+static int freezeInode(sfs_t *, int, _inode_entry *, _freeze *);
+static int freezeDirectory(sfs_t *, int, _extent **, int *, _freeze *);
+static int freezeExtents(sfs_t *, _inode_entry *, _extent *, int, _freeze *);
+static sfs_status takeSnapshot(sfs_t *, int, const char *);
+static void markInUse(sfs_t *, int, unsigned char *);
+static void freeMarked(sfs_t *, const unsigned char *, const unsigned char *);
+static sfs_status dropSnapshot(sfs_t *, int);
+
+// Read consecutive blocks of a metadata region into a newly allocated array
+sfs_status readRegion(sfs_t *fs, uint32_t start, uint32_t count, void *region)
+{
+    char **out = region;
+
+    *out = malloc((size_t)count * 1024);
+    if (*out == NULL)
+        return SFS_ENOMEM;
+
+    if (!diskRead(fs, start, count, *out))
+        return SFS_EIO;
+
+    return SFS_OK;
+}
+
+// Open file and read metadata + bitmaps + inode table
+sfs_status mountMetaData(sfs_t *fs)
+{
+    int i;
+    char buffer[1024];
+    _super_block *sb = (_super_block *)buffer;
+    _super_block expected;
+    sfs_status status;
+
+    fs->diskFd = open(fs->diskPath, O_RDWR);
+    if (fs->diskFd == -1)
+        return SFS_ENOENT;
+
+    // read superblock
+    if (pread(fs->diskFd, buffer, 1024, 0) != 1024)
+        return SFS_EFORMAT;
+    if (memcmp(sb->magic, sfsMagic, 4) != 0)
+    {
+        // version 1 images start with BLB and INB as six ASCII digits
+        for (i = 0; i < 6 && buffer[i] >= '0' && buffer[i] <= '9'; i++)
+            ;
+        return i == 6 ? SFS_EOLDFORMAT : SFS_EFORMAT;
+    }
+    if (sb->version < sfsOldestVersion || sb->version > sfsVersion)
+        return SFS_EVERSION;
+
+    // every bound below comes from the superblock; make sure it is one mkfs.sfs could have written
+    sfsLayout(&expected, sb->BLB, sb->INB, sb->journalBlocks, sb->shareBlocks > 0);
+    expected.version = sb->version;
+    if (sb->BLB == 0 || sb->BLB > 0x7fffffff || sb->INB == 0 || memcmp(sb, &expected, offsetof(_super_block, state)) != 0 || expected.dataStart >= sb->BLB ||
+        sb->journalBlocks == 1 || sb->journalBlocks == 2 || sb->shareStart != expected.shareStart || sb->shareBlocks != expected.shareBlocks ||
+        (sb->snapshotBlock != 0 && (sb->snapshotBlock < expected.dataStart || sb->snapshotBlock >= sb->BLB)))
+        return SFS_ECORRUPT;
+    fs->superBlock = *sb;
+    fs->BLB = sb->BLB;
+    fs->INB = sb->INB;
+
+    // commits logged before a crash must reach their home blocks before any metadata is read
+    if (fs->superBlock.journalBlocks > 0 && (status = replayJournal(fs)) != SFS_OK)
+        return status;
+
+    // read block bitmap
+    if ((status = readRegion(fs, fs->superBlock.blockBitmapStart, fs->superBlock.blockBitmapBlocks, &fs->_block_bitmap)) != SFS_OK)
+        return status;
+    // initialize number of free disk blocks, per group and in total; the allocator needs the groups, so the
+    // total is added up from them, and the superblock's count is only used to check it below
+    fs->blockGroupFree = groupFreeCounts(fs->_block_bitmap, fs->BLB);
+    fs->freeDiskBlocks = sumCounts(fs->blockGroupFree, (fs->BLB + bitsPerBlock - 1) / bitsPerBlock);
+    fs->blockHint = fs->superBlock.dataStart;
+
+    // read inode bitmap
+    if ((status = readRegion(fs, fs->superBlock.inodeBitmapStart, fs->superBlock.inodeBitmapBlocks, &fs->_inode_bitmap)) != SFS_OK)
+        return status;
+    // initialize number of unused inode entries
+    fs->inodeGroupFree = groupFreeCounts(fs->_inode_bitmap, fs->INB);
+    fs->freeInodeEntries = sumCounts(fs->inodeGroupFree, (fs->INB + bitsPerBlock - 1) / bitsPerBlock);
+    fs->inodeHint = 0;
+
+    // an image unmounted cleanly by this version recorded what its bitmaps add up to; the counts of an image
+    // that crashed, or that an older sfs wrote, are not trusted
+    if (fs->superBlock.state == superStateClean && fs->superBlock.version == sfsVersion &&
+        (fs->superBlock.freeBlocks != (uint32_t)fs->freeDiskBlocks || fs->superBlock.freeInodes != (uint32_t)fs->freeInodeEntries))
+        return SFS_ECORRUPT;
+
+    // read the inode table
+    if ((status = readRegion(fs, fs->superBlock.inodeTableStart, fs->superBlock.inodeTableBlocks, &fs->_inode_table)) != SFS_OK)
+        return status;
+
+    // read the share table and hash the shared blocks by fingerprint
+    if (fs->superBlock.shareBlocks > 0 && ((status = readRegion(fs, fs->superBlock.shareStart, fs->superBlock.shareBlocks, &fs->_share_table)) != SFS_OK ||
+                                           (status = initShares(fs)) != SFS_OK))
+        return status;
+
+    // read the snapshot table; a snapshot mounted read-only takes the place of the tree
+    if ((status = readSnapshots(fs)) != SFS_OK || (fs->snapshotName != NULL && (status = mountSnapshot(fs)) != SFS_OK))
+        return status;
+
+    // orphans left by deferred reclaim are freed in the background, as if just removed
+    for (i = 0; fs->snapshotName == NULL && i < fs->INB; i++)
+    {
+        if ((fs->_inode_table[i].flags & inodeFlagOrphan) && testBit(fs->_inode_bitmap, i))
+            queueOrphan(fs, i);
+    }
+
+    if (fs->mapImage)
+        return mapDisk(fs);
+    return SFS_OK;
+}
+
+// Map the whole image into memory; blocks are then read and written in place and the page cache does the caching
+sfs_status mapDisk(sfs_t *fs)
+{
+    struct stat info;
+    char *map;
+
+    if (fstat(fs->diskFd, &info) != 0 || info.st_size < (off_t)fs->BLB * 1024)
+        return SFS_EIO;
+
+    map = mmap(NULL, (size_t)fs->BLB * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fs->diskFd, 0);
+    if (map == MAP_FAILED)
+        return SFS_EIO;
+    fs->diskMap = map;
+
+    // lookups jump around the metadata; readahead is asked for where a scan is known to be sequential
+    madvise(fs->diskMap, (size_t)fs->BLB * 1024, MADV_RANDOM);
+    fs->cacheBlocks = 0;
+    return SFS_OK;
+}
+
+// Return the contents of count consecutive blocks for reading only
+// A mapped image hands out the blocks in place; otherwise they are read into buffer
+char *blockData(sfs_t *fs, int block_number, int count, char *buffer)
+{
+    // a block of the open transaction is not in the image yet; such a run is copied
+    if (fs->diskMap != NULL && block_number >= 0 && count >= 0 && block_number + count <= fs->BLB && !pendingIn(fs, block_number, count))
+    {
+        // counted as a read of the blocks, though nothing is copied
+        if (fs->perf)
+            perfCount(fs, perfRead, block_number, block_number + count, (uint64_t)count * 1024, perfClock());
+        return fs->diskMap + (size_t)block_number * 1024;
+    }
+
+    if (count == 1)
+        readBlock(fs, block_number, buffer);
+    else
+        readBlocks(fs, block_number, count, buffer);
+    return buffer;
+}
+
+// Tell the kernel a run of blocks of the mapped image is about to be read front to back
+void adviseSequential(sfs_t *fs, int block_number, int count)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t from = (size_t)block_number * 1024 / page * page;
+
+    if (fs->diskMap != NULL && count > 0)
+        madvise(fs->diskMap + from, (size_t)(block_number + count) * 1024 - from, MADV_SEQUENTIAL | MADV_WILLNEED);
+}
+
+// Copy length bytes of a run of count blocks, from head bytes into its first block on, to a host file
+// descriptor. The kernel moves them straight from the image as *mode says; when it refuses, *mode falls back
+// for this run and the next ones, and the rest is read into buffer and written. A run holding blocks of the
+// open transaction or of a commit not written back yet is always read, since the image has older contents
+// Returns 0, or -1 if fd failed
+int sendBlocks(sfs_t *fs, int fd, int block_number, int count, size_t head, size_t length, char *buffer, int *mode)
+{
+    off_t at = (off_t)block_number * 1024 + head;
+    int pending = pendingIn(fs, block_number, count) || cachedDirty(fs, block_number, count);
+    const char *data;
+    uint64_t start;
+    ssize_t n;
+
+    while (length > 0 && *mode != copyPlain && !pending)
+    {
+        start = fs->perf ? perfClock() : 0;
+        if (*mode == copyRange)
+            n = copy_file_range(fs->diskFd, &at, fd, NULL, length, 0);
+        else
+            n = sendfile(fd, fs->diskFd, &at, length);
+        if (fs->perf && n > 0)
+            perfCount(fs, perfCopy, (at - n) / 1024, (at + 1023) / 1024, n, start);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EBADF))
+            (*mode)++;
+        else if (n <= 0)
+            return -1;
+        else
+            length -= n;
+    }
+
+    data = length > 0 ? blockData(fs, block_number, count, buffer) + (at - (off_t)block_number * 1024) : NULL;
+    return writeOut(fd, data, length);
+}
+
+// Write all of length bytes to a host file descriptor; returns 0, or -1 if it failed
+int writeOut(int fd, const char *data, size_t length)
+{
+    ssize_t n;
+
+    while (length > 0)
+    {
+        n = write(fd, data, length);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+// Allocate the cache slots and the hash buckets
+sfs_status initCache(sfs_t *fs)
+{
+    int i;
+
+    if (fs->cacheBlocks <= 0)
+    {
+        fs->cacheBlocks = 0;
+        return SFS_OK;
+    }
+
+    fs->cacheHashSize = 1;
+    while (fs->cacheHashSize < 2 * fs->cacheBlocks)
+        fs->cacheHashSize <<= 1;
+
+    fs->_cache = malloc(fs->cacheBlocks * sizeof(_cache_entry));
+    fs->cacheHash = malloc(fs->cacheHashSize * sizeof(int));
+    if (fs->_cache == NULL || fs->cacheHash == NULL)
+        return SFS_ENOMEM;
+
+    for (i = 0; i < fs->cacheHashSize; i++)
+        fs->cacheHash[i] = -1;
+
+    for (i = 0; i < fs->cacheBlocks; i++)
+    {
+        fs->_cache[i].block = -1;
+        fs->_cache[i].dirty = 0;
+        fs->_cache[i].referenced = 0;
+        fs->_cache[i].next = -1;
+    }
+
+    return SFS_OK;
+}
+
+
+// Return the cache slot holding a block, or -1 if it is not cached
+int cacheLookup(sfs_t *fs, int block_number)
+{
+    int slot = fs->cacheHash[block_number & (fs->cacheHashSize - 1)];
+
+    while (slot != -1 && fs->_cache[slot].block != block_number)
+        slot = fs->_cache[slot].next;
+
+    return slot;
+}
+
+// Tell whether the cache holds newer contents than the image for any of count consecutive blocks
+int cachedDirty(sfs_t *fs, int block_number, int count)
+{
+    int i, slot, dirty = 0;
+
+    if (fs->cacheBlocks == 0)
+        return 0;
+
+    pthread_rwlock_rdlock(&fs->cacheLock);
+    for (i = 0; i < count && !dirty; i++)
+        dirty = (slot = cacheLookup(fs, block_number + i)) != -1 && fs->_cache[slot].dirty;
+    pthread_rwlock_unlock(&fs->cacheLock);
+
+    return dirty;
+}
+
+// Pick a slot for a block that is not cached; evicts with CLOCK and writes back a dirty victim
+int cacheSlot(sfs_t *fs, int block_number)
+{
+    int slot, *link;
+
+    // second chance: skip slots that were used since the hand last passed them
+    while (fs->_cache[fs->clockHand].block != -1 && fs->_cache[fs->clockHand].referenced)
+    {
+        fs->_cache[fs->clockHand].referenced = 0;
+        fs->clockHand = (fs->clockHand + 1) % fs->cacheBlocks;
+    }
+    slot = fs->clockHand;
+    fs->clockHand = (fs->clockHand + 1) % fs->cacheBlocks;
+
+    if (fs->_cache[slot].block != -1)
+    {
+        if (fs->_cache[slot].dirty)
+        {
+            diskWrite(fs, fs->_cache[slot].block, 1, fs->_cache[slot].data);
+            countEvent(fs->cacheWritebacks, 1);
+        }
+
+        // unlink the victim from its hash chain
+        link = &fs->cacheHash[fs->_cache[slot].block & (fs->cacheHashSize - 1)];
+        while (*link != slot)
+            link = &fs->_cache[*link].next;
+        *link = fs->_cache[slot].next;
+
+        countEvent(fs->cacheEvictions, 1);
+    }
+
+    fs->_cache[slot].block = block_number;
+    fs->_cache[slot].dirty = 0;
+    fs->_cache[slot].referenced = 1;
+    fs->_cache[slot].next = fs->cacheHash[block_number & (fs->cacheHashSize - 1)];
+    fs->cacheHash[block_number & (fs->cacheHashSize - 1)] = slot;
+
+    return slot;
+}
+
+// Empty a cache slot without writing it back; its block was overwritten on disk
+void cacheDrop(sfs_t *fs, int slot)
+{
+    int *link = &fs->cacheHash[fs->_cache[slot].block & (fs->cacheHashSize - 1)];
+
+    while (*link != slot)
+        link = &fs->_cache[*link].next;
+    *link = fs->_cache[slot].next;
+
+    fs->_cache[slot].block = -1;
+    fs->_cache[slot].dirty = 0;
+    fs->_cache[slot].referenced = 0;
+    fs->_cache[slot].next = -1;
+}
+
+// Compare cache slots by block number (writeback in disk order)
+int compareSlots(const void *a, const void *b)
+{
+    return (*(_cache_entry *const *)a)->block - (*(_cache_entry *const *)b)->block;
+}
+
+// Write every dirty cached block back to the disk file and flush it
+void writeBack(sfs_t *fs)
+{
+    int i, n = 0;
+    _cache_entry **dirty;
+
+    if (fs->diskMap != NULL)
+    {
+        flushDisk(fs, flushMap);
+        return;
+    }
+
+    if (fs->cacheBlocks > 0)
+    {
+        dirty = malloc(fs->cacheBlocks * sizeof(_cache_entry *));
+        if (dirty == NULL)
+            outOfMemory();
+
+        pthread_rwlock_wrlock(&fs->cacheLock);
+        for (i = 0; i < fs->cacheBlocks; i++)
+        {
+            if (fs->_cache[i].block != -1 && fs->_cache[i].dirty)
+                dirty[n++] = &fs->_cache[i];
+        }
+
+        qsort(dirty, n, sizeof(_cache_entry *), compareSlots);
+        for (i = 0; i < n; i++)
+        {
+            diskWrite(fs, dirty[i]->block, 1, dirty[i]->data);
+            dirty[i]->dirty = 0;
+        }
+        pthread_rwlock_unlock(&fs->cacheLock);
+
+        countEvent(fs->cacheWritebacks, n);
+        free(dirty);
+    }
+}
+
+// Read block data
+int readBlock(sfs_t *fs, int block_number, char buffer[1024])
+{
+    int slot;
+
+    if (block_number < 0 || block_number >= fs->BLB)
+    {
+        return 0;
+    }
+
+    // metadata written since the last commit is newer than its home block
+    if (overlayPending(fs, block_number, 1, buffer))
+        return 1;
+
+    if (fs->diskMap != NULL)
+    {
+        mapRead(fs, block_number, 1, buffer);
+        return 1;
+    }
+
+    if (fs->cacheBlocks == 0)
+        return diskRead(fs, block_number, 1, buffer);
+
+    pthread_rwlock_rdlock(&fs->cacheLock);
+    slot = cacheLookup(fs, block_number);
+    if (slot != -1)
+    {
+        memcpy(buffer, fs->_cache[slot].data, 1024);
+        __atomic_store_n(&fs->_cache[slot].referenced, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&fs->cacheLock);
+
+    if (slot != -1)
+    {
+        countEvent(fs->cacheHits, 1);
+        return 1;
+    }
+
+    // a miss is read without holding the cache; if another thread cached the block meanwhile, its copy wins
+    countEvent(fs->cacheMisses, 1);
+    diskRead(fs, block_number, 1, buffer);
+
+    pthread_rwlock_wrlock(&fs->cacheLock);
+    slot = cacheLookup(fs, block_number);
+    if (slot == -1)
+    {
+        slot = cacheSlot(fs, block_number);
+        memcpy(fs->_cache[slot].data, buffer, 1024);
+    }
+    else
+        memcpy(buffer, fs->_cache[slot].data, 1024);
+    pthread_rwlock_unlock(&fs->cacheLock);
+
+    return 1;
+}
+
+// Read a run of consecutive blocks in one go; cached copies may be newer than the disk and replace what was read
+int readBlocks(sfs_t *fs, int block_number, int count, char *buffer)
+{
+    int i, slot, cached = 0, ok;
+
+    if (block_number < 0 || count < 0 || block_number + count > fs->BLB)
+    {
+        return 0;
+    }
+
+    if (fs->diskMap != NULL)
+    {
+        mapRead(fs, block_number, count, buffer);
+        overlayPending(fs, block_number, count, buffer);
+        return 1;
+    }
+
+    ok = diskRead(fs, block_number, count, buffer);
+
+    if (fs->cacheBlocks > 0)
+    {
+        pthread_rwlock_rdlock(&fs->cacheLock);
+        for (i = 0; i < count; i++)
+        {
+            if ((slot = cacheLookup(fs, block_number + i)) != -1)
+            {
+                memcpy(buffer + (size_t)i * 1024, fs->_cache[slot].data, 1024);
+                cached++;
+            }
+        }
+        pthread_rwlock_unlock(&fs->cacheLock);
+
+        countEvent(fs->cacheHits, cached);
+        countEvent(fs->cacheMisses, count - cached);
+    }
+
+    overlayPending(fs, block_number, count, buffer);
+    return ok;
+}
+
+// Write a metadata block; with a journal it joins the open transaction, otherwise it goes to its home block
+int writeBlock(sfs_t *fs, int block_number, char buffer[1024])
+{
+    char empty_buffer[1024];
+
+    if (block_number < 0 || block_number >= fs->BLB)
+    {
+        return 0;
+    }
+
+    if (buffer == NULL)
+    {
+        memset(empty_buffer, 0, 1024);
+        buffer = empty_buffer;
+    }
+
+    if (fs->superBlock.journalBlocks > 0)
+    {
+        pthread_rwlock_wrlock(&fs->journalLock);
+        logBlock(fs, block_number, buffer);
+        pthread_rwlock_unlock(&fs->journalLock);
+        return 1;
+    }
+
+    return writeHome(fs, block_number, buffer);
+}
+
+// Write a block to its home location; with the cache enabled the block only becomes dirty and is written back later
+int writeHome(sfs_t *fs, int block_number, char buffer[1024])
+{
+    int slot;
+
+    if (fs->diskMap != NULL)
+    {
+        mapWrite(fs, block_number, 1, buffer);
+        return 1;
+    }
+
+    if (fs->cacheBlocks == 0)
+    {
+        diskWrite(fs, block_number, 1, buffer);
+        return 1;
+    }
+
+    // a whole block is written, so a miss does not need to read the old contents
+    pthread_rwlock_wrlock(&fs->cacheLock);
+    slot = cacheLookup(fs, block_number);
+    if (slot == -1)
+        slot = cacheSlot(fs, block_number);
+
+    memcpy(fs->_cache[slot].data, buffer, 1024);
+    fs->_cache[slot].dirty = 1;
+    fs->_cache[slot].referenced = 1;
+    pthread_rwlock_unlock(&fs->cacheLock);
+
+    return 1;
+}
+
+// Write a run of consecutive file data blocks straight to the disk file, bypassing the cache
+int writeBlocks(sfs_t *fs, int block_number, int count, char *buffer)
+{
+    int i, j, k;
+
+    if (block_number < 0 || count < 0 || block_number + count > fs->BLB)
+    {
+        return 0;
+    }
+
+    if (fs->superBlock.journalBlocks == 0)
+    {
+        writeRun(fs, block_number, count, buffer);
+        return 1;
+    }
+
+    // file data bypasses the journal, so it must not go home ahead of a commit the block depends on:
+    // a block the open transaction wrote or freed is still in use in the last commit, so its new
+    // contents join the transaction; a block with an old image in the log is checkpointed first, or a
+    // replay would write the image over the data
+    for (i = 0; i < count; i = k)
+    {
+        pthread_rwlock_wrlock(&fs->journalLock);
+        for (j = i; j < count && pendingLookup(fs, block_number + j) == -1 && !freedSinceCommit(fs, block_number + j); j++)
+            ;
+        for (k = i; k < j && fs->journalHead > 1; k++)
+        {
+            if (journaled(fs, block_number + k))
+            {
+                checkpointJournal(fs);
+                break;
+            }
+        }
+        for (k = j; k < count && (pendingLookup(fs, block_number + k) != -1 || freedSinceCommit(fs, block_number + k)); k++)
+            logBlock(fs, block_number + k, buffer + (size_t)k * 1024);
+        pthread_rwlock_unlock(&fs->journalLock);
+
+        // the blocks belong to an inode this thread has locked, so nobody can log them meanwhile
+        writeRun(fs, block_number + i, j - i, buffer + (size_t)i * 1024);
+    }
+
+    return 1;
+}
+
+// Write a run of blocks home; a cached copy of any of them is stale now (the block belonged to
+// something else before) and is dropped
+void writeRun(sfs_t *fs, int block_number, int count, char *buffer)
+{
+    int i, slot;
+
+    if (count == 0)
+        return;
+
+    if (fs->diskMap != NULL)
+    {
+        mapWrite(fs, block_number, count, buffer);
+        return;
+    }
+
+    if (fs->cacheBlocks > 0)
+    {
+        pthread_rwlock_wrlock(&fs->cacheLock);
+        for (i = 0; i < count; i++)
+        {
+            if ((slot = cacheLookup(fs, block_number + i)) != -1)
+                cacheDrop(fs, slot);
+        }
+        pthread_rwlock_unlock(&fs->cacheLock);
+    }
+
+    diskWrite(fs, block_number, count, buffer);
+}
+
+// Read count consecutive blocks straight from the disk file; a failed read leaves zeros
+int diskRead(sfs_t *fs, int block_number, int count, char *buffer)
+{
+    size_t length = (size_t)count * 1024, done = 0;
+    uint64_t start = fs->perf ? perfClock() : 0;
+    ssize_t n;
+
+    while (done < length)
+    {
+        n = pread(fs->diskFd, buffer + done, length - done, (off_t)block_number * 1024 + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            memset(buffer + done, 0, length - done);
+            fs->ioFailed = 1;
+            return 0;
+        }
+        done += n;
+    }
+
+    if (fs->perf)
+        perfCount(fs, perfRead, block_number, block_number + count, length, start);
+    return 1;
+}
+
+// Write count consecutive blocks straight to the disk file
+void diskWrite(sfs_t *fs, int block_number, int count, char *buffer)
+{
+    size_t length = (size_t)count * 1024, done = 0;
+    uint64_t start = fs->perf ? perfClock() : 0;
+    ssize_t n;
+
+    while (done < length)
+    {
+        n = pwrite(fs->diskFd, buffer + done, length - done, (off_t)block_number * 1024 + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            fs->ioFailed = 1;
+            return;
+        }
+        done += n;
+    }
+
+    if (fs->perf)
+        perfCount(fs, perfWrite, block_number, block_number + count, length, start);
+}
+
+// Copy count consecutive blocks out of the mapped image; counted as a read, page faults included
+void mapRead(sfs_t *fs, int block_number, int count, char *buffer)
+{
+    uint64_t start = fs->perf ? perfClock() : 0;
+
+    memcpy(buffer, fs->diskMap + (size_t)block_number * 1024, (size_t)count * 1024);
+    if (fs->perf)
+        perfCount(fs, perfRead, block_number, block_number + count, (uint64_t)count * 1024, start);
+}
+
+// Copy count consecutive blocks into the mapped image; counted as a write
+void mapWrite(sfs_t *fs, int block_number, int count, char *buffer)
+{
+    uint64_t start = fs->perf ? perfClock() : 0;
+
+    memcpy(fs->diskMap + (size_t)block_number * 1024, buffer, (size_t)count * 1024);
+    if (fs->perf)
+        perfCount(fs, perfWrite, block_number, block_number + count, (uint64_t)count * 1024, start);
+}
+
+// Flush the disk file as how says (flushData, flushAll or flushMap)
+void flushDisk(sfs_t *fs, int how)
+{
+    uint64_t start = fs->perf ? perfClock() : 0;
+
+    if (how == flushMap)
+        msync(fs->diskMap, (size_t)fs->BLB * 1024, MS_SYNC);
+    else if (how == flushAll)
+        fsync(fs->diskFd);
+    else
+        fdatasync(fs->diskFd);
+
+    if (fs->perf)
+        perfCount(fs, perfFlush, -1, -1, 0, start);
+}
+
+// Nanoseconds on the monotonic clock
+uint64_t perfClock()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Count a call to the image that covered blocks [from, to) and moved bytes; -1 for a flush, which
+// covers no blocks. Under several threads a seek is counted against whichever call ended last
+void perfCount(sfs_t *fs, int kind, int from, int to, uint64_t bytes, uint64_t start)
+{
+    sfs_perf_counter_t *counter = &fs->perfCounters[kind];
+    uint64_t us = (perfClock() - start) / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+
+    countEvent(counter->calls, 1);
+    countEvent(counter->bytes, bytes);
+    countEvent(counter->latency[bucket < SFS_LATENCY_BUCKETS ? bucket : SFS_LATENCY_BUCKETS - 1], 1);
+    if (from == -1)
+        return;
+
+    if (__atomic_exchange_n(&fs->nextDiskBlock, to, __ATOMIC_RELAXED) != from)
+        countEvent(counter->seeks, 1);
+}
+
+// Allocate the transaction and the set of logged blocks; the log itself was replayed and emptied at mount
+sfs_status initJournal(sfs_t *fs)
+{
+    int i;
+
+    if (fs->superBlock.journalBlocks == 0)
+        return SFS_OK;
+
+    fs->journaledSetSize = 1;
+    while (fs->journaledSetSize < 2 * (int)fs->superBlock.journalBlocks)
+        fs->journaledSetSize <<= 1;
+
+    fs->pendingHash = malloc(pendingHashSize * sizeof(int));
+    fs->journaledSet = malloc(fs->journaledSetSize * sizeof(int));
+    fs->journalBuffer = malloc((size_t)(1 + recordBlocks) * 1024);
+    if (fs->pendingHash == NULL || fs->journaledSet == NULL || fs->journalBuffer == NULL)
+        return SFS_ENOMEM;
+
+    for (i = 0; i < pendingHashSize; i++)
+        fs->pendingHash[i] = -1;
+    for (i = 0; i < fs->journaledSetSize; i++)
+        fs->journaledSet[i] = -1;
+
+    return SFS_OK;
+}
+
+// FNV-1a over a run of bytes, continuing from hash
+uint32_t checksumBytes(uint32_t hash, const char *data, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+
+    return hash;
+}
+
+// Log blocks taken by a commit of count block images; a descriptor per recordBlocks images
+int logSpace(int count)
+{
+    return count + (count + recordBlocks - 1) / recordBlocks;
+}
+
+// Return the entry of the open transaction holding a block, or -1 if it was not written since the last commit
+int pendingLookup(sfs_t *fs, int block_number)
+{
+    int entry;
+
+    if (fs->pendingBlocks == 0)
+        return -1;
+
+    entry = fs->pendingHash[block_number & (pendingHashSize - 1)];
+    while (entry != -1 && fs->_pending[entry].block != block_number)
+        entry = fs->_pending[entry].next;
+
+    return entry;
+}
+
+// Put a metadata block into the open transaction; a block written again just gets the new contents.
+// The caller holds journalLock exclusive.
+void logBlock(sfs_t *fs, int block_number, char *buffer)
+{
+    int entry = pendingLookup(fs, block_number);
+
+    if (entry == -1)
+    {
+        // a commit has to fit in the log; a transaction that outgrows it is committed in parts
+        if (logSpace(fs->pendingBlocks + 1) > (int)fs->superBlock.journalBlocks - 1)
+            commitJournal(fs);
+
+        if (fs->pendingBlocks == fs->pendingCapacity)
+        {
+            fs->pendingCapacity = fs->pendingCapacity == 0 ? 64 : 2 * fs->pendingCapacity;
+            fs->_pending = realloc(fs->_pending, fs->pendingCapacity * sizeof(_pending_block));
+            if (fs->_pending == NULL)
+            {
+                outOfMemory();
+            }
+        }
+
+        entry = fs->pendingBlocks;
+        __atomic_store_n(&fs->pendingBlocks, entry + 1, __ATOMIC_RELEASE);
+        fs->_pending[entry].block = block_number;
+        fs->_pending[entry].next = fs->pendingHash[block_number & (pendingHashSize - 1)];
+        fs->pendingHash[block_number & (pendingHashSize - 1)] = entry;
+    }
+
+    memcpy(fs->_pending[entry].data, buffer, 1024);
+}
+
+// Replace the blocks of a run just read from the image by their copies in the open transaction;
+// returns 1 if any block was replaced
+int overlayPending(sfs_t *fs, int block_number, int count, char *buffer)
+{
+    int i, entry, found = 0;
+
+    if (__atomic_load_n(&fs->pendingBlocks, __ATOMIC_ACQUIRE) == 0)
+        return 0;
+
+    pthread_rwlock_rdlock(&fs->journalLock);
+    for (i = 0; i < count; i++)
+    {
+        if ((entry = pendingLookup(fs, block_number + i)) != -1)
+        {
+            memcpy(buffer + (size_t)i * 1024, fs->_pending[entry].data, 1024);
+            found = 1;
+        }
+    }
+    pthread_rwlock_unlock(&fs->journalLock);
+
+    return found;
+}
+
+// Tell whether any block of a run was written since the last commit
+int pendingIn(sfs_t *fs, int block_number, int count)
+{
+    int i, found = 0;
+
+    if (__atomic_load_n(&fs->pendingBlocks, __ATOMIC_ACQUIRE) == 0)
+        return 0;
+
+    pthread_rwlock_rdlock(&fs->journalLock);
+    for (i = 0; i < count && !found; i++)
+        found = pendingLookup(fs, block_number + i) != -1;
+    pthread_rwlock_unlock(&fs->journalLock);
+
+    return found;
+}
+
+// Remember a run of blocks freed by the open transaction; the last commit still has them in use
+void rememberFreed(sfs_t *fs, int start, int count)
+{
+    if (fs->freedRunCount > 0 && fs->freedRuns[fs->freedRunCount - 1].start + fs->freedRuns[fs->freedRunCount - 1].length == (uint32_t)start)
+    {
+        fs->freedRuns[fs->freedRunCount - 1].length += count;
+        return;
+    }
+
+    if (fs->freedRunCount == fs->freedRunCapacity)
+    {
+        fs->freedRunCapacity = fs->freedRunCapacity == 0 ? 64 : 2 * fs->freedRunCapacity;
+        fs->freedRuns = realloc(fs->freedRuns, fs->freedRunCapacity * sizeof(_extent));
+        if (fs->freedRuns == NULL)
+        {
+            outOfMemory();
+        }
+    }
+
+    fs->freedRuns[fs->freedRunCount].start = start;
+    fs->freedRuns[fs->freedRunCount].length = count;
+    fs->freedRunCount++;
+}
+
+// Tell whether a block was freed by the open transaction
+int freedSinceCommit(sfs_t *fs, int block_number)
+{
+    int i;
+
+    for (i = 0; i < fs->freedRunCount; i++)
+    {
+        if ((uint32_t)block_number - fs->freedRuns[i].start < fs->freedRuns[i].length)
+            return 1;
+    }
+
+    return 0;
+}
+
+// Tell whether a block has an image in the log, so a replay would write it
+int journaled(sfs_t *fs, int block_number)
+{
+    int i = (block_number * 2654435761u) & (fs->journaledSetSize - 1);
+
+    while (fs->journaledSet[i] != -1)
+    {
+        if (fs->journaledSet[i] == block_number)
+            return 1;
+        i = (i + 1) & (fs->journaledSetSize - 1);
+    }
+
+    return 0;
+}
+
+// Add a block to the set of blocks logged since the last checkpoint; the log holds fewer images than the set has slots
+void rememberJournaled(sfs_t *fs, int block_number)
+{
+    int i = (block_number * 2654435761u) & (fs->journaledSetSize - 1);
+
+    while (fs->journaledSet[i] != -1)
+    {
+        if (fs->journaledSet[i] == block_number)
+            return;
+        i = (i + 1) & (fs->journaledSetSize - 1);
+    }
+
+    fs->journaledSet[i] = block_number;
+}
+
+// Write the journal header; commits numbered below sequence are no longer valid
+void writeJournalHeader(sfs_t *fs, uint32_t sequence)
+{
+    _journal_header header;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = journalMagic;
+    header.sequence = sequence;
+    diskWrite(fs, fs->superBlock.journalStart, 1, (char *)&header);
+}
+
+// Log the open transaction as one commit: sequential records, then a single flush to the disk; the
+// blocks go home afterwards and may stay dirty in the cache, since a replay can redo them. The caller
+// holds journalLock exclusive.
+void commitJournal(sfs_t *fs)
+{
+    _journal_record *record = (_journal_record *)fs->journalBuffer;
+    int i, first, n, at, need = logSpace(fs->pendingBlocks);
+
+    if (fs->pendingBlocks == 0)
+    {
+        fs->freedRunCount = 0;
+        return;
+    }
+
+    if (fs->journalHead + need > (int)fs->superBlock.journalBlocks)
+        checkpointJournal(fs);
+
+    at = fs->superBlock.journalStart + fs->journalHead;
+    for (first = 0; first < fs->pendingBlocks; first += n)
+    {
+        n = fs->pendingBlocks - first < recordBlocks ? fs->pendingBlocks - first : recordBlocks;
+
+        // a record and its images go down in one write
+        memset(record, 0, sizeof(*record));
+        record->magic = journalMagic;
+        record->sequence = fs->journalSequence;
+        record->count = n;
+        record->flags = first + n == fs->pendingBlocks ? journalRecordLast : 0;
+        for (i = 0; i < n; i++)
+        {
+            record->block[i] = fs->_pending[first + i].block;
+            memcpy(fs->journalBuffer + (size_t)(1 + i) * 1024, fs->_pending[first + i].data, 1024);
+        }
+
+        record->checksum = checksumBytes(2166136261u, (char *)record, sizeof(*record));
+        record->checksum = checksumBytes(record->checksum, fs->journalBuffer + 1024, (size_t)n * 1024);
+
+        diskWrite(fs, at, 1 + n, fs->journalBuffer);
+        at += 1 + n;
+    }
+
+    // file data written since the last commit goes down with the same flush
+    flushDisk(fs, flushData);
+
+    for (i = 0; i < fs->pendingBlocks; i++)
+    {
+        writeHome(fs, fs->_pending[i].block, fs->_pending[i].data);
+        rememberJournaled(fs, fs->_pending[i].block);
+        fs->pendingHash[fs->_pending[i].block & (pendingHashSize - 1)] = -1;
+    }
+
+    fs->journalHead += need;
+    fs->journalSequence++;
+    fs->journalCommits++;
+    fs->journalLogged += fs->pendingBlocks;
+    __atomic_store_n(&fs->pendingBlocks, 0, __ATOMIC_RELEASE);
+    fs->freedRunCount = 0;
+}
+
+// Empty the log: every committed block is written home and made durable, then the header moves past the
+// commits in the log. The open transaction is left alone. The caller holds journalLock exclusive.
+void checkpointJournal(sfs_t *fs)
+{
+    int i;
+
+    if (fs->journalHead == 1)
+        return;
+
+    writeBack(fs);
+    flushDisk(fs, flushAll);
+
+    writeJournalHeader(fs, fs->journalSequence);
+    flushDisk(fs, flushAll);
+
+    fs->journalHead = 1;
+    for (i = 0; i < fs->journaledSetSize; i++)
+        fs->journaledSet[i] = -1;
+    fs->journalCheckpoints++;
+}
+
+// Read the record at a log position; returns 1 if it is an intact record of the given commit
+int readRecord(sfs_t *fs, uint32_t at, uint32_t sequence, _journal_record *record, char *images)
+{
+    uint32_t i, checksum;
+
+    if (at >= fs->superBlock.journalBlocks || !diskRead(fs, fs->superBlock.journalStart + at, 1, (char *)record) || record->magic != journalMagic || record->sequence != sequence ||
+        record->count == 0 || record->count > recordBlocks || at + 1 + record->count > fs->superBlock.journalBlocks)
+        return 0;
+    if (!diskRead(fs, fs->superBlock.journalStart + at + 1, record->count, images))
+        return 0;
+
+    for (i = 0; i < record->count; i++)
+    {
+        if (record->block[i] >= fs->superBlock.BLB || (record->block[i] >= fs->superBlock.journalStart && record->block[i] < fs->superBlock.journalStart + fs->superBlock.journalBlocks))
+            return 0;
+    }
+
+    checksum = record->checksum;
+    record->checksum = 0;
+    record->checksum = checksumBytes(checksumBytes(2166136261u, (char *)record, 1024), images, (size_t)record->count * 1024);
+
+    return record->checksum == checksum;
+}
+
+// Redo the complete commits in the log, in sequence order; a commit cut short by a crash is ignored,
+// so the image holds every command up to the last commit and nothing of the ones after it
+sfs_status replayJournal(sfs_t *fs)
+{
+    _journal_header header;
+    _journal_record record;
+    char *images = malloc(recordBlocks * 1024);
+    uint32_t head = 1, at, i;
+    int complete;
+
+    if (images == NULL)
+        return SFS_ENOMEM;
+    if (!diskRead(fs, fs->superBlock.journalStart, 1, (char *)&header) || header.magic != journalMagic)
+    {
+        free(images);
+        return SFS_ECORRUPT;
+    }
+    fs->journalSequence = header.sequence;
+
+    while (1)
+    {
+        // a commit counts only if all its records are intact, up to the one flagged last
+        complete = 0;
+        for (at = head; !complete && readRecord(fs, at, fs->journalSequence, &record, images); at += 1 + record.count)
+            complete = record.flags & journalRecordLast;
+        if (!complete)
+            break;
+
+        for (at = head;; at += 1 + record.count)
+        {
+            readRecord(fs, at, fs->journalSequence, &record, images);
+            for (i = 0; i < record.count; i++)
+                diskWrite(fs, record.block[i], 1, images + (size_t)i * 1024);
+            if (record.flags & journalRecordLast)
+                break;
+        }
+
+        head = at + 1 + record.count;
+        fs->journalSequence++;
+        fs->journalReplayed++;
+    }
+    free(images);
+
+    if (fs->journalReplayed > 0)
+        flushDisk(fs, flushAll);
+
+    // records of a commit cut short carry the next number; skip it so they can never pass for part of a new commit
+    fs->journalSequence++;
+    writeJournalHeader(fs, fs->journalSequence);
+    flushDisk(fs, flushAll);
+    fs->journalHead = 1;
+    return SFS_OK;
+}
+
+// Record the free counts in the superblock, marked clean once everything they describe is on disk;
+// a mounted image is marked otherwise, so the counts of an image that crashed are not trusted
+void writeSuperBlock(sfs_t *fs, int clean)
+{
+    char buffer[1024];
+
+    fs->superBlock.state = clean ? superStateClean : 0;
+    fs->superBlock.freeBlocks = fs->freeDiskBlocks;
+    fs->superBlock.freeInodes = fs->freeInodeEntries;
+
+    memset(buffer, 0, sizeof(buffer));
+    memcpy(buffer, &fs->superBlock, sizeof(fs->superBlock));
+    if (clean)
+        flushDisk(fs, flushData);
+    diskWrite(fs, superBlockIndex, 1, buffer);
+}
+
+// Write the block bitmap block holding the bit of the given block
+void writeBlockBitmap(sfs_t *fs, int index)
+{
+    writeMetadata(fs, fs->superBlock.blockBitmapStart + index / bitsPerBlock);
+}
+
+// Write the inode bitmap block holding the bit of the given inode
+void writeInodeBitmap(sfs_t *fs, int index)
+{
+    writeMetadata(fs, fs->superBlock.inodeBitmapStart + index / bitsPerBlock);
+}
+
+// Write the inode table block holding the given inode entry
+void writeInode(sfs_t *fs, int index)
+{
+    writeMetadata(fs, fs->superBlock.inodeTableStart + index / inodesPerBlock);
+}
+
+// Return the in-memory copy of a bitmap, inode table or share table block
+char *metadataSource(sfs_t *fs, int block)
+{
+    if (fs->superBlock.shareBlocks > 0 && block >= (int)fs->superBlock.shareStart)
+        return (char *)fs->_share_table + (size_t)(block - fs->superBlock.shareStart) * 1024;
+    if (block >= (int)fs->superBlock.inodeTableStart)
+        return (char *)fs->_inode_table + (size_t)(block - fs->superBlock.inodeTableStart) * 1024;
+    if (block >= (int)fs->superBlock.inodeBitmapStart)
+        return (char *)fs->_inode_bitmap + (size_t)(block - fs->superBlock.inodeBitmapStart) * 1024;
+    return (char *)fs->_block_bitmap + (size_t)(block - fs->superBlock.blockBitmapStart) * 1024;
+}
+
+// Write a bitmap or inode table block from its in-memory copy, or just mark it while writes are deferred.
+// An inode table block is copied while other threads may be changing neighbour inodes; each of them
+// writes the block again after its change, so the last copy logged has them all.
+void writeMetadata(sfs_t *fs, int block)
+{
+    pthread_mutex_lock(&fs->deferLock);
+    if (fs->deferDepth == 0)
+    {
+        pthread_mutex_unlock(&fs->deferLock);
+        writeBlock(fs, block, metadataSource(fs, block));
+        return;
+    }
+
+    if (!fs->deferredDirty[block])
+    {
+        fs->deferredDirty[block] = 1;
+        fs->deferredBlocks[fs->deferredCount++] = block;
+    }
+    pthread_mutex_unlock(&fs->deferLock);
+}
+
+// Start collecting bitmap and inode table writes; the in-memory copies stay current, so nothing reads a stale block
+void deferMetadata(sfs_t *fs)
+{
+    pthread_mutex_lock(&fs->deferLock);
+    if (fs->deferredDirty == NULL)
+    {
+        fs->deferredDirty = calloc(fs->superBlock.dataStart, 1);
+        fs->deferredBlocks = malloc(fs->superBlock.dataStart * sizeof(int));
+        if (fs->deferredDirty == NULL || fs->deferredBlocks == NULL)
+        {
+            outOfMemory();
+        }
+    }
+
+    fs->deferDepth++;
+    pthread_mutex_unlock(&fs->deferLock);
+}
+
+int compareBlocks(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// Write every block marked since the matching deferMetadata() once, in disk order; with several threads
+// deferring, the blocks go out when the last of them publishes
+void publishMetadata(sfs_t *fs)
+{
+    int i, count, *blocks;
+    pthread_mutex_t *lock;
+
+    pthread_mutex_lock(&fs->deferLock);
+    if (--fs->deferDepth > 0)
+    {
+        pthread_mutex_unlock(&fs->deferLock);
+        return;
+    }
+
+    count = fs->deferredCount;
+    blocks = malloc((count + 1) * sizeof(int));
+    if (blocks == NULL)
+    {
+        outOfMemory();
+    }
+    memcpy(blocks, fs->deferredBlocks, count * sizeof(int));
+    for (i = 0; i < count; i++)
+        fs->deferredDirty[blocks[i]] = 0;
+    fs->deferredCount = 0;
+    pthread_mutex_unlock(&fs->deferLock);
+
+    // a bitmap block is copied under its bitmap lock, so the copy never has half an allocation
+    qsort(blocks, count, sizeof(int), compareBlocks);
+    for (i = 0; i < count; i++)
+    {
+        lock = NULL;
+        if (blocks[i] < (int)fs->superBlock.inodeBitmapStart)
+            lock = &fs->blockBitmapLock;
+        else if (blocks[i] < (int)fs->superBlock.inodeTableStart)
+            lock = &fs->inodeBitmapLock;
+        else if (fs->superBlock.shareBlocks > 0 && blocks[i] >= (int)fs->superBlock.shareStart)
+            lock = &fs->shareLock;
+
+        if (lock != NULL)
+            pthread_mutex_lock(lock);
+        writeBlock(fs, blocks[i], metadataSource(fs, blocks[i]));
+        if (lock != NULL)
+            pthread_mutex_unlock(lock);
+    }
+    free(blocks);
+}
+
+// Collect all extents of an inode, in file order, into a newly allocated array; returns how many there are
+int getExtents(sfs_t *fs, int inode, _extent **extents)
+{
+    _inode_entry *entry = &fs->_inode_table[inode];
+    _extent_block overflow;
+    uint32_t n, next = entry->extentBlock;
+
+    *extents = malloc((entry->extentCount + 1) * sizeof(_extent));
+
+    n = entry->extentCount < inodeExtents ? entry->extentCount : inodeExtents;
+    memcpy(*extents, entry->ext, n * sizeof(_extent));
+
+    while (next != 0 && n < entry->extentCount)
+    {
+        readBlock(fs, next, (char *)&overflow);
+        memcpy(*extents + n, overflow.ext, overflow.count * sizeof(_extent));
+        n += overflow.count;
+        next = overflow.next;
+    }
+
+    return n;
+}
+
+// Map count more blocks starting at block to the end of an inode; the caller writes the inode
+// Returns 0 if an overflow extent block was needed and the disk is full
+int appendExtent(sfs_t *fs, int inode, int block, int count)
+{
+    _inode_entry *entry = &fs->_inode_table[inode];
+    _extent_block overflow;
+    _extent *last = NULL;
+    int tail = 0, fresh;
+
+    // the last extent is in the inode, or in the last overflow block
+    if (entry->extentCount > inodeExtents)
+    {
+        for (tail = entry->extentBlock; readBlock(fs, tail, (char *)&overflow) && overflow.next != 0; tail = overflow.next)
+            ;
+        last = &overflow.ext[overflow.count - 1];
+    }
+    else if (entry->extentCount > 0)
+        last = &entry->ext[entry->extentCount - 1];
+
+    // the run continues the last extent; just make it longer
+    if (last != NULL && last->start + last->length == (uint32_t)block)
+    {
+        last->length += count;
+        entry->blockCount += count;
+        if (tail != 0)
+            writeBlock(fs, tail, (char *)&overflow);
+        return 1;
+    }
+
+    if (entry->extentCount < inodeExtents)
+    {
+        entry->ext[entry->extentCount].start = block;
+        entry->ext[entry->extentCount].length = count;
+        entry->extentCount++;
+        entry->blockCount += count;
+        return 1;
+    }
+
+    // the extent goes to the overflow blocks; chain a new one if there is none yet or the last is full
+    if (tail == 0 || overflow.count == blockExtents)
+    {
+        if ((fresh = getBlock(fs, 0)) == -1)
+            return 0;
+
+        if (tail == 0)
+            entry->extentBlock = fresh;
+        else
+        {
+            overflow.next = fresh;
+            writeBlock(fs, tail, (char *)&overflow);
+        }
+        tail = fresh;
+        memset(&overflow, 0, sizeof(overflow));
+    }
+
+    overflow.ext[overflow.count].start = block;
+    overflow.ext[overflow.count].length = count;
+    overflow.count++;
+    writeBlock(fs, tail, (char *)&overflow);
+
+    entry->extentCount++;
+    entry->blockCount += count;
+    return 1;
+}
+
+// Make n extents, in file order, the whole mapping of an inode: the first inodeExtents go to the inode and the
+// rest to its overflow blocks, which are reused, chained on or freed as the count needs. The caller writes the
+// inode. Returns 0 if an overflow block was needed and the disk is full; the mapping is left as it was
+int setExtents(sfs_t *fs, int inode, _extent *extents, int n)
+{
+    _inode_entry *entry = &fs->_inode_table[inode];
+    _extent_block overflow;
+    int *chain, have, need, i, k, next;
+    uint32_t blocks = 0;
+
+    // overflow blocks are always full but the last
+    have = entry->extentCount > inodeExtents ? (entry->extentCount - inodeExtents + blockExtents - 1) / blockExtents : 0;
+    need = n > inodeExtents ? (n - inodeExtents + blockExtents - 1) / blockExtents : 0;
+    if ((chain = malloc(((have > need ? have : need) + 1) * sizeof(int))) == NULL)
+        return 0;
+
+    // the blocks of the chain as it is, then new ones for what it lacks
+    for (i = 0, next = entry->extentBlock; next != 0 && i < have; next = overflow.next)
+    {
+        chain[i++] = next;
+        readBlock(fs, next, (char *)&overflow);
+    }
+    for (; i < need; i++)
+    {
+        if ((chain[i] = getBlock(fs, i > 0 ? chain[i - 1] + 1 : 0)) == -1)
+        {
+            while (--i >= have)
+                returnBlock(fs, chain[i]);
+            free(chain);
+            return 0;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        blocks += extents[i].length;
+    memset(entry->ext, 0, sizeof(entry->ext));
+    memcpy(entry->ext, extents, (n < inodeExtents ? n : inodeExtents) * sizeof(_extent));
+    for (i = 0, k = inodeExtents; i < need; i++, k += blockExtents)
+    {
+        memset(&overflow, 0, sizeof(overflow));
+        overflow.next = i + 1 < need ? chain[i + 1] : 0;
+        overflow.count = n - k < blockExtents ? n - k : blockExtents;
+        memcpy(overflow.ext, extents + k, overflow.count * sizeof(_extent));
+        writeBlock(fs, chain[i], (char *)&overflow);
+    }
+    for (; i < have; i++)
+        returnBlock(fs, chain[i]);
+
+    entry->extentBlock = need > 0 ? chain[0] : 0;
+    entry->extentCount = n;
+    entry->blockCount = blocks;
+    free(chain);
+    return 1;
+}
+
+// Add a run of blocks to the end of n extents, as part of the last one if it continues it; returns the new count
+int addExtent(_extent *extents, int n, uint32_t start, uint32_t length)
+{
+    if (length == 0)
+        return n;
+    if (n > 0 && extents[n - 1].start + extents[n - 1].length == start)
+    {
+        extents[n - 1].length += length;
+        return n;
+    }
+
+    extents[n].start = start;
+    extents[n].length = length;
+    return n + 1;
+}
+
+// Unmap and free the last block of an inode; the caller writes the inode
+void removeLastBlock(sfs_t *fs, int inode)
+{
+    _inode_entry *entry = &fs->_inode_table[inode];
+    _extent_block overflow;
+    _extent *last;
+    int block, previous = 0, current;
+
+    if (entry->blockCount == 0)
+        return;
+
+    if (entry->extentCount <= inodeExtents)
+    {
+        last = &entry->ext[entry->extentCount - 1];
+        returnBlock(fs, last->start + last->length - 1);
+        if (--last->length == 0)
+            entry->extentCount--;
+        entry->blockCount--;
+        return;
+    }
+
+    // the last extent is in the last overflow block
+    for (current = entry->extentBlock; readBlock(fs, current, (char *)&overflow) && overflow.next != 0; current = overflow.next)
+        previous = current;
+
+    last = &overflow.ext[overflow.count - 1];
+    block = last->start + last->length - 1;
+    if (--last->length == 0)
+    {
+        overflow.count--;
+        entry->extentCount--;
+    }
+    entry->blockCount--;
+    returnBlock(fs, block);
+
+    if (overflow.count > 0)
+    {
+        writeBlock(fs, current, (char *)&overflow);
+        return;
+    }
+
+    // the overflow block is empty now; unlink and free it
+    if (previous == 0)
+        entry->extentBlock = 0;
+    else
+    {
+        readBlock(fs, previous, (char *)&overflow);
+        overflow.next = 0;
+        writeBlock(fs, previous, (char *)&overflow);
+    }
+    returnBlock(fs, current);
+}
+
+// Free every block mapped by an inode, and its overflow extent blocks; the caller writes the inode
+void freeExtents(sfs_t *fs, int inode)
+{
+    _inode_entry *entry = &fs->_inode_table[inode];
+    _extent_block overflow;
+    _extent *extents;
+    int i, n, next;
+
+    n = getExtents(fs, inode, &extents);
+    for (i = 0; i < n; i++)
+        returnBlocks(fs, extents[i].start, extents[i].length);
+    free(extents);
+
+    for (next = entry->extentBlock; next != 0; next = overflow.next)
+    {
+        readBlock(fs, next, (char *)&overflow);
+        returnBlock(fs, next);
+    }
+
+    entry->extentCount = 0;
+    entry->blockCount = 0;
+    entry->extentBlock = 0;
+    entry->flags &= ~inodeFlagInline;
+    memset(entry->ext, 0, sizeof(entry->ext));
+}
+
+// Return the block holding logical block number logical of an inode, or 0 if it is not mapped
+int mapBlock(sfs_t *fs, int inode, uint32_t logical)
+{
+    _inode_entry *entry = &fs->_inode_table[inode];
+    _extent_block overflow;
+    uint32_t i, next;
+
+    for (i = 0; i < entry->extentCount && i < inodeExtents; i++)
+    {
+        if (logical < entry->ext[i].length)
+            return entry->ext[i].start + logical;
+        logical -= entry->ext[i].length;
+    }
+
+    for (next = entry->extentBlock; next != 0; next = overflow.next)
+    {
+        readBlock(fs, next, (char *)&overflow);
+        for (i = 0; i < overflow.count; i++)
+        {
+            if (logical < overflow.ext[i].length)
+                return overflow.ext[i].start + logical;
+            logical -= overflow.ext[i].length;
+        }
+    }
+
+    return 0;
+}
+
+// Fill blocks with the directory blocks of an inode, in order; returns how many there are
+int directoryBlocks(sfs_t *fs, int inode, int *blocks)
+{
+    _extent *extents;
+    int i, n, count = 0;
+    uint32_t b;
+
+    n = getExtents(fs, inode, &extents);
+    for (i = 0; i < n; i++)
+    {
+        for (b = 0; b < extents[i].length && count < maxDirectoryBlocks; b++)
+            blocks[count++] = extents[i].start + b;
+    }
+    free(extents);
+
+    return count;
+}
+
+// Drop an empty directory block; the last block takes its place so the directory stays dense
+void dropDirectoryBlock(sfs_t *fs, int inode, int index, int *blocks, int count)
+{
+    char buffer[1024];
+
+    if (index != count - 1)
+    {
+        readBlock(fs, blocks[count - 1], buffer);
+        writeBlock(fs, blocks[index], buffer);
+    }
+
+    removeLastBlock(fs, inode);
+    writeInode(fs, inode);
+}
+
+// Hash a name for the directory index (FNV-1a)
+uint32_t nameHash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < maxNameLength && name[i] != 0; i++)
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+
+    return hash;
+}
+
+// Read an index slot of an indexed directory
+void readSlot(sfs_t *fs, int inode, uint32_t slot, _dir_slot *out)
+{
+    _dir_slot slots[slotsPerBlock];
+
+    readBlock(fs, mapBlock(fs, inode, 1 + slot / slotsPerBlock), (char *)slots);
+    *out = slots[slot % slotsPerBlock];
+}
+
+// Write an index slot of an indexed directory
+void writeSlot(sfs_t *fs, int inode, uint32_t slot, _dir_slot *in)
+{
+    _dir_slot slots[slotsPerBlock];
+    int block = mapBlock(fs, inode, 1 + slot / slotsPerBlock);
+
+    readBlock(fs, block, (char *)slots);
+    slots[slot % slotsPerBlock] = *in;
+    writeBlock(fs, block, (char *)slots);
+}
+
+// Look up a name in a directory; returns the inode it names and where the entry is, or -1
+// Linear directories are scanned; indexed ones only read the one bucket the name hashes to
+int findEntry(sfs_t *fs, int inode, char *name, _entry_location *where)
+{
+    _directory_entry buffer[4], *entries;
+    _dir_header header;
+    _dir_slot slot;
+    int blocks[maxDirectoryBlocks], nblocks;
+    int i, j;
+
+    if (fs->_inode_table[inode].flags & inodeFlagIndexed)
+    {
+        readBlock(fs, mapBlock(fs, inode, 0), (char *)&header);
+        readSlot(fs, inode, nameHash(name) & ((1u << header.depth) - 1), &slot);
+        blocks[0] = slot.bucket;
+        nblocks = 1;
+    }
+    else
+        nblocks = directoryBlocks(fs, inode, blocks);
+
+    for (i = 0; i < nblocks; i++)
+    {
+        entries = (_directory_entry *)blockData(fs, blocks[i], 1, (char *)buffer);
+
+        for (j = 0; j < 4; j++)
+        {
+            if (entries[j].F == 1 && strncmp(name, entries[j].fname, maxNameLength) == 0)
+            {
+                if (where != NULL)
+                {
+                    where->block = blocks[i];
+                    where->slot = j;
+                    where->index = (fs->_inode_table[inode].flags & inodeFlagIndexed) ? -1 : i;
+                }
+                return entries[j].MMM;
+            }
+        }
+    }
+
+    return -1;
+}
+
+// Store a name of at most maxNameLength bytes in a directory entry, padded with NULs; a name of exactly
+// maxNameLength bytes fills the field and has none
+void nameEntry(_directory_entry *entry, const char *name)
+{
+    size_t length = strlen(name);
+
+    memcpy(entry->fname, name, length);
+    memset(entry->fname + length, 0, maxNameLength - length);
+}
+
+// Add a name to a directory; the caller made sure it is not there yet
+// Returns 1, 0 if the disk is full or -1 if the directory cannot take more names
+int addEntry(sfs_t *fs, int inode, char *name, int target)
+{
+    _directory_entry entries[4];
+    int blocks[maxDirectoryBlocks], nblocks;
+    int i, j, block, ret;
+
+    if (!(fs->_inode_table[inode].flags & inodeFlagIndexed))
+    {
+        nblocks = directoryBlocks(fs, inode, blocks);
+
+        // take the first unused entry
+        for (i = 0; i < nblocks; i++)
+        {
+            readBlock(fs, blocks[i], (char *)entries);
+            for (j = 0; j < 4; j++)
+            {
+                if (entries[j].F == 0)
+                {
+                    entries[j].F = 1;
+                    nameEntry(&entries[j], name);
+                    entries[j].MMM = target;
+                    writeBlock(fs, blocks[i], (char *)entries);
+                    rememberName(fs, inode, name, target);
+                    return 1;
+                }
+            }
+        }
+
+        // or grow the directory by a block
+        if (nblocks < maxDirectoryBlocks)
+        {
+            if ((block = getBlock(fs, nblocks > 0 ? blocks[nblocks - 1] + 1 : 0)) == -1)
+                return 0;
+
+            memset(entries, 0, sizeof(entries));
+            entries[0].F = 1;
+            nameEntry(&entries[0], name);
+            entries[0].MMM = target;
+            writeBlock(fs, block, (char *)entries);
+
+            appendExtent(fs, inode, block, 1);
+            writeInode(fs, inode);
+            rememberName(fs, inode, name, target);
+            return 1;
+        }
+
+        // a full linear directory turns into an indexed one
+        if ((ret = indexDirectory(fs, inode)) != 1)
+            return ret;
+    }
+
+    return addIndexedEntry(fs, inode, name, target);
+}
+
+// Add a name to an indexed directory, splitting its bucket as often as needed
+int addIndexedEntry(sfs_t *fs, int inode, char *name, int target)
+{
+    _directory_entry entries[4];
+    _dir_header header;
+    _dir_slot slot;
+    uint32_t hash = nameHash(name);
+    int j, ret;
+
+    readBlock(fs, mapBlock(fs, inode, 0), (char *)&header);
+
+    while (1)
+    {
+        readSlot(fs, inode, hash & ((1u << header.depth) - 1), &slot);
+        readBlock(fs, slot.bucket, (char *)entries);
+
+        for (j = 0; j < 4; j++)
+        {
+            if (entries[j].F == 0)
+            {
+                entries[j].F = 1;
+                nameEntry(&entries[j], name);
+                entries[j].MMM = target;
+                writeBlock(fs, slot.bucket, (char *)entries);
+
+                header.entries++;
+                writeBlock(fs, mapBlock(fs, inode, 0), (char *)&header);
+                rememberName(fs, inode, name, target);
+                return 1;
+            }
+        }
+
+        // the bucket is full; if no other slot points at it the index must double first
+        if (slot.depth == header.depth)
+        {
+            if (header.depth == maxDirectoryDepth)
+                return -1;
+            if ((ret = growIndex(fs, inode, &header)) != 1)
+                return ret;
+        }
+
+        if ((ret = splitBucket(fs, inode, &header, hash, &slot)) != 1)
+            return ret;
+    }
+}
+
+// Double the index of an indexed directory; the new upper half repeats the lower half
+int growIndex(sfs_t *fs, int inode, _dir_header *header)
+{
+    _dir_slot slots[slotsPerBlock];
+    uint32_t oldSlots = 1u << header->depth, i;
+    uint32_t oldBlocks = (oldSlots + slotsPerBlock - 1) / slotsPerBlock;
+    uint32_t newBlocks = (2 * oldSlots + slotsPerBlock - 1) / slotsPerBlock;
+    int block;
+
+    // the index blocks follow the header in the extent map
+    while (fs->_inode_table[inode].blockCount - 1 < newBlocks)
+    {
+        if ((block = getBlock(fs, mapBlock(fs, inode, fs->_inode_table[inode].blockCount - 1) + 1)) == -1 || !appendExtent(fs, inode, block, 1))
+        {
+            if (block != -1)
+                returnBlock(fs, block);
+            writeInode(fs, inode);
+            return 0;
+        }
+    }
+    writeInode(fs, inode);
+
+    if (oldBlocks == newBlocks)
+    {
+        // both halves fit in the first index block
+        readBlock(fs, mapBlock(fs, inode, 1), (char *)slots);
+        memcpy(slots + oldSlots, slots, oldSlots * sizeof(_dir_slot));
+        writeBlock(fs, mapBlock(fs, inode, 1), (char *)slots);
+    }
+    else
+    {
+        for (i = 0; i < oldBlocks; i++)
+        {
+            readBlock(fs, mapBlock(fs, inode, 1 + i), (char *)slots);
+            writeBlock(fs, mapBlock(fs, inode, 1 + oldBlocks + i), (char *)slots);
+        }
+    }
+
+    header->depth++;
+    writeBlock(fs, mapBlock(fs, inode, 0), (char *)header);
+    return 1;
+}
+
+// Split the bucket a hash lands in by the next hash bit, and repoint the slots that shared it
+int splitBucket(sfs_t *fs, int inode, _dir_header *header, uint32_t hash, _dir_slot *slot)
+{
+    _directory_entry entries[4], low[4], high[4];
+    _dir_slot updated;
+    uint32_t depth = slot->depth, j;
+    int lowCount = 0, highCount = 0, i, block;
+
+    if ((block = getBlock(fs, slot->bucket + 1)) == -1)
+        return 0;
+
+    readBlock(fs, slot->bucket, (char *)entries);
+    memset(low, 0, sizeof(low));
+    memset(high, 0, sizeof(high));
+    for (i = 0; i < 4; i++)
+    {
+        if ((nameHash(entries[i].fname) >> depth) & 1)
+            high[highCount++] = entries[i];
+        else
+            low[lowCount++] = entries[i];
+    }
+    writeBlock(fs, slot->bucket, (char *)low);
+    writeBlock(fs, block, (char *)high);
+
+    // every 2^depth-th slot starting at the hash's low bits pointed at the old bucket
+    updated.depth = depth + 1;
+    for (j = hash & ((1u << depth) - 1); j < (1u << header->depth); j += 1u << depth)
+    {
+        updated.bucket = ((j >> depth) & 1) ? (uint32_t)block : slot->bucket;
+        writeSlot(fs, inode, j, &updated);
+    }
+
+    header->buckets++;
+    writeBlock(fs, mapBlock(fs, inode, 0), (char *)header);
+    return 1;
+}
+
+// Turn a full linear directory into an indexed one and move its names over
+int indexDirectory(sfs_t *fs, int inode)
+{
+    _directory_entry entries[maxDirectoryBlocks * 4];
+    _dir_header header;
+    _dir_slot slots[slotsPerBlock];
+    int blocks[maxDirectoryBlocks], nblocks;
+    int headerBlock, indexBlock, bucket;
+    int i, n = 0;
+
+    // room for the header, the index, the first bucket and the splits the old names cause
+    if (fs->freeDiskBlocks < 3 + maxDirectoryBlocks * 2)
+        return 0;
+
+    nblocks = directoryBlocks(fs, inode, blocks);
+    for (i = 0; i < nblocks; i++)
+        readBlock(fs, blocks[i], (char *)&entries[4 * i]);
+    n = 4 * nblocks;
+
+    headerBlock = getBlock(fs, 0);
+    indexBlock = getBlock(fs, headerBlock + 1);
+    bucket = getBlock(fs, indexBlock + 1);
+
+    freeExtents(fs, inode);
+    fs->_inode_table[inode].flags |= inodeFlagIndexed;
+    appendExtent(fs, inode, headerBlock, 1);
+    appendExtent(fs, inode, indexBlock, 1);
+    writeInode(fs, inode);
+
+    memset(&header, 0, sizeof(header));
+    header.buckets = 1;
+    writeBlock(fs, headerBlock, (char *)&header);
+
+    memset(slots, 0, sizeof(slots));
+    slots[0].bucket = bucket;
+    writeBlock(fs, indexBlock, (char *)slots);
+    writeBlock(fs, bucket, NULL);
+
+    for (i = 0; i < n; i++)
+    {
+        if (entries[i].F == 1)
+            addIndexedEntry(fs, inode, entries[i].fname, entries[i].MMM);
+    }
+
+    return 1;
+}
+
+// Clear a directory entry found by findEntry()
+void removeEntry(sfs_t *fs, int inode, _entry_location *where)
+{
+    _directory_entry entries[4];
+    _dir_header header;
+    int blocks[maxDirectoryBlocks], nblocks;
+    int j, used = 0;
+
+    readBlock(fs, where->block, (char *)entries);
+    entries[where->slot].F = 0;
+    writeBlock(fs, where->block, (char *)entries);
+    rememberName(fs, inode, entries[where->slot].fname, -1);
+
+    if (fs->_inode_table[inode].flags & inodeFlagIndexed)
+    {
+        readBlock(fs, mapBlock(fs, inode, 0), (char *)&header);
+        header.entries--;
+        writeBlock(fs, mapBlock(fs, inode, 0), (char *)&header);
+        return;
+    }
+
+    // a linear directory gives back blocks that become empty
+    for (j = 0; j < 4; j++)
+        used += entries[j].F;
+    if (used == 0)
+    {
+        nblocks = directoryBlocks(fs, inode, blocks);
+        dropDirectoryBlock(fs, inode, where->index, blocks, nblocks);
+    }
+}
+
+// Call visit for every used entry of a directory
+void walkDirectory(sfs_t *fs, int inode, void (*visit)(sfs_t *, _directory_entry *, void *), void *arg)
+{
+    _directory_entry buffer[4], *entries;
+    _dir_header header;
+    _dir_slot slotBuffer[slotsPerBlock], *slots = NULL;
+    int blocks[maxDirectoryBlocks], nblocks;
+    uint32_t i, j;
+
+    if (!(fs->_inode_table[inode].flags & inodeFlagIndexed))
+    {
+        nblocks = directoryBlocks(fs, inode, blocks);
+        for (i = 0; i < (uint32_t)nblocks; i++)
+        {
+            entries = (_directory_entry *)blockData(fs, blocks[i], 1, (char *)buffer);
+            for (j = 0; j < 4; j++)
+            {
+                if (entries[j].F == 1)
+                    visit(fs, &entries[j], arg);
+            }
+        }
+        return;
+    }
+
+    // a bucket of depth d is pointed at by slots d apart; it is visited at the first of them
+    readBlock(fs, mapBlock(fs, inode, 0), (char *)&header);
+    for (i = 0; i < (1u << header.depth); i++)
+    {
+        if (i % slotsPerBlock == 0)
+            slots = (_dir_slot *)blockData(fs, mapBlock(fs, inode, 1 + i / slotsPerBlock), 1, (char *)slotBuffer);
+        if (i >= (1u << slots[i % slotsPerBlock].depth))
+            continue;
+
+        entries = (_directory_entry *)blockData(fs, slots[i % slotsPerBlock].bucket, 1, (char *)buffer);
+        for (j = 0; j < 4; j++)
+        {
+            if (entries[j].F == 1)
+                visit(fs, &entries[j], arg);
+        }
+    }
+}
+
+// Free the blocks of a directory; its entries must have been dealt with already
+void freeDirectory(sfs_t *fs, int inode)
+{
+    _dir_header header;
+    _dir_slot slots[slotsPerBlock];
+    uint32_t i;
+
+    if (fs->_inode_table[inode].flags & inodeFlagIndexed)
+    {
+        readBlock(fs, mapBlock(fs, inode, 0), (char *)&header);
+        for (i = 0; i < (1u << header.depth); i++)
+        {
+            if (i % slotsPerBlock == 0)
+                readBlock(fs, mapBlock(fs, inode, 1 + i / slotsPerBlock), (char *)slots);
+            if (i < (1u << slots[i % slotsPerBlock].depth))
+                returnBlock(fs, slots[i % slotsPerBlock].bucket);
+        }
+    }
+
+    freeExtents(fs, inode);
+    fs->_inode_table[inode].flags &= ~inodeFlagIndexed;
+}
+
+// Allocate the dentry cache and the inode generations
+sfs_status initDentryCache(sfs_t *fs)
+{
+    int i;
+
+    fs->_dentry_cache = malloc(dentryCacheSize * sizeof(_dentry));
+    fs->inodeGeneration = calloc(fs->INB, sizeof(uint32_t));
+    if (fs->_dentry_cache == NULL || fs->inodeGeneration == NULL)
+        return SFS_ENOMEM;
+
+    for (i = 0; i < dentryCacheSize; i++)
+        fs->_dentry_cache[i].parent = -1;
+
+    return SFS_OK;
+}
+
+// Return the dentry cache entry a name in a directory hashes to
+int dentrySlot(int parent, const char *name)
+{
+    return (nameHash(name) ^ (uint32_t)parent * 2654435761u) & (dentryCacheSize - 1);
+}
+
+// Record what a name in a directory refers to; -1 records that it does not exist
+void rememberName(sfs_t *fs, int parent, char *name, int inode)
+{
+    int slot = dentrySlot(parent, name);
+    _dentry *entry = &fs->_dentry_cache[slot];
+
+    pthread_rwlock_wrlock(&fs->dentryLocks[slot & (dentryLockCount - 1)]);
+    entry->parent = parent;
+    entry->generation = fs->inodeGeneration[parent];
+    entry->inode = inode;
+    strncpy(entry->name, name, maxNameLength);
+    entry->name[maxNameLength] = 0;
+    pthread_rwlock_unlock(&fs->dentryLocks[slot & (dentryLockCount - 1)]);
+}
+
+// Look up a name in a directory through the dentry cache; returns the inode or -1
+int lookupName(sfs_t *fs, int parent, char *name)
+{
+    int slot = dentrySlot(parent, name), hit, inode;
+    _dentry *entry = &fs->_dentry_cache[slot];
+
+    // the caller has parent locked, so its entries cannot change meanwhile
+    pthread_rwlock_rdlock(&fs->dentryLocks[slot & (dentryLockCount - 1)]);
+    hit = entry->parent == parent && entry->generation == fs->inodeGeneration[parent] && strncmp(entry->name, name, maxNameLength) == 0;
+    inode = entry->inode;
+    pthread_rwlock_unlock(&fs->dentryLocks[slot & (dentryLockCount - 1)]);
+
+    if (hit)
+    {
+        countEvent(fs->dentryHits, 1);
+        return inode;
+    }
+
+    countEvent(fs->dentryMisses, 1);
+    inode = findEntry(fs, parent, name, NULL);
+    rememberName(fs, parent, name, inode);
+    return inode;
+}
+
+// Turn a path into an absolute one without empty, "." and ".." components; relative paths start at cwd
+// Returns 0 if a name or the whole path is too long
+int normalizePath(const char *cwd, const char *path, char *out)
+{
+    size_t len = 0, n;
+    const char *p = path, *slash;
+
+    // out holds "" for the root while it is built
+    if (path[0] != '/' && strcmp(cwd, "/") != 0)
+    {
+        strcpy(out, cwd);
+        len = strlen(out);
+    }
+    out[len] = 0;
+
+    while (*p != 0)
+    {
+        slash = strchr(p, '/');
+        n = slash != NULL ? (size_t)(slash - p) : strlen(p);
+
+        if (n == 2 && strncmp(p, "..", 2) == 0)
+        {
+            // the parent of the root is the root
+            while (len > 0 && out[--len] != '/')
+                ;
+            out[len] = 0;
+        }
+        else if (n > 0 && !(n == 1 && p[0] == '.'))
+        {
+            if (n > maxNameLength || len + 1 + n >= maxPathLength)
+                return 0;
+            out[len++] = '/';
+            memcpy(out + len, p, n);
+            len += n;
+            out[len] = 0;
+        }
+
+        p += slash != NULL ? n + 1 : n;
+    }
+
+    if (len == 0)
+        strcpy(out, "/");
+    return 1;
+}
+
+// Copy the path of the current directory into cwd; returns its inode, and its generation in generation
+int currentDirectory(sfs_t *fs, char *cwd, uint32_t *generation)
+{
+    int inode;
+
+    pthread_mutex_lock(&fs->cwdLock);
+    strcpy(cwd, fs->currrentWorkingDirectory);
+    inode = fs->currentDirectoryInode;
+    *generation = fs->currentDirectoryGeneration;
+    pthread_mutex_unlock(&fs->cwdLock);
+
+    return inode;
+}
+
+// Return how resolvePath() locks a directory when what is left of the path below it is rest: the leaf
+// gets leafMode, the parent of the leaf at least a shared lock and every directory above it a shared one
+int walkMode(const char *rest, int parentMode, int leafMode)
+{
+    if (rest[0] == 0 || rest[1] == 0)
+        return leafMode;
+    if (strchr(rest + 1, '/') == NULL)
+        return parentMode > lockShared ? parentMode : lockShared;
+    return lockShared;
+}
+
+// Resolve a path to an inode; found gets it, or -1 if only the last name is missing; fails if the path is bad
+// parent gets the directory holding the last name and leaf the name itself; a path naming the root leaves leaf empty
+// The walk locks each directory before letting go of the one above it. On success found is left locked in
+// leafMode and parent in parentMode (releasePath() undoes both); on failure nothing is left locked.
+sfs_status resolvePath(sfs_t *fs, const char *path, int parentMode, int leafMode, int *parent, char *leaf, int *found)
+{
+    char cwd[maxPathLength], full[maxPathLength];
+    char *p, *slash;
+    size_t cwdLength, n;
+    uint32_t generation;
+    int inode = 0, start, mode, next, nextMode;
+
+    *parent = -1;
+    *found = -1;
+    leaf[0] = 0;
+
+    start = currentDirectory(fs, cwd, &generation);
+    if (!normalizePath(cwd, path, full))
+        return SFS_ENAMETOOLONG;
+
+    // a path inside the current directory is walked from there rather than from the root
+    p = full;
+    cwdLength = strlen(cwd);
+    if (cwdLength > 1 && strncmp(full, cwd, cwdLength) == 0 && (full[cwdLength] == '/' || full[cwdLength] == 0))
+    {
+        inode = start;
+        p = full + cwdLength;
+    }
+
+    mode = walkMode(p, parentMode, leafMode);
+    lockInode(fs, inode, mode);
+
+    // the current directory was removed and freed since it was entered
+    if (inode == start && inode != 0 && fs->inodeGeneration[inode] != generation)
+    {
+        unlockInode(fs, inode, mode);
+        return SFS_ENOENT;
+    }
+
+    while (*p == '/' && p[1] != 0)
+    {
+        p++;
+        slash = strchr(p, '/');
+        n = slash != NULL ? (size_t)(slash - p) : strlen(p);
+        memcpy(leaf, p, n);
+        leaf[n] = 0;
+        p += n;
+
+        if (fs->_inode_table[inode].TT[0] != 'D')
+        {
+            unlockInode(fs, inode, mode);
+            return SFS_ENOTDIR;
+        }
+
+        next = lookupName(fs, inode, leaf);
+        if (next == -1)
+        {
+            if (*p != 0)
+            {
+                unlockInode(fs, inode, mode);
+                return SFS_ENOENT;
+            }
+
+            if (parentMode == lockNone)
+                unlockInode(fs, inode, mode);
+            *parent = inode;
+            return SFS_OK;
+        }
+
+        nextMode = walkMode(p, parentMode, leafMode);
+        lockInode(fs, next, nextMode);
+        if (*p != 0 || parentMode == lockNone)
+            unlockInode(fs, inode, mode);
+
+        *parent = inode;
+        inode = next;
+        mode = nextMode;
+    }
+
+    *found = inode;
+    return SFS_OK;
+}
+
+// Let go of what a successful resolvePath() left locked
+void releasePath(sfs_t *fs, int parent, int parentMode, int found, int leafMode)
+{
+    if (found != -1)
+        unlockInode(fs, found, leafMode);
+    if (parent != -1)
+        unlockInode(fs, parent, parentMode);
+}
+
+// Set up the locks that do not depend on the image
+void initLocks(sfs_t *fs)
+{
+    pthread_rwlockattr_t attributes;
+    int i;
+
+    // a commit or a change waits for readers already in, but new readers queue up behind it
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+    pthread_rwlock_init(&fs->opLock, &attributes);
+    pthread_mutex_init(&fs->cwdLock, NULL);
+    pthread_mutex_init(&fs->blockBitmapLock, NULL);
+    pthread_mutex_init(&fs->inodeBitmapLock, NULL);
+    pthread_mutex_init(&fs->deferLock, NULL);
+    pthread_mutex_init(&fs->reclaimLock, NULL);
+    pthread_mutex_init(&fs->shareLock, NULL);
+    pthread_rwlock_init(&fs->journalLock, NULL);
+    pthread_rwlock_init(&fs->cacheLock, NULL);
+    for (i = 0; i < dentryLockCount; i++)
+        pthread_rwlock_init(&fs->dentryLocks[i], NULL);
+
+    pthread_rwlockattr_destroy(&attributes);
+}
+
+// Set up a lock and an open-file count per inode; needs the inode count of the mounted image
+sfs_status initInodeLocks(sfs_t *fs)
+{
+    pthread_rwlockattr_t attributes;
+
+    fs->inodeLocks = malloc(fs->INB * sizeof(pthread_rwlock_t));
+    fs->openCount = calloc(fs->INB, sizeof(int));
+    if (fs->inodeLocks == NULL || fs->openCount == NULL)
+        return SFS_ENOMEM;
+
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (fs->inodeLockCount = 0; fs->inodeLockCount < fs->INB; fs->inodeLockCount++)
+        pthread_rwlock_init(&fs->inodeLocks[fs->inodeLockCount], &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+
+    return SFS_OK;
+}
+
+void destroyLocks(sfs_t *fs)
+{
+    int i;
+
+    for (i = 0; i < fs->inodeLockCount; i++)
+        pthread_rwlock_destroy(&fs->inodeLocks[i]);
+    free(fs->inodeLocks);
+
+    pthread_rwlock_destroy(&fs->opLock);
+    pthread_mutex_destroy(&fs->cwdLock);
+    pthread_mutex_destroy(&fs->blockBitmapLock);
+    pthread_mutex_destroy(&fs->inodeBitmapLock);
+    pthread_mutex_destroy(&fs->deferLock);
+    pthread_mutex_destroy(&fs->reclaimLock);
+    pthread_mutex_destroy(&fs->shareLock);
+    pthread_rwlock_destroy(&fs->journalLock);
+    pthread_rwlock_destroy(&fs->cacheLock);
+    for (i = 0; i < dentryLockCount; i++)
+        pthread_rwlock_destroy(&fs->dentryLocks[i]);
+}
+
+// Lock an inode shared or exclusive; lockNone does nothing
+void lockInode(sfs_t *fs, int inode, int mode)
+{
+    if (mode == lockShared)
+        pthread_rwlock_rdlock(&fs->inodeLocks[inode]);
+    else if (mode == lockExclusive)
+        pthread_rwlock_wrlock(&fs->inodeLocks[inode]);
+}
+
+void unlockInode(sfs_t *fs, int inode, int mode)
+{
+    if (mode != lockNone)
+        pthread_rwlock_unlock(&fs->inodeLocks[inode]);
+}
+
+// Return the 64 bitmap bits starting at bit 64 * word; bit i of the result is bit 64 * word + i
+uint64_t bitmapWord(const unsigned char *map, int word)
+{
+    uint64_t bits;
+
+    memcpy(&bits, map + (size_t)word * 8, 8); // the image is little-endian, so byte order matches bit order
+    return bits;
+}
+
+// Count the set bits of a bitmap in [from, to), a word at a time
+int countUsed(const unsigned char *map, int from, int to)
+{
+    int i, used = 0;
+    uint64_t bits;
+
+    for (i = from & ~63; i < to; i += 64)
+    {
+        bits = bitmapWord(map, i >> 6);
+        if (i < from)
+            bits &= ~0ull << (from - i);
+        if (to - i < 64)
+            bits &= (1ull << (to - i)) - 1;
+        used += __builtin_popcountll(bits);
+    }
+
+    return used;
+}
+
+// Count the clear bits of every group of bitsPerBlock bits into a newly allocated array
+int *groupFreeCounts(const unsigned char *map, int bits)
+{
+    int groups = (bits + bitsPerBlock - 1) / bitsPerBlock, g, end;
+    int *counts = malloc(groups * sizeof(int));
+
+    if (counts == NULL)
+    {
+        outOfMemory();
+    }
+
+    for (g = 0; g < groups; g++)
+    {
+        end = (g + 1) * bitsPerBlock < bits ? (g + 1) * bitsPerBlock : bits;
+        counts[g] = end - g * bitsPerBlock - countUsed(map, g * bitsPerBlock, end);
+    }
+
+    return counts;
+}
+
+// Add up the free counts of groups groups
+int sumCounts(const int *counts, int groups)
+{
+    int g, total = 0;
+
+    for (g = 0; g < groups; g++)
+        total += counts[g];
+    return total;
+}
+
+// Return the first clear bit in [from, to), or -1; groups without free entries are skipped whole
+int scanFree(const unsigned char *map, const int *groupFree, int from, int to)
+{
+    int i = from, found;
+    uint64_t bits;
+
+    while (i < to)
+    {
+        if (groupFree[i / bitsPerBlock] == 0)
+        {
+            i = (i / bitsPerBlock + 1) * bitsPerBlock;
+            continue;
+        }
+
+        bits = ~bitmapWord(map, i >> 6) & (~0ull << (i & 63));
+        if (bits != 0)
+        {
+            found = (i & ~63) + __builtin_ctzll(bits);
+            return found < to ? found : -1;
+        }
+        i = (i | 63) + 1;
+    }
+
+    return -1;
+}
+
+// Return how many clear bits follow start (itself clear), stopping at to or after max
+int freeRunLength(const unsigned char *map, int start, int to, int max)
+{
+    int i = start;
+    uint64_t bits;
+
+    while (i < to && i - start < max)
+    {
+        bits = bitmapWord(map, i >> 6) >> (i & 63);
+        if (bits != 0)
+        {
+            i += __builtin_ctzll(bits);
+            break;
+        }
+        i = (i | 63) + 1;
+    }
+
+    if (i > to)
+        i = to;
+    return i - start < max ? i - start : max;
+}
+
+// Mark a run of blocks used (or free) and write each bitmap block it touches once; the caller holds blockBitmapLock
+void markBlocks(sfs_t *fs, int start, int count, int used)
+{
+    int i;
+
+    for (i = start; i < start + count; i++)
+    {
+        if (used)
+            setBit(fs->_block_bitmap, i);
+        else
+            clearBit(fs->_block_bitmap, i);
+        fs->blockGroupFree[i / bitsPerBlock] += used ? -1 : 1;
+
+        if (i == start + count - 1 || (i + 1) % bitsPerBlock == 0)
+            writeBlockBitmap(fs, i);
+    }
+
+    fs->freeDiskBlocks += used ? -count : count;
+    if (!used && fs->superBlock.journalBlocks > 0)
+    {
+        pthread_rwlock_wrlock(&fs->journalLock);
+        rememberFreed(fs, start, count);
+        pthread_rwlock_unlock(&fs->journalLock);
+    }
+}
+
+// Return first available block index at or after goal; wraps around to the start of the disk
+// Passing the block after a file's last block keeps the file in one extent
+int getBlock(sfs_t *fs, int goal)
+{
+    int length;
+
+    return getBlocks(fs, goal, 1, &length);
+}
+
+// Allocate up to count consecutive blocks; returns the first one and stores how many were taken in length
+// The first run of count free blocks at or after goal is taken; failing that, the longest run on the disk
+// Without a goal the search continues where the previous one left off (next fit)
+int getBlocks(sfs_t *fs, int goal, int count, int *length)
+{
+    int best = -1, bestLength = 0;
+    int pass, from, to, i, n, shortage, waiting;
+
+    *length = 0;
+    if (count <= 0)
+        return -1;
+
+    // space still held by orphans is needed now
+    pthread_mutex_lock(&fs->blockBitmapLock);
+    shortage = fs->freeDiskBlocks < count;
+    pthread_mutex_unlock(&fs->blockBitmapLock);
+    if (shortage)
+    {
+        pthread_mutex_lock(&fs->reclaimLock);
+        waiting = fs->reclaimCount > 0;
+        pthread_mutex_unlock(&fs->reclaimLock);
+        if (waiting)
+            reclaimOrphans(fs, -1);
+    }
+
+    pthread_mutex_lock(&fs->blockBitmapLock);
+    if (fs->freeDiskBlocks == 0)
+    {
+        pthread_mutex_unlock(&fs->blockBitmapLock);
+        return -1;
+    }
+
+    if (goal < (int)fs->superBlock.dataStart || goal >= fs->BLB)
+        goal = fs->blockHint;
+
+    // first from goal to the end of the disk, then from the start of the data area up to goal
+    for (pass = 0; pass < 2 && bestLength < count; pass++)
+    {
+        from = pass == 0 ? goal : (int)fs->superBlock.dataStart;
+        to = pass == 0 ? fs->BLB : goal;
+
+        for (i = from; i < to && (i = scanFree(fs->_block_bitmap, fs->blockGroupFree, i, to)) != -1; i += n)
+        {
+            n = freeRunLength(fs->_block_bitmap, i, to, count);
+            if (n > bestLength)
+            {
+                best = i;
+                bestLength = n;
+                if (n == count)
+                    break;
+            }
+        }
+    }
+
+    if (best == -1)
+    {
+        pthread_mutex_unlock(&fs->blockBitmapLock);
+        return -1;
+    }
+    markBlocks(fs, best, bestLength, 1);
+
+    fs->blockHint = best + bestLength < fs->BLB ? best + bestLength : (int)fs->superBlock.dataStart;
+    pthread_mutex_unlock(&fs->blockBitmapLock);
+
+    *length = bestLength;
+    return best;
+}
+
+// Free unused block
+void returnBlock(sfs_t *fs, int index)
+{
+    returnBlocks(fs, index, 1);
+}
+
+// Free a run of unused blocks; a block other files still share only loses a reference and stays in use, and
+// a block a snapshot holds stays in use as long as the snapshot does
+void returnBlocks(sfs_t *fs, int start, int count)
+{
+    int i, from = 0;
+
+    if (start < (int)fs->superBlock.dataStart || count <= 0 || start + count > fs->BLB)
+        return;
+
+    for (i = 0; (fs->_share_table != NULL || fs->heldBitmap != NULL) && i < count; i++)
+    {
+        if ((fs->_share_table != NULL && keepShared(fs, start + i)) || isHeld(fs, start + i))
+        {
+            freeBlocks(fs, start + from, i - from);
+            from = i + 1;
+        }
+    }
+    freeBlocks(fs, start + from, count - from);
+}
+
+// Mark a run of blocks free
+void freeBlocks(sfs_t *fs, int start, int count)
+{
+    if (count > 0)
+    {
+        pthread_mutex_lock(&fs->blockBitmapLock);
+        markBlocks(fs, start, count, 0);
+        pthread_mutex_unlock(&fs->blockBitmapLock);
+    }
+}
+
+// Return first available inode, searching on from the last one handed out
+int getInode(sfs_t *fs)
+{
+    int i, waiting;
+
+    pthread_mutex_lock(&fs->inodeBitmapLock);
+    if (fs->freeInodeEntries == 0)
+    {
+        pthread_mutex_unlock(&fs->inodeBitmapLock);
+
+        pthread_mutex_lock(&fs->reclaimLock);
+        waiting = fs->reclaimCount > 0;
+        pthread_mutex_unlock(&fs->reclaimLock);
+        if (waiting)
+            reclaimOrphans(fs, -1);
+
+        pthread_mutex_lock(&fs->inodeBitmapLock);
+    }
+    if (fs->freeInodeEntries == 0)
+    {
+        pthread_mutex_unlock(&fs->inodeBitmapLock);
+        return -1;
+    }
+
+    i = scanFree(fs->_inode_bitmap, fs->inodeGroupFree, fs->inodeHint, fs->INB);
+    if (i == -1)
+        i = scanFree(fs->_inode_bitmap, fs->inodeGroupFree, 0, fs->inodeHint);
+
+    setBit(fs->_inode_bitmap, i);
+    fs->inodeGroupFree[i / bitsPerBlock]--;
+    fs->freeInodeEntries--;
+    fs->inodeHint = i + 1 < fs->INB ? i + 1 : 0;
+
+    writeInodeBitmap(fs, i);
+    pthread_mutex_unlock(&fs->inodeBitmapLock);
+
+    return i;
+}
+
+// Free unused Inode
+void returnInode(sfs_t *fs, int index)
+{
+    if (index > 0 && index < fs->INB)
+    {
+        pthread_mutex_lock(&fs->inodeBitmapLock);
+        clearBit(fs->_inode_bitmap, index);
+        fs->inodeGroupFree[index / bitsPerBlock]++;
+        fs->freeInodeEntries++;
+        fs->inodeGeneration[index]++; // names cached under the old inode must not be found in the new one
+
+        writeInodeBitmap(fs, index);
+        pthread_mutex_unlock(&fs->inodeBitmapLock);
+    }
+}
+
+// Add an empty file ("FI") or directory ("DI") under a name that is not in the directory yet
+// Returns the new inode, or a negated status; the caller writes the inode once it is filled in
+int makeEntry(sfs_t *fs, int parent, char *name, char *type)
+{
+    int newInode;
+    int ret;
+
+    // do we have free inodes
+    newInode = getInode(fs);
+    if (newInode == -1)
+        return -SFS_ENOINODE;
+
+    memset(&fs->_inode_table[newInode], 0, sizeof(_inode_entry));
+    memcpy(fs->_inode_table[newInode].TT, type, 2);
+
+    ret = addEntry(fs, parent, name, newInode);
+    if (ret != 1)
+    {
+        returnInode(fs, newInode);
+        return ret == 0 ? -SFS_ENOSPC : -SFS_EDIRFULL;
+    }
+
+    return newInode;
+}
+
+// Add an empty file or directory at a path whose directory exists; inode gets the new one,
+// locked exclusive until the caller has filled it in
+sfs_status makePath(sfs_t *fs, const char *path, char *type, int *inode)
+{
+    int parent, found;
+    char name[maxNameLength + 1];
+    sfs_status status;
+
+    // now lets try to see if the name already exists
+    if ((status = resolvePath(fs, path, lockExclusive, lockNone, &parent, name, &found)) != SFS_OK)
+        return status;
+    if (found != -1)
+    {
+        releasePath(fs, parent, lockExclusive, -1, lockNone);
+        return SFS_EEXIST;
+    }
+    // so the name is new
+
+    *inode = makeEntry(fs, parent, name, type);
+    if (*inode >= 0)
+        lockInode(fs, *inode, lockExclusive);
+    unlockInode(fs, parent, lockExclusive);
+    return *inode < 0 ? (sfs_status)-*inode : SFS_OK;
+}
+
+// Fill a buffer from a source; returns the bytes read, short only at the end of the source, or -1
+long readSource(sfs_source_fn source, void *arg, char *buffer, size_t size)
+{
+    size_t done = 0;
+    long got;
+
+    while (done < size)
+    {
+        got = source(arg, buffer + done, size - done);
+        if (got < 0)
+            return -1;
+        if (got == 0)
+            break;
+        done += got;
+    }
+
+    return done;
+}
+
+// Write the contents of an empty file, taken from a source copyBlocks at a time
+// With a known length, blocks are allocated in runs as long as the disk allows; otherwise a run per chunk
+// Fails if the contents did not fit or the source failed or ended early; the file keeps what was written
+sfs_status fillFile(sfs_t *fs, int inode, uint64_t length, sfs_source_fn source, void *arg)
+{
+    _inode_entry *entry = &fs->_inode_table[inode];
+    uint64_t done = 0, left;
+    size_t want;
+    long got;
+    int goal = 0, start = 0, runLength = 0, used = 0, blocks, i, n;
+    sfs_status status = SFS_OK;
+    char *buffer = malloc(copyBlocks * 1024), *packed = NULL, *data;
+    size_t bytes;
+
+    if (fs->compress)
+        packed = malloc(copyBlocks * 1024 / chunkBytes * packedChunkBlocks * 1024);
+    if (buffer == NULL || (fs->compress && packed == NULL))
+    {
+        free(buffer);
+        free(packed);
+        return SFS_ENOMEM;
+    }
+
+    while (length == SFS_LENGTH_UNKNOWN || done < length)
+    {
+        want = length - done < copyBlocks * 1024 ? length - done : copyBlocks * 1024;
+        got = readSource(source, arg, buffer, want);
+        if (got < 0 || (got == 0 && length != SFS_LENGTH_UNKNOWN))
+        {
+            status = SFS_EIO;
+            break;
+        }
+        if (got == 0)
+            break;
+
+        // a file that ends within inlineBytes keeps its contents in the inode; no block to take, write or read
+        if (done == 0 && (size_t)got <= inlineBytes && (length == SFS_LENGTH_UNKNOWN ? (size_t)got < want : (uint64_t)got == length))
+        {
+            memcpy(entry->ext, buffer, got);
+            entry->flags |= inodeFlagInline;
+            entry->size = got;
+            break;
+        }
+
+        // with compression on, a file whose first chunks pack into fewer blocks is packed all the way
+        data = buffer;
+        bytes = got;
+        if (packed != NULL && (done == 0 || (entry->flags & inodeFlagPacked)))
+        {
+            bytes = packChunks(buffer, got, packed);
+            if (done == 0 && bytes / 1024 < ((size_t)got + 1023) / 1024)
+                entry->flags |= inodeFlagPacked;
+            if (entry->flags & inodeFlagPacked)
+                data = packed;
+            else
+                bytes = got;
+        }
+
+        // the last block of the file is padded with zeros
+        blocks = (bytes + 1023) / 1024;
+        memset(data + bytes, 0, (size_t)blocks * 1024 - bytes);
+
+        // with a share table every block is looked up by its contents and only new ones are written
+        if (fs->_share_table != NULL)
+        {
+            i = storeShared(fs, inode, data, blocks, &goal);
+            if (i < blocks)
+                status = SFS_ENOSPC;
+        }
+        else
+            for (i = 0; i < blocks; i += n)
+            {
+                if (used == runLength)
+                {
+                    left = length == SFS_LENGTH_UNKNOWN || (entry->flags & inodeFlagPacked) ? (uint64_t)(blocks - i) : (length - done + 1023) / 1024 - i;
+                    start = getBlocks(fs, goal, left < (uint64_t)fs->BLB ? (int)left : fs->BLB, &runLength);
+                    if (start == -1 || !appendExtent(fs, inode, start, runLength))
+                    {
+                        if (start != -1)
+                            returnBlocks(fs, start, runLength);
+                        runLength = used = 0;
+                        status = SFS_ENOSPC;
+                        break;
+                    }
+                    goal = start + runLength;
+                    used = 0;
+                }
+
+                n = runLength - used < blocks - i ? runLength - used : blocks - i;
+                writeBlocks(fs, start + used, n, data + (size_t)i * 1024);
+                used += n;
+            }
+
+        // a chunk that did not fit is kept as far as its blocks were written; a packed one cannot be read
+        // in part, so its blocks are given back
+        if (!(entry->flags & inodeFlagPacked))
+            done += (size_t)got < (size_t)i * 1024 ? (size_t)got : (size_t)i * 1024;
+        else if (i == blocks)
+            done += got;
+        else
+            for (; i > 0; i--)
+                removeLastBlock(fs, inode);
+        entry->size = done;
+        if (status != SFS_OK)
+            break;
+        if ((size_t)got < want && length != SFS_LENGTH_UNKNOWN)
+        {
+            status = SFS_EIO;
+            break;
+        }
+    }
+
+    // a run taken for contents that never came is given back
+    for (; used < runLength; used++)
+        removeLastBlock(fs, inode);
+
+    free(buffer);
+    free(packed);
+    return status;
+}
+
+// Fill in what an inode is, under the given name
+void describe(sfs_t *fs, int inode, const char *name, sfs_entry_t *out)
+{
+    snprintf(out->name, sizeof(out->name), "%.*s", maxNameLength, name);
+    out->inode = inode;
+    out->isDirectory = fs->_inode_table[inode].TT[0] == 'D';
+    out->size = fs->_inode_table[inode].size;
+    out->blocks = fs->_inode_table[inode].blockCount;
+}
+
+// Pass one entry of a listed directory to the caller's function
+void listEntry(sfs_t *fs, _directory_entry *entry, void *arg)
+{
+    _listing *listing = arg;
+    char name[maxNameLength + 1];
+    sfs_entry_t out;
+
+    snprintf(name, sizeof(name), "%.*s", maxNameLength, entry->fname);
+    describe(fs, entry->MMM, name, &out);
+    listing->visit(listing->arg, &out);
+}
+
+// Count one entry of a surveyed directory
+void countEntry(sfs_t *fs, _directory_entry *entry, void *arg)
+{
+    (void)fs;
+    (void)entry;
+    (*(uint64_t *)arg)++;
+}
+
+// Helper function to delete file
+/**
+ * Read inode data from inode table
+ * Read data blocks index from inode
+ * Return data blocks to free block list
+ * Return inode to free inode list
+ * Write inode table in disk
+ */
+int removeFile(sfs_t *fs, int inode)
+{
+    char inodeType = fs->_inode_table[inode].TT[0];
+    if (inodeType == 'D')
+        return 0;
+
+    // an open file keeps its blocks until the last handle is closed; the mark frees it after a crash
+    if (__atomic_load_n(&fs->openCount[inode], __ATOMIC_RELAXED) > 0)
+    {
+        fs->_inode_table[inode].flags |= inodeFlagOrphan;
+        writeInode(fs, inode);
+        return 1;
+    }
+
+    freeExtents(fs, inode);
+
+    returnInode(fs, inode);
+    writeInode(fs, inode);
+    return 1;
+}
+
+// Remove what a directory entry points at; removeDirectory() calls it for every entry
+void removeChild(sfs_t *fs, _directory_entry *entry, void *arg)
+{
+    (void)arg;
+
+    lockInode(fs, entry->MMM, lockExclusive);
+    if (fs->_inode_table[entry->MMM].TT[0] == 'F')
+        removeFile(fs, entry->MMM);
+    else
+        removeDirectory(fs, entry->MMM);
+    unlockInode(fs, entry->MMM, lockExclusive);
+}
+
+// Recursive helper function to delete directory
+/**
+ * Read inode data from inode table
+ * Read data blocks index from inode
+ * Traverse through all directory entries
+ * If directory entry is a file then call removeFile()
+ * If directory entry is a directory then call removeDirectory()
+ * Return data blocks to free block list
+ * Return inode to free inode list
+ * Write inode table in disk
+ */
+int removeDirectory(sfs_t *fs, int inode)
+{
+    char inodeType = fs->_inode_table[inode].TT[0];
+    if (inodeType == 'F')
+        return 0;
+
+    walkDirectory(fs, inode, removeChild, NULL);
+
+    freeDirectory(fs, inode);
+    returnInode(fs, inode);
+    writeInode(fs, inode);
+    return 1;
+}
+
+// Mark an inode as an orphan and queue it for reclaim; the mark survives a crash or an exit,
+// and the next mount queues the inode again
+void queueOrphan(sfs_t *fs, int inode)
+{
+    if (!(fs->_inode_table[inode].flags & inodeFlagOrphan))
+    {
+        fs->_inode_table[inode].flags |= inodeFlagOrphan;
+        writeInode(fs, inode);
+    }
+
+    pthread_mutex_lock(&fs->reclaimLock);
+    if (fs->reclaimCount == fs->reclaimCapacity)
+    {
+        fs->reclaimCapacity = fs->reclaimCapacity == 0 ? 64 : 2 * fs->reclaimCapacity;
+        fs->reclaimQueue = realloc(fs->reclaimQueue, fs->reclaimCapacity * sizeof(int));
+        if (fs->reclaimQueue == NULL)
+        {
+            outOfMemory();
+        }
+    }
+
+    fs->reclaimQueue[fs->reclaimCount++] = inode;
+    pthread_mutex_unlock(&fs->reclaimLock);
+}
+
+// Queue what a directory entry of an orphan directory points at
+void orphanChild(sfs_t *fs, _directory_entry *entry, void *arg)
+{
+    (void)arg;
+
+    lockInode(fs, entry->MMM, lockExclusive);
+    queueOrphan(fs, entry->MMM);
+    unlockInode(fs, entry->MMM, lockExclusive);
+}
+
+// Free up to limit orphans (-1 = all of them); the children of an orphan directory become orphans
+// themselves, so a step never walks more than one directory. Returns how many inodes were freed
+int reclaimOrphans(sfs_t *fs, int limit)
+{
+    int inode, done = 0;
+
+    deferMetadata(fs);
+    while (limit < 0 || done < limit)
+    {
+        pthread_mutex_lock(&fs->reclaimLock);
+        inode = fs->reclaimCount > 0 ? fs->reclaimQueue[--fs->reclaimCount] : -1;
+        pthread_mutex_unlock(&fs->reclaimLock);
+        if (inode == -1)
+            break;
+
+        // no directory leads to an orphan any more, so it is busy only when the thread reclaiming
+        // holds it already (it ran out of space creating in it) or the current directory is in it;
+        // such an orphan waits for a later reclaim
+        if (pthread_rwlock_trywrlock(&fs->inodeLocks[inode]) != 0)
+        {
+            queueOrphan(fs, inode);
+            break;
+        }
+
+        // an open file stays marked; its last close queues it again
+        if (__atomic_load_n(&fs->openCount[inode], __ATOMIC_RELAXED) > 0)
+        {
+            unlockInode(fs, inode, lockExclusive);
+            continue;
+        }
+
+        if (fs->_inode_table[inode].TT[0] == 'D')
+        {
+            walkDirectory(fs, inode, orphanChild, NULL);
+            freeDirectory(fs, inode);
+        }
+        else
+            freeExtents(fs, inode);
+
+        fs->_inode_table[inode].flags = 0;
+        returnInode(fs, inode);
+        writeInode(fs, inode);
+        unlockInode(fs, inode, lockExclusive);
+        done++;
+    }
+    publishMetadata(fs);
+
+    countEvent(fs->reclaimedInodes, done);
+    return done;
+}
+
+// Out of memory halfway through an operation; the in-memory metadata cannot be trusted any more
+void outOfMemory()
+{
+    fprintf(stderr, "libsfs: Out of memory.\n");
+    abort();
+}
+
+// Find logical block logical of a file in its extents; returns the block holding it and sets run to how many
+// blocks from there on are contiguous, or returns 0 if it is not mapped
+int extentRun(_extent *extents, int n, uint32_t logical, uint32_t *run)
+{
+    int i;
+
+    *run = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (logical < extents[i].length)
+        {
+            *run = extents[i].length - logical;
+            return extents[i].start + logical;
+        }
+        logical -= extents[i].length;
+    }
+
+    return 0;
+}
+
+// Map count more blocks at the end of a file, right after its last one if the disk allows; the caller writes
+// the inode. Returns 0 if the disk filled up first; the blocks mapped so far stay
+int growFile(sfs_t *fs, int inode, uint32_t count)
+{
+    _inode_entry *entry = &fs->_inode_table[inode];
+    int goal, start, length;
+
+    goal = entry->blockCount > 0 ? mapBlock(fs, inode, entry->blockCount - 1) + 1 : 0;
+    while (count > 0)
+    {
+        start = getBlocks(fs, goal, count < (uint32_t)fs->BLB ? (int)count : fs->BLB, &length);
+        if (start == -1 || !appendExtent(fs, inode, start, length))
+        {
+            if (start != -1)
+                returnBlocks(fs, start, length);
+            return 0;
+        }
+        goal = start + length;
+        count -= length;
+    }
+
+    return 1;
+}
+
+// Write size bytes at offset of a file locked exclusive, or zeros when data is NULL; a gap between the end of
+// the file and offset is filled with zeros first. Only the blocks the bytes fall in are written, and those
+// cut by either end are read first; the caller writes the inode. done gets the bytes written, short if the
+// disk filled up
+sfs_status writeRange(sfs_t *fs, int inode, const char *data, uint64_t offset, uint64_t size, uint64_t *done)
+{
+    _inode_entry *entry = &fs->_inode_table[inode];
+    uint64_t end, from, to, head, tail, mapped;
+    uint32_t logical, last, oldBlocks, run;
+    _extent *extents;
+    char *buffer;
+    int block, n;
+    sfs_status status = SFS_OK;
+
+    *done = 0;
+    if (size == 0)
+        return SFS_OK;
+
+    // an empty or inline file that still fits in its inode is written there; one that outgrows it moves to a block
+    if (offset + size <= inlineBytes && ((entry->flags & inodeFlagInline) || entry->blockCount == 0))
+    {
+        // a file cut down to no blocks may still hold the extents it had
+        if (!(entry->flags & inodeFlagInline))
+            memset(entry->ext, 0, sizeof(entry->ext));
+        if (data != NULL)
+            memcpy((char *)entry->ext + offset, data, size);
+        else
+            memset((char *)entry->ext + offset, 0, size);
+        entry->flags |= inodeFlagInline;
+        if (offset + size > entry->size)
+            entry->size = offset + size;
+        *done = size;
+        return SFS_OK;
+    }
+
+    // a packed file is stored plain first; blocks of the range that other files share or a snapshot holds are
+    // copied, one by one, to blocks of the file's own
+    if ((entry->flags & inodeFlagPacked) && (status = rewriteFile(fs, inode)) != SFS_OK)
+        return status;
+    if ((status = unshareRange(fs, inode, offset, size)) != SFS_OK)
+        return status;
+
+    // the zeros of a gap may land in the inode too, so the move comes after them
+    if (offset > entry->size && (status = writeRange(fs, inode, NULL, entry->size, offset - entry->size, &mapped)) != SFS_OK)
+        return status;
+    if ((entry->flags & inodeFlagInline) && (status = promoteInline(fs, inode)) != SFS_OK)
+        return status;
+
+    // blocks past the old end are mapped first, as far as the disk allows
+    oldBlocks = entry->blockCount;
+    end = offset + size;
+    if ((end + 1023) / 1024 > oldBlocks && !growFile(fs, inode, (end + 1023) / 1024 - oldBlocks))
+        status = SFS_ENOSPC;
+    mapped = (uint64_t)entry->blockCount * 1024;
+    if (mapped <= offset)
+        return status;
+    if (end > mapped)
+        end = mapped;
+
+    if ((buffer = malloc(copyBlocks * 1024)) == NULL)
+        return SFS_ENOMEM;
+    n = getExtents(fs, inode, &extents);
+
+    last = (end - 1) / 1024;
+    for (logical = offset / 1024; logical <= last; logical += run)
+    {
+        if ((block = extentRun(extents, n, logical, &run)) == 0)
+        {
+            status = SFS_ECORRUPT;
+            break;
+        }
+        if (run > last + 1 - logical)
+            run = last + 1 - logical;
+        if (run > copyBlocks)
+            run = copyBlocks;
+
+        // a block the range only cuts into keeps the rest of what it holds; a new one starts out zeroed
+        from = (uint64_t)logical * 1024;
+        to = from + (uint64_t)run * 1024;
+        head = offset > from ? offset - from : 0;
+        tail = end < to ? to - end : 0;
+        if (head > 0 && logical < oldBlocks)
+            readBlock(fs, block, buffer);
+        else if (head > 0)
+            memset(buffer, 0, 1024);
+        if (tail > 0 && (run > 1 || head == 0) && logical + run - 1 < oldBlocks)
+            readBlock(fs, block + run - 1, buffer + (size_t)(run - 1) * 1024);
+        else if (tail > 0 && (run > 1 || head == 0))
+            memset(buffer + (size_t)(run - 1) * 1024, 0, 1024);
+
+        if (data != NULL)
+            memcpy(buffer + head, data + (from + head - offset), to - tail - from - head);
+        else
+            memset(buffer + head, 0, to - tail - from - head);
+        writeBlocks(fs, block, run, buffer);
+    }
+
+    free(extents);
+    free(buffer);
+    if (status == SFS_ECORRUPT)
+        return status;
+
+    *done = end - offset;
+    if (end > entry->size)
+        entry->size = end;
+    return status;
+}
+
+// Copy up to size bytes at offset of a file locked shared into out; done gets how many, short at the end of the file
+sfs_status readRange(sfs_t *fs, int inode, char *out, uint64_t offset, uint64_t size, uint64_t *done)
+{
+    uint64_t end, from, head, chunk;
+    uint32_t logical, last, run;
+    _extent *extents;
+    char *buffer, *data, *cursor;
+    int block, n;
+    sfs_status status = SFS_OK;
+
+    *done = 0;
+    end = fs->_inode_table[inode].size;
+    if (offset >= end || size == 0)
+        return SFS_OK;
+    if (size < end - offset)
+        end = offset + size;
+    if (fs->_inode_table[inode].flags & inodeFlagInline)
+    {
+        memcpy(out, (char *)fs->_inode_table[inode].ext + offset, end - offset);
+        *done = end - offset;
+        return SFS_OK;
+    }
+    if (fs->_inode_table[inode].flags & inodeFlagPacked)
+    {
+        cursor = out;
+        if ((status = readPacked(fs, inode, offset, end, copySink, &cursor)) == SFS_OK)
+            *done = end - offset;
+        return status;
+    }
+
+    last = (end - 1) / 1024;
+    n = last - offset / 1024 + 1;
+    if ((buffer = malloc((n < readAheadBlocks ? n : readAheadBlocks) * 1024)) == NULL)
+        return SFS_ENOMEM;
+    n = getExtents(fs, inode, &extents);
+
+    for (logical = offset / 1024; logical <= last; logical += run)
+    {
+        if ((block = extentRun(extents, n, logical, &run)) == 0)
+        {
+            status = SFS_ECORRUPT;
+            break;
+        }
+        if (run > last + 1 - logical)
+            run = last + 1 - logical;
+        if (run > readAheadBlocks)
+            run = readAheadBlocks;
+
+        data = blockData(fs, block, run, buffer);
+        from = (uint64_t)logical * 1024;
+        head = offset > from ? offset - from : 0;
+        chunk = (end < from + (uint64_t)run * 1024 ? end : from + (uint64_t)run * 1024) - from - head;
+        memcpy(out + *done, data + head, chunk);
+        *done += chunk;
+    }
+
+    free(extents);
+    free(buffer);
+    return status;
+}
+
+// Copy up to size bytes at offset of a file locked shared to a host file descriptor; done gets how many,
+// short at the end of the file. An output the kernel writes to never sees the bytes pass through memory
+sfs_status sendRange(sfs_t *fs, int inode, int fd, uint64_t offset, uint64_t size, uint64_t *done)
+{
+    uint64_t end, from, head, chunk;
+    uint32_t logical, last, run;
+    _extent *extents;
+    struct stat info;
+    char *buffer;
+    int block, n, mode;
+    sfs_status status = SFS_OK;
+
+    *done = 0;
+    end = fs->_inode_table[inode].size;
+    if (offset >= end || size == 0)
+        return SFS_OK;
+    if (size < end - offset)
+        end = offset + size;
+    if (fs->_inode_table[inode].flags & inodeFlagInline)
+    {
+        if (writeOut(fd, (char *)fs->_inode_table[inode].ext + offset, end - offset) != 0)
+            return SFS_EIO;
+        *done = end - offset;
+        return SFS_OK;
+    }
+    if (fs->_inode_table[inode].flags & inodeFlagPacked)
+    {
+        if ((status = readPacked(fs, inode, offset, end, fdSink, &fd)) == SFS_OK)
+            *done = end - offset;
+        return status;
+    }
+    mode = fstat(fd, &info) == 0 && S_ISREG(info.st_mode) ? copyRange : copySend;
+
+    last = (end - 1) / 1024;
+    n = last - offset / 1024 + 1;
+    if ((buffer = malloc((n < readAheadBlocks ? n : readAheadBlocks) * 1024)) == NULL)
+        return SFS_ENOMEM;
+    n = getExtents(fs, inode, &extents);
+
+    for (logical = offset / 1024; logical <= last; logical += run)
+    {
+        if ((block = extentRun(extents, n, logical, &run)) == 0)
+        {
+            status = SFS_ECORRUPT;
+            break;
+        }
+        if (run > last + 1 - logical)
+            run = last + 1 - logical;
+        if (run > readAheadBlocks)
+            run = readAheadBlocks;
+
+        from = (uint64_t)logical * 1024;
+        head = offset > from ? offset - from : 0;
+        chunk = (end < from + (uint64_t)run * 1024 ? end : from + (uint64_t)run * 1024) - from - head;
+        if (sendBlocks(fs, fd, block, run, head, chunk, buffer, &mode) != 0)
+        {
+            status = SFS_EIO;
+            break;
+        }
+        *done += chunk;
+    }
+
+    free(extents);
+    free(buffer);
+    return status;
+}
+
+// Cut a file locked exclusive to length bytes, or extend it with zeros; the caller writes the inode
+sfs_status truncateFile(sfs_t *fs, int inode, uint64_t length)
+{
+    _inode_entry *entry = &fs->_inode_table[inode];
+    uint64_t done;
+    sfs_status status;
+
+    // a packed file cut to nothing just loses its blocks
+    if ((entry->flags & inodeFlagPacked) && length > 0 && (status = rewriteFile(fs, inode)) != SFS_OK)
+        return status;
+    if (length > entry->size)
+        return writeRange(fs, inode, NULL, entry->size, length - entry->size, &done);
+
+    // bytes past the end of an inline file are kept zero, so growing it again reads zeros
+    if (entry->flags & inodeFlagInline)
+    {
+        memset((char *)entry->ext + length, 0, entry->size - length);
+        entry->size = length;
+        return SFS_OK;
+    }
+
+    // the bitmap blocks of a long cut are written once
+    deferMetadata(fs);
+    while (entry->blockCount > (length + 1023) / 1024)
+        removeLastBlock(fs, inode);
+    publishMetadata(fs);
+
+    if (length == 0)
+        entry->flags &= ~inodeFlagPacked;
+    entry->size = length;
+    return SFS_OK;
+}
+
+// Move the contents of an inline file into a block of its own, so it can grow past inlineBytes; the caller
+// writes the inode. The block is written before the inode that maps it, so a crash leaves the inline copy
+sfs_status promoteInline(sfs_t *fs, int inode)
+{
+    _inode_entry *entry = &fs->_inode_table[inode];
+    char buffer[1024];
+    int block;
+
+    entry->flags &= ~inodeFlagInline;
+    if (entry->size == 0)
+        return SFS_OK;
+    if ((block = getBlock(fs, 0)) == -1)
+    {
+        entry->flags |= inodeFlagInline;
+        return SFS_ENOSPC;
+    }
+
+    memset(buffer, 0, sizeof(buffer));
+    memcpy(buffer, entry->ext, entry->size);
+    memset(entry->ext, 0, sizeof(entry->ext));
+    writeBlocks(fs, block, 1, buffer);
+    appendExtent(fs, inode, block, 1);
+    return SFS_OK;
+}
+
+// The last handle of a file removed while open was closed; free it, or leave it to reclaim
+void releaseOrphan(sfs_t *fs, int inode)
+{
+    if (fs->deferredReclaim)
+    {
+        queueOrphan(fs, inode);
+        return;
+    }
+
+    deferMetadata(fs);
+    freeExtents(fs, inode);
+    fs->_inode_table[inode].flags = 0;
+    returnInode(fs, inode);
+    writeInode(fs, inode);
+    publishMetadata(fs);
+}
+
+// COMPRESSION
+
+// Hash of the four bytes at p, to find where they were seen before
+uint32_t packHash(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - packHashBits);
+}
+
+// Store the part of a literal count or match length that did not fit in its token
+unsigned char *packLength(unsigned char *out, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = length;
+    return out;
+}
+
+// Compress length bytes (at most chunkBytes) into an LZ4 block at out, which has room for packBound(length);
+// returns its size. A match is the last place the same four bytes were seen, extended as far as it goes
+size_t packBytes(const char *in, size_t length, char *out)
+{
+    const unsigned char *src = (const unsigned char *)in, *end = src + length, *p = src, *anchor = src, *match;
+    const unsigned char *limit = length > 12 ? end - 12 : src;
+    unsigned char *dst = (unsigned char *)out, *token;
+    int32_t seen[1 << packHashBits];
+    size_t literals, matched;
+    uint32_t h;
+
+    memset(seen, 0xff, sizeof(seen));
+    while (p < limit)
+    {
+        h = packHash(p);
+        match = seen[h] >= 0 ? src + seen[h] : NULL;
+        seen[h] = p - src;
+        if (match == NULL || p - match > 65535 || memcmp(match, p, 4) != 0)
+        {
+            p++;
+            continue;
+        }
+
+        // the last five bytes are always literals
+        for (matched = 4; p + matched < end - 5 && match[matched] == p[matched]; matched++)
+            ;
+        literals = p - anchor;
+        token = dst++;
+        *token = (literals < 15 ? literals : 15) << 4 | (matched - 4 < 15 ? matched - 4 : 15);
+        if (literals >= 15)
+            dst = packLength(dst, literals - 15);
+        memcpy(dst, anchor, literals);
+        dst += literals;
+        *dst++ = (p - match) & 0xff;
+        *dst++ = (p - match) >> 8;
+        if (matched - 4 >= 15)
+            dst = packLength(dst, matched - 4 - 15);
+        p += matched;
+        anchor = p;
+    }
+
+    literals = end - anchor;
+    token = dst++;
+    *token = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15)
+        dst = packLength(dst, literals - 15);
+    memcpy(dst, anchor, literals);
+    dst += literals;
+    return dst - (unsigned char *)out;
+}
+
+// Decompress an LZ4 block of length bytes into out; returns the bytes made, or -1 if the block is damaged or
+// would make more than capacity
+long unpackBytes(const char *in, size_t length, char *out, size_t capacity)
+{
+    const unsigned char *src = (const unsigned char *)in, *end = src + length;
+    unsigned char *dst = (unsigned char *)out, *limit = dst + capacity;
+    size_t literals, matched, offset;
+    unsigned char token, c;
+
+    while (src < end)
+    {
+        token = *src++;
+        literals = token >> 4;
+        if (literals == 15)
+            do
+            {
+                if (src == end)
+                    return -1;
+                literals += c = *src++;
+            } while (c == 255);
+        if (literals > (size_t)(end - src) || literals > (size_t)(limit - dst))
+            return -1;
+        memcpy(dst, src, literals);
+        dst += literals;
+        src += literals;
+        if (src == end)
+            break;
+
+        if (end - src < 2)
+            return -1;
+        offset = src[0] | src[1] << 8;
+        src += 2;
+        matched = (token & 15) + 4;
+        if ((token & 15) == 15)
+            do
+            {
+                if (src == end)
+                    return -1;
+                matched += c = *src++;
+            } while (c == 255);
+        if (offset == 0 || offset > (size_t)(dst - (unsigned char *)out) || matched > (size_t)(limit - dst))
+            return -1;
+
+        // byte by byte, since a match may overlap the bytes it makes
+        for (; matched > 0; matched--, dst++)
+            *dst = dst[-offset];
+    }
+
+    return dst - (unsigned char *)out;
+}
+
+// Compress length bytes into chunks at out, each a _chunk_header and its bytes padded to whole blocks, with
+// room for packedChunkBlocks blocks per chunk; returns the bytes used. A chunk that does not shrink is stored
+// as it is
+size_t packChunks(const char *in, size_t length, char *out)
+{
+    _chunk_header header;
+    size_t done, bytes, used = 0;
+
+    for (done = 0; done < length; done += header.rawBytes)
+    {
+        header.rawBytes = length - done < chunkBytes ? length - done : chunkBytes;
+        bytes = packBytes(in + done, header.rawBytes, out + used + sizeof(header));
+        if (bytes >= header.rawBytes)
+        {
+            bytes = header.rawBytes;
+            memcpy(out + used + sizeof(header), in + done, bytes);
+        }
+        header.packedBytes = bytes;
+        memcpy(out + used, &header, sizeof(header));
+
+        bytes += sizeof(header);
+        memset(out + used + bytes, 0, (bytes + 1023) / 1024 * 1024 - bytes);
+        used += (bytes + 1023) / 1024 * 1024;
+    }
+
+    return used;
+}
+
+// Read count blocks of a file from logical on into buffer, across as many extents as they span
+// Returns 0, or -1 if the file has no such blocks
+int readLogical(sfs_t *fs, _extent *extents, int n, uint32_t logical, uint32_t count, char *buffer)
+{
+    uint32_t run;
+    char *data;
+    int block;
+
+    for (; count > 0; logical += run, count -= run, buffer += (size_t)run * 1024)
+    {
+        if ((block = extentRun(extents, n, logical, &run)) == 0)
+            return -1;
+        if (run > count)
+            run = count;
+        if ((data = blockData(fs, block, run, buffer)) != buffer)
+            memcpy(buffer, data, (size_t)run * 1024);
+    }
+
+    return 0;
+}
+
+// Pass the bytes from offset up to end of a packed file locked shared to sink, a chunk at a time. Only the
+// chunks they fall in are read whole and decompressed; one before them costs the read of its first block
+sfs_status readPacked(sfs_t *fs, int inode, uint64_t offset, uint64_t end, sfs_sink_fn sink, void *arg)
+{
+    _chunk_header header;
+    _extent *extents;
+    uint64_t at = 0, from, to;
+    uint32_t logical = 0, blocks;
+    char *packed = malloc(packedChunkBlocks * 1024), *raw = malloc(chunkBytes), *data;
+    int n;
+    sfs_status status = SFS_OK;
+
+    if (packed == NULL || raw == NULL)
+    {
+        free(packed);
+        free(raw);
+        return SFS_ENOMEM;
+    }
+    n = getExtents(fs, inode, &extents);
+
+    while (at < end && status == SFS_OK)
+    {
+        if (readLogical(fs, extents, n, logical, 1, packed) != 0)
+        {
+            status = SFS_ECORRUPT;
+            break;
+        }
+        memcpy(&header, packed, sizeof(header));
+        if (header.rawBytes == 0 || header.rawBytes > chunkBytes || header.packedBytes > header.rawBytes)
+        {
+            status = SFS_ECORRUPT;
+            break;
+        }
+        blocks = (sizeof(header) + header.packedBytes + 1023) / 1024;
+
+        if (at + header.rawBytes > offset)
+        {
+            data = packed + sizeof(header);
+            if (readLogical(fs, extents, n, logical + 1, blocks - 1, packed + 1024) != 0 ||
+                (header.packedBytes < header.rawBytes && unpackBytes(data, header.packedBytes, raw, chunkBytes) != header.rawBytes))
+            {
+                status = SFS_ECORRUPT;
+                break;
+            }
+            if (header.packedBytes < header.rawBytes)
+                data = raw;
+
+            from = offset > at ? offset - at : 0;
+            to = end - at < header.rawBytes ? end - at : header.rawBytes;
+            if (sink(arg, data + from, to - from) != 0)
+                status = SFS_EIO;
+        }
+        at += header.rawBytes;
+        logical += blocks;
+    }
+
+    free(extents);
+    free(packed);
+    free(raw);
+    return status;
+}
+
+// Store a packed file locked exclusive again as plain blocks, so it can be written in place. The caller writes
+// the inode. The whole file passes through memory, and it needs room for all of its new blocks before the old
+// ones are given back at the next commit
+sfs_status rewriteFile(sfs_t *fs, int inode)
+{
+    _inode_entry *entry = &fs->_inode_table[inode];
+    uint64_t size = entry->size, done;
+    char *contents;
+    int room;
+    sfs_status status;
+
+    pthread_mutex_lock(&fs->blockBitmapLock);
+    room = (uint64_t)fs->freeDiskBlocks > (size + 1023) / 1024;
+    pthread_mutex_unlock(&fs->blockBitmapLock);
+    if (!room)
+        return SFS_ENOSPC;
+    if ((contents = malloc(size > 0 ? size : 1)) == NULL)
+        return SFS_ENOMEM;
+
+    status = readRange(fs, inode, contents, 0, size, &done);
+    if (status == SFS_OK)
+    {
+        deferMetadata(fs);
+        freeExtents(fs, inode);
+        publishMetadata(fs);
+        entry->flags &= ~inodeFlagPacked;
+        entry->size = 0;
+        status = writeRange(fs, inode, contents, 0, size, &done);
+        if (status == SFS_OK && done < size)
+            status = SFS_ENOSPC;
+    }
+
+    free(contents);
+    return status;
+}
+
+// Sink that copies to memory; arg points at where to, and is moved past what was copied
+int copySink(void *arg, const char *data, size_t length)
+{
+    char **cursor = arg;
+
+    memcpy(*cursor, data, length);
+    *cursor += length;
+    return 0;
+}
+
+// Sink that writes to the host file descriptor arg points at
+int fdSink(void *arg, const char *data, size_t length)
+{
+    return writeOut(*(int *)arg, data, length);
+}
+
+// Set up the hash chains over the share table just read; every block with references is found by its fingerprint
+sfs_status initShares(sfs_t *fs)
+{
+    int i;
+
+    for (fs->shareBuckets = 1; fs->shareBuckets < fs->BLB / 2; fs->shareBuckets *= 2)
+        ;
+    fs->shareHead = malloc(fs->shareBuckets * sizeof(int));
+    fs->shareNext = malloc(fs->BLB * sizeof(int));
+    if (fs->shareHead == NULL || fs->shareNext == NULL)
+        return SFS_ENOMEM;
+
+    memset(fs->shareHead, 0xff, fs->shareBuckets * sizeof(int));
+    for (i = fs->superBlock.dataStart; i < fs->BLB; i++)
+    {
+        if (fs->_share_table[i].refs > 0)
+            chainShare(fs, i);
+    }
+    return SFS_OK;
+}
+
+// Write the share table block holding the entry of a block
+void writeShare(sfs_t *fs, int block)
+{
+    writeMetadata(fs, fs->superBlock.shareStart + block / sharesPerBlock);
+}
+
+// Put a block in the hash chain of its fingerprint; the caller holds shareLock
+void chainShare(sfs_t *fs, int block)
+{
+    int *head = &fs->shareHead[fs->_share_table[block].fingerprint & (fs->shareBuckets - 1)];
+
+    fs->shareNext[block] = *head;
+    *head = block;
+}
+
+// Take a block out of its hash chain; the caller holds shareLock
+void unchainShare(sfs_t *fs, int block)
+{
+    int *link = &fs->shareHead[fs->_share_table[block].fingerprint & (fs->shareBuckets - 1)];
+
+    while (*link != -1 && *link != block)
+        link = &fs->shareNext[*link];
+    if (*link == block)
+        *link = fs->shareNext[block];
+}
+
+// Find a block already holding the 1024 bytes of data and take a reference to it; returns the block, or -1
+// Blocks with the same fingerprint are compared byte for byte, so a collision never shares the wrong contents;
+// the blocks [start, start + count) are not written yet and are compared with pending, what they will hold
+int shareExisting(sfs_t *fs, const char *data, int start, int count, const char *pending)
+{
+    uint32_t fingerprint = checksumBytes(2166136261u, data, 1024);
+    char buffer[1024];
+    const char *contents;
+    int block;
+
+    pthread_mutex_lock(&fs->shareLock);
+    for (block = fs->shareHead[fingerprint & (fs->shareBuckets - 1)]; block != -1; block = fs->shareNext[block])
+    {
+        if (fs->_share_table[block].fingerprint != fingerprint)
+            continue;
+        if (block >= start && block < start + count)
+            contents = pending + (size_t)(block - start) * 1024;
+        else
+            contents = blockData(fs, block, 1, buffer);
+        if (memcmp(contents, data, 1024) == 0)
+        {
+            fs->_share_table[block].refs++;
+            writeShare(fs, block);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->shareLock);
+    return block;
+}
+
+// Enter a new block mapped by one file, which is to hold data, so later copies of the bytes can share it
+void shareNew(sfs_t *fs, int block, const char *data)
+{
+    pthread_mutex_lock(&fs->shareLock);
+    fs->_share_table[block].refs = 1;
+    fs->_share_table[block].fingerprint = checksumBytes(2166136261u, data, 1024);
+    chainShare(fs, block);
+    writeShare(fs, block);
+    pthread_mutex_unlock(&fs->shareLock);
+}
+
+// Drop one reference to a block a file no longer maps; returns 1 if other files still map it, so it is not freed
+int keepShared(sfs_t *fs, int block)
+{
+    _share_entry *entry = &fs->_share_table[block];
+    int kept;
+
+    pthread_mutex_lock(&fs->shareLock);
+    kept = entry->refs > 1;
+    if (entry->refs > 0)
+    {
+        if (--entry->refs == 0)
+        {
+            unchainShare(fs, block);
+            entry->fingerprint = 0;
+        }
+        writeShare(fs, block);
+    }
+    pthread_mutex_unlock(&fs->shareLock);
+    return kept;
+}
+
+// Give a file locked exclusive blocks of its own for the part of [offset, offset + size) it maps, before the
+// range is written. A block other files share or a snapshot holds is copied to a new block, which takes its
+// place in the file, and loses this file's reference; only the bytes the write leaves are copied. A block only
+// this file maps leaves the share table, since its contents are about to change. The caller writes the inode
+sfs_status unshareRange(sfs_t *fs, int inode, uint64_t offset, uint64_t size)
+{
+    _inode_entry *entry = &fs->_inode_table[inode];
+    _extent *extents, *mapped;
+    uint32_t logical, first, last, before, upTo, b;
+    int *moved, *copies, block, copy, shared, i, n, count = 0, changed = 0;
+    char buffer[1024];
+    sfs_status status = SFS_OK;
+
+    if ((fs->_share_table == NULL && fs->heldBitmap == NULL) || offset / 1024 >= entry->blockCount || (entry->flags & inodeFlagInline))
+        return SFS_OK;
+    first = offset / 1024;
+    last = (offset + size - 1) / 1024 < entry->blockCount ? (offset + size - 1) / 1024 : entry->blockCount - 1;
+    if ((n = getExtents(fs, inode, &extents)) < 0)
+        return SFS_ENOMEM;
+
+    // each block of the range may split its extent in three
+    mapped = malloc((n + 2 * (size_t)(last - first + 1)) * sizeof(_extent));
+    moved = malloc((last - first + 1) * sizeof(int));
+    copies = malloc((last - first + 1) * sizeof(int));
+    if (mapped == NULL || moved == NULL || copies == NULL)
+    {
+        free(extents);
+        free(mapped);
+        free(moved);
+        free(copies);
+        return SFS_ENOMEM;
+    }
+
+    for (i = 0, logical = 0; i < n; logical += extents[i++].length)
+    {
+        // the blocks of the extent before the range and after it keep their place
+        before = first > logical ? (first - logical < extents[i].length ? first - logical : extents[i].length) : 0;
+        upTo = last + 1 > logical ? (last + 1 - logical < extents[i].length ? last + 1 - logical : extents[i].length) : 0;
+        count = addExtent(mapped, count, extents[i].start, before);
+
+        for (b = before; b < upTo; b++)
+        {
+            block = extents[i].start + b;
+            if (fs->_share_table != NULL)
+                pthread_mutex_lock(&fs->shareLock);
+            shared = isHeld(fs, block) || (fs->_share_table != NULL && fs->_share_table[block].refs > 1);
+            if (!shared && fs->_share_table != NULL && fs->_share_table[block].refs == 1)
+            {
+                unchainShare(fs, block);
+                fs->_share_table[block].refs = 0;
+                fs->_share_table[block].fingerprint = 0;
+                writeShare(fs, block);
+            }
+            if (fs->_share_table != NULL)
+                pthread_mutex_unlock(&fs->shareLock);
+
+            // copies of neighbouring blocks are kept together
+            copy = -1;
+            if (shared && status == SFS_OK && (copy = getBlock(fs, changed > 0 ? copies[changed - 1] + 1 : block)) == -1)
+                status = SFS_ENOSPC;
+            if (copy == -1)
+            {
+                count = addExtent(mapped, count, block, 1);
+                continue;
+            }
+
+            // a block the write covers whole needs nothing of the old contents
+            if ((uint64_t)(logical + b) * 1024 < offset || (uint64_t)(logical + b + 1) * 1024 > offset + size)
+            {
+                readBlock(fs, block, buffer);
+                writeBlocks(fs, copy, 1, buffer);
+            }
+            moved[changed] = block;
+            copies[changed++] = copy;
+            count = addExtent(mapped, count, copy, 1);
+        }
+
+        count = addExtent(mapped, count, extents[i].start + upTo, extents[i].length - upTo);
+    }
+
+    // the old blocks are let go once the file maps the copies
+    deferMetadata(fs);
+    if (changed > 0 && !setExtents(fs, inode, mapped, count))
+    {
+        status = SFS_ENOSPC;
+        for (i = 0; i < changed; i++)
+            returnBlock(fs, copies[i]);
+    }
+    else
+    {
+        for (i = 0; i < changed; i++)
+            returnBlock(fs, moved[i]);
+    }
+    publishMetadata(fs);
+
+    free(extents);
+    free(mapped);
+    free(moved);
+    free(copies);
+    return status;
+}
+
+// Map blocks of data to the end of a file: each to a block already holding the same bytes if there is one, and
+// to a new block otherwise. New blocks are entered in the table as they are taken and written in runs of
+// consecutive ones, so a block repeated within the file is shared too. Returns how many blocks were mapped,
+// short if the disk filled up
+int storeShared(sfs_t *fs, int inode, char *data, int blocks, int *goal)
+{
+    char *run = data;
+    int i, block, found, length, start = 0, count = 0;
+
+    for (i = 0; i < blocks; i++)
+    {
+        found = (block = shareExisting(fs, data + (size_t)i * 1024, start, count, run)) != -1;
+        if (!found && (block = getBlocks(fs, *goal, 1, &length)) == -1)
+            break;
+        if (!appendExtent(fs, inode, block, 1))
+        {
+            returnBlock(fs, block);
+            break;
+        }
+        *goal = block + 1;
+        if (found)
+            continue;
+
+        // a run also ends where the blocks of data it holds stop being consecutive
+        if (count > 0 && (block != start + count || data + (size_t)i * 1024 != run + (size_t)count * 1024))
+        {
+            writeBlocks(fs, start, count, run);
+            count = 0;
+        }
+        if (count++ == 0)
+        {
+            start = block;
+            run = data + (size_t)i * 1024;
+        }
+        shareNew(fs, block, data + (size_t)i * 1024);
+    }
+    if (count > 0)
+        writeBlocks(fs, start, count, run);
+    return i;
+}
+
+// SNAPSHOTS
+
+// Read the snapshot table and gather the blocks the snapshots hold
+sfs_status readSnapshots(sfs_t *fs)
+{
+    _snapshot_entry *entry;
+    sfs_status status;
+    int i;
+
+    if (fs->superBlock.snapshotBlock == 0)
+        return SFS_OK;
+    if ((status = readRegion(fs, fs->superBlock.snapshotBlock, 1, &fs->_snapshot_table)) != SFS_OK)
+        return status;
+
+    for (i = 0; i < maxSnapshots; i++)
+    {
+        entry = &fs->_snapshot_table[i];
+        if (entry->name[0] != 0 && (entry->name[snapshotNameLength] != 0 || entry->blocks != snapshotRunBlocks(&fs->superBlock) ||
+                                    entry->start < fs->superBlock.dataStart || (uint64_t)entry->start + entry->blocks > (uint64_t)fs->BLB))
+            return SFS_ECORRUPT;
+    }
+    return heldBlocks(fs, -1, &fs->heldBitmap);
+}
+
+// Put the inode bitmap and inode table of the snapshot being mounted in place of the tree's. The free counts
+// stay those of the tree, which the superblock goes on recording
+sfs_status mountSnapshot(sfs_t *fs)
+{
+    int i = findSnapshot(fs, fs->snapshotName);
+    uint32_t start;
+    sfs_status status;
+
+    if (i == -1)
+        return SFS_ENOENT;
+    start = fs->_snapshot_table[i].start;
+
+    free(fs->_inode_bitmap);
+    free(fs->_inode_table);
+    fs->_inode_table = NULL;
+    if ((status = readRegion(fs, start, fs->superBlock.inodeBitmapBlocks, &fs->_inode_bitmap)) != SFS_OK)
+        return status;
+    return readRegion(fs, start + fs->superBlock.inodeBitmapBlocks, fs->superBlock.inodeTableBlocks, &fs->_inode_table);
+}
+
+// Return the entry of the snapshot table holding a name, or -1 if there is none
+int findSnapshot(sfs_t *fs, const char *name)
+{
+    int i;
+
+    for (i = 0; fs->_snapshot_table != NULL && i < maxSnapshots; i++)
+    {
+        if (fs->_snapshot_table[i].name[0] != 0 && strcmp(fs->_snapshot_table[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Tell whether some snapshot holds a block
+int isHeld(sfs_t *fs, int block)
+{
+    return fs->heldBitmap != NULL && testBit(fs->heldBitmap, block);
+}
+
+// Gather the blocks held by every snapshot but the one in entry skip (-1 = none) into a new bitmap; it is
+// NULL when there is no other snapshot. A snapshot's bitmap goes straight to the image when it is taken, so
+// it is read from there; at mount there is no cache yet
+sfs_status heldBlocks(sfs_t *fs, int skip, unsigned char **held)
+{
+    uint32_t bitmapBlocks = fs->superBlock.blockBitmapBlocks;
+    size_t size = (size_t)bitmapBlocks * 1024, j;
+    _snapshot_entry *entry;
+    unsigned char *buffer;
+    int i;
+
+    *held = NULL;
+    if ((buffer = malloc(size)) == NULL)
+        return SFS_ENOMEM;
+
+    for (i = 0; fs->_snapshot_table != NULL && i < maxSnapshots; i++)
+    {
+        entry = &fs->_snapshot_table[i];
+        if (i == skip || entry->name[0] == 0)
+            continue;
+        if (*held == NULL && (*held = calloc(1, size)) == NULL)
+        {
+            free(buffer);
+            return SFS_ENOMEM;
+        }
+        if (!diskRead(fs, entry->start + entry->blocks - bitmapBlocks, bitmapBlocks, (char *)buffer))
+        {
+            free(buffer);
+            return SFS_EIO;
+        }
+        for (j = 0; j < size; j++)
+            (*held)[j] |= buffer[j];
+    }
+    free(buffer);
+    return SFS_OK;
+}
+
+// Take a block for the snapshot table the first time a snapshot is taken. The empty table is committed
+// before the superblock points at it
+sfs_status createSnapshotTable(sfs_t *fs)
+{
+    int block;
+
+    if ((fs->_snapshot_table = calloc(maxSnapshots, sizeof(_snapshot_entry))) == NULL)
+        return SFS_ENOMEM;
+    if ((block = getBlock(fs, 0)) == -1)
+    {
+        free(fs->_snapshot_table);
+        fs->_snapshot_table = NULL;
+        return SFS_ENOSPC;
+    }
+    writeBlock(fs, block, (char *)fs->_snapshot_table);
+    if (fs->superBlock.journalBlocks > 0)
+    {
+        pthread_rwlock_wrlock(&fs->journalLock);
+        commitJournal(fs);
+        pthread_rwlock_unlock(&fs->journalLock);
+    }
+
+    fs->superBlock.snapshotBlock = block;
+    writeSuperBlock(fs, 0);
+    return SFS_OK;
+}
+
+// Write a copy of a block of metadata for a snapshot to a new block, which the snapshot holds
+// Returns the new block, or -1 if the disk is full
+int freshBlock(sfs_t *fs, char *data, _freeze *freeze)
+{
+    int block = getBlock(fs, 0);
+
+    if (block == -1)
+        return -1;
+    setBit(freeze->held, block);
+    setBit(freeze->fresh, block);
+    writeBlocks(fs, block, 1, data);
+    return block;
+}
+
+// Make the snapshot's copy of an inode stand on its own: the blocks of a file are held, and the tree goes
+// on sharing them, while a directory and overflow extent blocks, which the tree changes in place, are copied
+// Returns 1, or 0 if the disk filled up
+int freezeInode(sfs_t *fs, int inode, _inode_entry *copy, _freeze *freeze)
+{
+    _extent *extents;
+    uint32_t b;
+    int i, n, ok = 1;
+
+    if ((copy->flags & inodeFlagInline) || copy->extentCount == 0)
+        return 1;
+    if ((n = getExtents(fs, inode, &extents)) < 0)
+        return 0;
+
+    if (copy->TT[0] == 'D')
+        ok = freezeDirectory(fs, inode, &extents, &n, freeze);
+    else
+    {
+        for (i = 0; i < n; i++)
+        {
+            for (b = 0; b < extents[i].length; b++)
+                setBit(freeze->held, extents[i].start + b);
+        }
+    }
+
+    if (ok && (n > inodeExtents || copy->TT[0] == 'D'))
+        ok = freezeExtents(fs, copy, extents, n, freeze);
+    free(extents);
+    return ok;
+}
+
+// Copy the blocks of a directory for a snapshot, and hand back the extents of the copies in place of its own.
+// The buckets of an indexed directory are copied too, at the first index slot pointing at each, and the slots
+// are pointed at the copies. Returns 1, or 0 if the disk filled up
+int freezeDirectory(sfs_t *fs, int inode, _extent **extents, int *n, _freeze *freeze)
+{
+    _inode_entry *entry = &fs->_inode_table[inode];
+    char buffer[1024], bucket[1024];
+    _dir_header *header = (_dir_header *)buffer;
+    _dir_slot *slots = (_dir_slot *)buffer;
+    uint32_t *moved = NULL, logical, slot = 0, slotCount = 0, i;
+    _extent *copies;
+    int block = 0, count = 0;
+
+    if (entry->flags & inodeFlagIndexed)
+    {
+        readBlock(fs, mapBlock(fs, inode, 0), buffer);
+        slotCount = 1u << header->depth;
+        if ((moved = malloc(slotCount * sizeof(uint32_t))) == NULL)
+            return 0;
+    }
+    if ((copies = malloc(entry->blockCount * sizeof(_extent))) == NULL)
+    {
+        free(moved);
+        return 0;
+    }
+
+    for (logical = 0; logical < entry->blockCount && block != -1; logical++)
+    {
+        readBlock(fs, mapBlock(fs, inode, logical), buffer);
+
+        // slot i shares its bucket with slot i mod 2^depth, which comes first
+        for (i = 0; logical > 0 && i < slotsPerBlock && slot < slotCount && block != -1; i++, slot++)
+        {
+            if (slot < (1u << slots[i].depth))
+            {
+                readBlock(fs, slots[i].bucket, bucket);
+                moved[slot] = block = freshBlock(fs, bucket, freeze);
+            }
+            slots[i].bucket = moved[slot & ((1u << slots[i].depth) - 1)];
+        }
+
+        if (block != -1 && (block = freshBlock(fs, buffer, freeze)) != -1)
+        {
+            if (count > 0 && copies[count - 1].start + copies[count - 1].length == (uint32_t)block)
+                copies[count - 1].length++;
+            else
+            {
+                copies[count].start = block;
+                copies[count++].length = 1;
+            }
+        }
+    }
+
+    free(moved);
+    free(*extents);
+    *extents = copies;
+    *n = count;
+    return block != -1;
+}
+
+// Give the snapshot's copy of an inode the extents it maps; those past the ones the inode holds go to overflow
+// blocks of the snapshot's own, written last to first so each knows the next. Returns 1, or 0 if the disk
+// filled up
+int freezeExtents(sfs_t *fs, _inode_entry *copy, _extent *extents, int n, _freeze *freeze)
+{
+    _extent_block overflow;
+    int k, next = 0;
+
+    for (k = n - 1 - (n - inodeExtents - 1) % blockExtents; n > inodeExtents && k >= inodeExtents; k -= blockExtents)
+    {
+        memset(&overflow, 0, sizeof(overflow));
+        overflow.next = next;
+        overflow.count = n - k < blockExtents ? n - k : blockExtents;
+        memcpy(overflow.ext, extents + k, overflow.count * sizeof(_extent));
+        if ((next = freshBlock(fs, (char *)&overflow, freeze)) == -1)
+            return 0;
+    }
+
+    memset(copy->ext, 0, sizeof(copy->ext));
+    memcpy(copy->ext, extents, (n < inodeExtents ? n : inodeExtents) * sizeof(_extent));
+    copy->extentCount = n;
+    copy->extentBlock = next;
+    return 1;
+}
+
+// Freeze the tree into entry slot of the snapshot table. The inode bitmap and inode table are copied as
+// they are, the blocks of the files are held rather than copied, and the copy goes to a run of blocks along
+// with the bitmap of the held blocks. Runs with opLock exclusive, so no operation is halfway through
+sfs_status takeSnapshot(sfs_t *fs, int slot, const char *name)
+{
+    _super_block *sb = &fs->superBlock;
+    uint32_t runBlocks = snapshotRunBlocks(sb);
+    size_t bitmapSize = (size_t)sb->blockBitmapBlocks * 1024, j;
+    _snapshot_entry *entry = &fs->_snapshot_table[slot];
+    char *run = calloc(runBlocks, 1024);
+    unsigned char *inodes = (unsigned char *)run;
+    _inode_entry *table = (_inode_entry *)(run + (size_t)sb->inodeBitmapBlocks * 1024);
+    _freeze freeze;
+    int i, start = -1, length = 0, ok = 1;
+
+    freeze.held = (unsigned char *)run + (size_t)(sb->inodeBitmapBlocks + sb->inodeTableBlocks) * 1024;
+    freeze.fresh = calloc(1, bitmapSize);
+    if (fs->heldBitmap == NULL)
+        fs->heldBitmap = calloc(1, bitmapSize);
+    if (run == NULL || freeze.fresh == NULL || fs->heldBitmap == NULL)
+    {
+        free(run);
+        free(freeze.fresh);
+        return SFS_ENOMEM;
+    }
+
+    memcpy(inodes, fs->_inode_bitmap, (size_t)sb->inodeBitmapBlocks * 1024);
+    memcpy(table, fs->_inode_table, (size_t)sb->inodeTableBlocks * 1024);
+    deferMetadata(fs);
+    for (i = 0; i < fs->INB && ok; i++)
+    {
+        if (!testBit(inodes, i))
+            continue;
+        // a file removed while open, or waiting for reclaim, is no longer part of the tree
+        if (table[i].flags & inodeFlagOrphan)
+        {
+            clearBit(inodes, i);
+            memset(&table[i], 0, sizeof(_inode_entry));
+        }
+        else
+            ok = freezeInode(fs, i, &table[i], &freeze);
+    }
+
+    if (ok && (start = getBlocks(fs, 0, runBlocks, &length)) != -1 && (uint32_t)length == runBlocks)
+    {
+        for (i = start; i < start + length; i++)
+            setBit(freeze.held, i);
+        writeBlocks(fs, start, length, run);
+
+        memset(entry, 0, sizeof(_snapshot_entry));
+        strcpy(entry->name, name);
+        entry->taken = time(NULL);
+        entry->start = start;
+        entry->blocks = runBlocks;
+        writeBlock(fs, sb->snapshotBlock, (char *)fs->_snapshot_table);
+        for (j = 0; j < bitmapSize; j++)
+            fs->heldBitmap[j] |= freeze.held[j];
+    }
+    else
+    {
+        // what was taken for the snapshot goes back
+        if (start != -1)
+            freeBlocks(fs, start, length);
+        freeMarked(fs, freeze.fresh, NULL);
+        ok = 0;
+    }
+    publishMetadata(fs);
+
+    free(run);
+    free(freeze.fresh);
+    return ok ? SFS_OK : SFS_ENOSPC;
+}
+
+// Mark in map the blocks an inode of the tree uses: the ones its extents map, its overflow extent blocks and
+// the buckets of an indexed directory
+void markInUse(sfs_t *fs, int inode, unsigned char *map)
+{
+    _inode_entry *entry = &fs->_inode_table[inode];
+    _extent_block overflow;
+    _extent *extents;
+    _dir_header header;
+    _dir_slot slots[slotsPerBlock];
+    uint32_t b, slot;
+    int i, n, next;
+
+    if (entry->flags & inodeFlagInline)
+        return;
+
+    if ((n = getExtents(fs, inode, &extents)) > 0)
+    {
+        for (i = 0; i < n; i++)
+        {
+            for (b = 0; b < extents[i].length; b++)
+                setBit(map, extents[i].start + b);
+        }
+    }
+    if (n >= 0)
+        free(extents);
+
+    for (next = entry->extentBlock; next != 0; next = overflow.next)
+    {
+        setBit(map, next);
+        readBlock(fs, next, (char *)&overflow);
+    }
+
+    if ((entry->flags & inodeFlagIndexed) && entry->blockCount > 0)
+    {
+        readBlock(fs, mapBlock(fs, inode, 0), (char *)&header);
+        for (slot = 0; slot < (1u << header.depth); slot++)
+        {
+            if (slot % slotsPerBlock == 0)
+                readBlock(fs, mapBlock(fs, inode, 1 + slot / slotsPerBlock), (char *)slots);
+            setBit(map, slots[slot % slotsPerBlock].bucket);
+        }
+    }
+}
+
+// Free, in runs, the blocks set in map but not in keep (NULL = none kept)
+void freeMarked(sfs_t *fs, const unsigned char *map, const unsigned char *keep)
+{
+    int i, from = -1;
+
+    deferMetadata(fs);
+    for (i = fs->superBlock.dataStart; i <= fs->BLB; i++)
+    {
+        if (i < fs->BLB && testBit(map, i) && (keep == NULL || !testBit(keep, i)))
+        {
+            if (from == -1)
+                from = i;
+        }
+        else if (from != -1)
+        {
+            freeBlocks(fs, from, i - from);
+            from = -1;
+        }
+    }
+    publishMetadata(fs);
+}
+
+// Delete the snapshot in entry slot of the snapshot table; the blocks it held that neither the tree nor
+// another snapshot uses are freed. Runs with opLock exclusive
+sfs_status dropSnapshot(sfs_t *fs, int slot)
+{
+    _snapshot_entry *entry = &fs->_snapshot_table[slot];
+    uint32_t bitmapBlocks = fs->superBlock.blockBitmapBlocks;
+    size_t bitmapSize = (size_t)bitmapBlocks * 1024;
+    unsigned char *held, *others, *keep;
+    sfs_status status;
+    int i;
+
+    held = malloc(bitmapSize);
+    keep = calloc(1, bitmapSize);
+    if (held == NULL || keep == NULL)
+    {
+        free(held);
+        free(keep);
+        return SFS_ENOMEM;
+    }
+    if (!diskRead(fs, entry->start + entry->blocks - bitmapBlocks, bitmapBlocks, (char *)held))
+        status = SFS_EIO;
+    else
+        status = heldBlocks(fs, slot, &others);
+    if (status != SFS_OK)
+    {
+        free(held);
+        free(keep);
+        return status;
+    }
+
+    // a block stays if another snapshot holds it or the tree uses it, orphans waiting for reclaim included
+    if (others != NULL)
+        memcpy(keep, others, bitmapSize);
+    for (i = 0; i < fs->INB; i++)
+    {
+        if (testBit(fs->_inode_bitmap, i))
+            markInUse(fs, i, keep);
+    }
+
+    memset(entry, 0, sizeof(_snapshot_entry));
+    writeBlock(fs, fs->superBlock.snapshotBlock, (char *)fs->_snapshot_table);
+    free(fs->heldBitmap);
+    fs->heldBitmap = others;
+    freeMarked(fs, held, keep);
+
+    free(held);
+    free(keep);
+    return SFS_OK;
+}
+
+// PUBLIC OPERATIONS
+
+const char *sfs_strerror(sfs_status status)
+{
+    switch (status)
+    {
+    case SFS_OK:
+        return "Success";
+    case SFS_ENOENT:
+        return "No such file or directory";
+    case SFS_EEXIST:
+        return "Already exists";
+    case SFS_ENOTDIR:
+        return "Not a directory";
+    case SFS_EISDIR:
+        return "Is a directory";
+    case SFS_ENAMETOOLONG:
+        return "Name too long";
+    case SFS_ENOSPC:
+        return "Disk is full";
+    case SFS_ENOINODE:
+        return "Inode table is full";
+    case SFS_EDIRFULL:
+        return "Maximum directory entries reached";
+    case SFS_EBUSY:
+        return "Cannot remove the current directory or a directory above it";
+    case SFS_EINVAL:
+        return "Invalid argument";
+    case SFS_EIO:
+        return "Input/output error";
+    case SFS_ENOMEM:
+        return "Not enough memory";
+    case SFS_EFORMAT:
+        return "Not an SFS image";
+    case SFS_EOLDFORMAT:
+        return "Old text format image; convert it with sfsconv";
+    case SFS_EVERSION:
+        return "Unsupported format version";
+    case SFS_ECORRUPT:
+        return "Corrupt image";
+    case SFS_EBADF:
+        return "File not open for that";
+    case SFS_EROFS:
+        return "Snapshot mounted read-only";
+    case SFS_ESNAPFULL:
+        return "Too many snapshots";
+    }
+    return "Unknown error";
+}
+
+// Mount an image; the journal of an image left by a crash is replayed first
+sfs_status sfs_mount(const char *image, const sfs_options_t *options, sfs_t **out)
+{
+    sfs_t *fs;
+    sfs_status status;
+
+    *out = NULL;
+    fs = calloc(1, sizeof(sfs_t));
+    if (fs == NULL || (fs->diskPath = strdup(image)) == NULL)
+    {
+        free(fs);
+        return SFS_ENOMEM;
+    }
+
+    fs->cacheBlocks = options != NULL ? options->cacheBlocks : defaultCacheBlocks;
+    fs->mapImage = options != NULL && options->mapImage;
+    fs->deferredReclaim = options != NULL && options->deferredReclaim;
+    fs->perf = options != NULL && options->perf;
+    fs->compress = options != NULL && options->compress;
+    if (options != NULL && options->snapshot != NULL && (fs->snapshotName = strdup(options->snapshot)) == NULL)
+    {
+        free(fs->diskPath);
+        free(fs);
+        return SFS_ENOMEM;
+    }
+    fs->currentDirectoryInode = 0; // first inode entry is for root directory
+    strcpy(fs->currrentWorkingDirectory, "/");
+    fs->diskFd = -1;
+    fs->journalHead = 1;
+    fs->journalSequence = 1;
+    initLocks(fs);
+
+    status = mountMetaData(fs);
+    if (status == SFS_OK)
+        status = initInodeLocks(fs);
+    if (status == SFS_OK)
+        status = initCache(fs);
+    if (status == SFS_OK)
+        status = initJournal(fs);
+    if (status == SFS_OK)
+        status = initDentryCache(fs);
+    if (status != SFS_OK)
+    {
+        // nothing was written yet, so there is nothing to sync
+        if (fs->diskFd != -1)
+            close(fs->diskFd);
+        fs->diskFd = -1;
+        sfs_unmount(fs);
+        return status;
+    }
+    // an older image is marked with the current version before anything it could not read is written
+    if (fs->superBlock.state == superStateClean || fs->superBlock.version != sfsVersion)
+    {
+        fs->superBlock.version = sfsVersion;
+        writeSuperBlock(fs, 0);
+    }
+
+    *out = fs;
+    return SFS_OK;
+}
+
+// Write everything home and release the handle
+sfs_status sfs_unmount(sfs_t *fs)
+{
+    sfs_status status = SFS_OK;
+
+    if (fs == NULL)
+        return SFS_EINVAL;
+
+    if (fs->diskFd != -1)
+    {
+        status = sfs_sync(fs);
+        if (status == SFS_OK)
+            writeSuperBlock(fs, 1);
+        if (fs->ioFailed)
+            status = SFS_EIO;
+        if (fs->diskMap != NULL)
+            munmap(fs->diskMap, (size_t)fs->BLB * 1024);
+        if (close(fs->diskFd) != 0 && status == SFS_OK)
+            status = SFS_EIO;
+    }
+
+    free(fs->_block_bitmap);
+    free(fs->_inode_bitmap);
+    free(fs->_inode_table);
+    free(fs->_share_table);
+    free(fs->shareHead);
+    free(fs->shareNext);
+    free(fs->_snapshot_table);
+    free(fs->heldBitmap);
+    free(fs->snapshotName);
+    free(fs->blockGroupFree);
+    free(fs->inodeGroupFree);
+    free(fs->_cache);
+    free(fs->cacheHash);
+    free(fs->_pending);
+    free(fs->pendingHash);
+    free(fs->freedRuns);
+    free(fs->journaledSet);
+    free(fs->journalBuffer);
+    free(fs->deferredDirty);
+    free(fs->deferredBlocks);
+    free(fs->reclaimQueue);
+    free(fs->_dentry_cache);
+    free(fs->inodeGeneration);
+    free(fs->openCount);
+    free(fs->diskPath);
+    destroyLocks(fs);
+    free(fs);
+    return status;
+}
+
+// Log the operations since the last commit as one journal commit; without a journal there is nothing to do
+// Operations under way are waited for, and new ones wait for the commit
+sfs_status sfs_commit(sfs_t *fs)
+{
+    if (fs->superBlock.journalBlocks > 0)
+    {
+        pthread_rwlock_wrlock(&fs->opLock);
+        pthread_rwlock_wrlock(&fs->journalLock);
+        commitJournal(fs);
+        pthread_rwlock_unlock(&fs->journalLock);
+        pthread_rwlock_unlock(&fs->opLock);
+    }
+    return fs->ioFailed ? SFS_EIO : SFS_OK;
+}
+
+// Make everything written so far reach the disk file; with a journal the open transaction is
+// committed and the log is emptied, so the image is complete without a replay
+sfs_status sfs_sync(sfs_t *fs)
+{
+    pthread_rwlock_wrlock(&fs->opLock);
+    if (fs->superBlock.journalBlocks > 0)
+    {
+        pthread_rwlock_wrlock(&fs->journalLock);
+        commitJournal(fs);
+        checkpointJournal(fs);
+        pthread_rwlock_unlock(&fs->journalLock);
+    }
+    else
+        writeBack(fs);
+    pthread_rwlock_unlock(&fs->opLock);
+    return fs->ioFailed ? SFS_EIO : SFS_OK;
+}
+
+// Move to directory; the root when the path is "/"
+sfs_status sfs_chdir(sfs_t *fs, const char *path)
+{
+    int parent, inode;
+    char name[maxNameLength + 1], cwd[maxPathLength], full[maxPathLength];
+    uint32_t generation;
+    sfs_status status;
+
+    // the path is made absolute first, so what is walked and what is kept agree even if another thread moves meanwhile
+    currentDirectory(fs, cwd, &generation);
+    if (!normalizePath(cwd, path, full))
+        return SFS_ENAMETOOLONG;
+
+    pthread_rwlock_rdlock(&fs->opLock);
+    if ((status = resolvePath(fs, full, lockNone, lockShared, &parent, name, &inode)) != SFS_OK || inode == -1)
+    {
+        pthread_rwlock_unlock(&fs->opLock);
+        return status != SFS_OK ? status : SFS_ENOENT;
+    }
+
+    // can't cd into a file, right?
+    if (fs->_inode_table[inode].TT[0] != 'D')
+        status = SFS_ENOTDIR;
+    else
+    {
+        // the directory is locked, so nobody can remove it before it becomes the current one
+        pthread_mutex_lock(&fs->cwdLock);
+        fs->currentDirectoryInode = inode; // just keep track of which inode entry in the table corresponds to this directory
+        fs->currentDirectoryGeneration = fs->inodeGeneration[inode];
+        strcpy(fs->currrentWorkingDirectory, full); // can use it in the prompt
+        pthread_mutex_unlock(&fs->cwdLock);
+    }
+
+    releasePath(fs, parent, lockNone, inode, lockShared);
+    pthread_rwlock_unlock(&fs->opLock);
+    return status;
+}
+
+const char *sfs_getcwd(sfs_t *fs)
+{
+    return fs->currrentWorkingDirectory;
+}
+
+// Tell what a path refers to; the root is named "/"
+sfs_status sfs_stat(sfs_t *fs, const char *path, sfs_entry_t *entry)
+{
+    int parent, inode;
+    char name[maxNameLength + 1];
+    sfs_status status;
+
+    pthread_rwlock_rdlock(&fs->opLock);
+    if ((status = resolvePath(fs, path, lockNone, lockShared, &parent, name, &inode)) == SFS_OK && inode == -1)
+        status = SFS_ENOENT;
+    if (status == SFS_OK)
+    {
+        describe(fs, inode, name[0] != 0 ? name : "/", entry);
+        releasePath(fs, parent, lockNone, inode, lockShared);
+    }
+    pthread_rwlock_unlock(&fs->opLock);
+
+    return status;
+}
+
+// Call visit for every entry of a directory
+sfs_status sfs_list(sfs_t *fs, const char *path, sfs_list_fn visit, void *arg)
+{
+    _listing listing = {visit, arg};
+    int parent, inode;
+    char name[maxNameLength + 1];
+    sfs_status status;
+
+    pthread_rwlock_rdlock(&fs->opLock);
+    if ((status = resolvePath(fs, path, lockNone, lockShared, &parent, name, &inode)) == SFS_OK && inode == -1)
+        status = SFS_ENOENT;
+    if (status == SFS_OK)
+    {
+        if (fs->_inode_table[inode].TT[0] != 'D')
+            status = SFS_ENOTDIR;
+        else
+            walkDirectory(fs, inode, listEntry, &listing);
+        releasePath(fs, parent, lockNone, inode, lockShared);
+    }
+    pthread_rwlock_unlock(&fs->opLock);
+
+    return status;
+}
+
+// Create new directory
+sfs_status sfs_mkdir(sfs_t *fs, const char *path)
+{
+    int inode;
+    sfs_status status;
+
+    if (path[0] == 0)
+        return SFS_EINVAL;
+    if (fs->snapshotName != NULL)
+        return SFS_EROFS;
+
+    pthread_rwlock_rdlock(&fs->opLock);
+    if ((status = makePath(fs, path, "DI", &inode)) == SFS_OK)
+    {
+        writeInode(fs, inode);
+        unlockInode(fs, inode, lockExclusive);
+    }
+    pthread_rwlock_unlock(&fs->opLock);
+
+    return status;
+}
+
+// Remove file or directory
+/**
+ * Read inode data from inode table
+ * Read data blocks index from inode
+ * Traverse through all directory entries
+ * If directory entry is a file then call removeFile()
+ * If directory entry is a directory then call removeDirectory()
+ * Return data blocks to free block list
+ * Return inode to free inode list
+ * Write inode table in disk
+ */
+sfs_status sfs_remove(sfs_t *fs, const char *path)
+{
+    char inodeType;
+    char name[maxNameLength + 1], cwd[maxPathLength], full[maxPathLength];
+    int parent, inode;
+    uint32_t generation;
+    size_t n;
+    _entry_location where;
+    sfs_status status;
+
+    if (fs->snapshotName != NULL)
+        return SFS_EROFS;
+
+    pthread_rwlock_rdlock(&fs->opLock);
+    if ((status = resolvePath(fs, path, lockExclusive, lockExclusive, &parent, name, &inode)) == SFS_OK && inode == -1)
+    {
+        releasePath(fs, parent, lockExclusive, -1, lockExclusive);
+        status = SFS_ENOENT;
+    }
+    if (status != SFS_OK)
+    {
+        pthread_rwlock_unlock(&fs->opLock);
+        return status;
+    }
+
+    // the current directory and the ones above it (the root included) must stay; it is checked with
+    // the tree locked, so a thread moving into the tree either got there first or cannot get past it
+    currentDirectory(fs, cwd, &generation);
+    normalizePath(cwd, path, full);
+    n = strlen(full);
+    if (name[0] == 0 || (strncmp(cwd, full, n) == 0 && (cwd[n] == 0 || cwd[n] == '/')))
+    {
+        releasePath(fs, parent, lockExclusive, inode, lockExclusive);
+        pthread_rwlock_unlock(&fs->opLock);
+        return SFS_EBUSY;
+    }
+
+    findEntry(fs, parent, name, &where);
+
+    // the bitmap and inode table blocks touched by a whole tree are written once, at the end
+    deferMetadata(fs);
+    inodeType = fs->_inode_table[inode].TT[0];
+    if (fs->deferredReclaim)
+        queueOrphan(fs, inode);
+    else if (inodeType == 'F')
+        removeFile(fs, inode);
+    else
+        removeDirectory(fs, inode);
+
+    removeEntry(fs, parent, &where);
+    publishMetadata(fs);
+
+    releasePath(fs, parent, lockExclusive, inode, lockExclusive);
+    pthread_rwlock_unlock(&fs->opLock);
+    return SFS_OK;
+}
+
+// Hand out the next piece of a buffer
+long bufferSource(void *arg, char *buffer, size_t size)
+{
+    _buffer_source *from = arg;
+    size_t n = from->left < size ? from->left : size;
+
+    memcpy(buffer, from->data, n);
+    from->data += n;
+    from->left -= n;
+    return n;
+}
+
+// Create a file holding length bytes of data
+sfs_status sfs_create(sfs_t *fs, const char *path, const void *data, uint64_t length)
+{
+    _buffer_source from = {data, length};
+
+    if (length == SFS_LENGTH_UNKNOWN)
+        return SFS_EINVAL;
+    return sfs_create_from(fs, path, length, bufferSource, &from, NULL);
+}
+
+// Create a file and fill it from a source; length bytes, or (SFS_LENGTH_UNKNOWN) up to the end of the source
+// If the contents do not fit or the source fails, the file keeps what was written and written tells how much
+sfs_status sfs_create_from(sfs_t *fs, const char *path, uint64_t length, sfs_source_fn source, void *arg, uint64_t *written)
+{
+    int inode;
+    sfs_status status;
+
+    if (written != NULL)
+        *written = 0;
+    if (fs->snapshotName != NULL)
+        return SFS_EROFS;
+
+    pthread_rwlock_rdlock(&fs->opLock);
+    if ((status = makePath(fs, path, "FI", &inode)) != SFS_OK)
+    {
+        pthread_rwlock_unlock(&fs->opLock);
+        return status;
+    }
+
+    status = fillFile(fs, inode, length, source, arg);
+    if (written != NULL)
+        *written = fs->_inode_table[inode].size;
+
+    // Write inode table in disk
+    writeInode(fs, inode);
+    unlockInode(fs, inode, lockExclusive);
+    pthread_rwlock_unlock(&fs->opLock);
+    return status;
+}
+
+// Pass the contents of a file to a sink, readAheadBlocks at a time and exactly size bytes in all
+sfs_status sfs_read(sfs_t *fs, const char *path, sfs_sink_fn sink, void *arg)
+{
+    char name[maxNameLength + 1];
+    char *buffer, *data;
+    _extent *extents;
+    uint64_t left, chunk;
+    uint32_t done, run;
+    int parent, inode, i, n;
+    sfs_status status;
+
+    pthread_rwlock_rdlock(&fs->opLock);
+    if ((status = resolvePath(fs, path, lockNone, lockShared, &parent, name, &inode)) != SFS_OK || inode == -1)
+    {
+        pthread_rwlock_unlock(&fs->opLock);
+        return status != SFS_OK ? status : SFS_ENOENT;
+    }
+
+    buffer = NULL;
+    if (fs->_inode_table[inode].TT[0] != 'F')
+        status = SFS_EISDIR;
+    else if ((buffer = malloc(readAheadBlocks * 1024)) == NULL)
+        status = SFS_ENOMEM;
+    if (status != SFS_OK)
+    {
+        releasePath(fs, parent, lockNone, inode, lockShared);
+        pthread_rwlock_unlock(&fs->opLock);
+        return status;
+    }
+
+    // read each extent sequentially; an inline file is all in its inode, a packed one is unpacked chunk by chunk
+    left = fs->_inode_table[inode].size;
+    if ((fs->_inode_table[inode].flags & inodeFlagInline) && left > 0 && sink(arg, (char *)fs->_inode_table[inode].ext, left) != 0)
+        status = SFS_EIO;
+    if ((fs->_inode_table[inode].flags & inodeFlagPacked) && left > 0)
+    {
+        status = readPacked(fs, inode, 0, left, sink, arg);
+        left = 0;
+    }
+    n = getExtents(fs, inode, &extents);
+    for (i = 0; i < n && left > 0 && status == SFS_OK; i++)
+    {
+        adviseSequential(fs, extents[i].start, extents[i].length);
+        for (done = 0; done < extents[i].length && left > 0 && status == SFS_OK; done += run)
+        {
+            run = extents[i].length - done < readAheadBlocks ? extents[i].length - done : readAheadBlocks;
+            data = blockData(fs, extents[i].start + done, run, buffer);
+            chunk = left < (uint64_t)run * 1024 ? left : (uint64_t)run * 1024;
+            if (sink(arg, data, chunk) != 0)
+                status = SFS_EIO;
+            left -= chunk;
+        }
+    }
+    free(extents);
+    free(buffer);
+
+    releasePath(fs, parent, lockNone, inode, lockShared);
+    pthread_rwlock_unlock(&fs->opLock);
+    return status;
+}
+
+// Open a file; with SFS_O_CREATE a missing one is made, empty
+sfs_status sfs_open(sfs_t *fs, const char *path, int flags, sfs_file_t **file)
+{
+    char name[maxNameLength + 1];
+    int parent, inode, made = 0, mode = flags & SFS_O_TRUNC ? lockExclusive : lockShared;
+    sfs_status status;
+
+    *file = NULL;
+    if (!(flags & (SFS_O_READ | SFS_O_WRITE)) || ((flags & (SFS_O_CREATE | SFS_O_TRUNC | SFS_O_APPEND)) && !(flags & SFS_O_WRITE)))
+        return SFS_EINVAL;
+    if ((flags & SFS_O_WRITE) && fs->snapshotName != NULL)
+        return SFS_EROFS;
+    if ((*file = malloc(sizeof(sfs_file_t))) == NULL)
+        return SFS_ENOMEM;
+
+    pthread_rwlock_rdlock(&fs->opLock);
+    // a file another thread makes between the lookup and makePath() is opened after all
+    do
+    {
+        if ((status = resolvePath(fs, path, lockNone, mode, &parent, name, &inode)) == SFS_OK && inode == -1)
+        {
+            if (!(flags & SFS_O_CREATE))
+                status = SFS_ENOENT;
+            else if ((status = makePath(fs, path, "FI", &inode)) == SFS_OK)
+            {
+                writeInode(fs, inode);
+                mode = lockExclusive;
+                made = 1;
+            }
+        }
+    } while (status == SFS_EEXIST && !(flags & SFS_O_EXCL));
+
+    if (status == SFS_OK && !made)
+    {
+        if (flags & SFS_O_CREATE && flags & SFS_O_EXCL)
+            status = SFS_EEXIST;
+        else if (fs->_inode_table[inode].TT[0] != 'F')
+            status = SFS_EISDIR;
+        else if (flags & SFS_O_TRUNC && fs->_inode_table[inode].size > 0)
+        {
+            truncateFile(fs, inode, 0);
+            writeInode(fs, inode);
+        }
+    }
+
+    if (status == SFS_OK)
+    {
+        __atomic_add_fetch(&fs->openCount[inode], 1, __ATOMIC_RELAXED);
+        (*file)->fs = fs;
+        (*file)->inode = inode;
+        (*file)->flags = flags;
+        (*file)->position = 0;
+    }
+    if (inode >= 0)
+        unlockInode(fs, inode, mode);
+    pthread_rwlock_unlock(&fs->opLock);
+
+    if (status != SFS_OK)
+    {
+        free(*file);
+        *file = NULL;
+    }
+    return status;
+}
+
+// Close a file; the last handle of a removed file frees it
+sfs_status sfs_close(sfs_file_t *file)
+{
+    sfs_t *fs = file->fs;
+
+    pthread_rwlock_rdlock(&fs->opLock);
+    lockInode(fs, file->inode, lockExclusive);
+    if (__atomic_sub_fetch(&fs->openCount[file->inode], 1, __ATOMIC_RELAXED) == 0 && (fs->_inode_table[file->inode].flags & inodeFlagOrphan))
+        releaseOrphan(fs, file->inode);
+    unlockInode(fs, file->inode, lockExclusive);
+    pthread_rwlock_unlock(&fs->opLock);
+
+    free(file);
+    return fs->ioFailed ? SFS_EIO : SFS_OK;
+}
+
+// Read up to size bytes at offset; done is short only at the end of the file
+sfs_status sfs_pread(sfs_file_t *file, void *buffer, size_t size, uint64_t offset, size_t *done)
+{
+    sfs_t *fs = file->fs;
+    uint64_t got = 0;
+    sfs_status status = SFS_EBADF;
+
+    if (file->flags & SFS_O_READ)
+    {
+        pthread_rwlock_rdlock(&fs->opLock);
+        lockInode(fs, file->inode, lockShared);
+        status = readRange(fs, file->inode, buffer, offset, size, &got);
+        unlockInode(fs, file->inode, lockShared);
+        pthread_rwlock_unlock(&fs->opLock);
+    }
+
+    if (done != NULL)
+        *done = got;
+    return status;
+}
+
+// Write size bytes at offset; past the end of the file the gap is filled with zeros
+// Only the blocks the bytes fall in and the inode are written
+sfs_status sfs_pwrite(sfs_file_t *file, const void *data, size_t size, uint64_t offset, size_t *done)
+{
+    sfs_t *fs = file->fs;
+    uint64_t put = 0;
+    sfs_status status = SFS_EBADF;
+
+    if (file->flags & SFS_O_WRITE)
+    {
+        pthread_rwlock_rdlock(&fs->opLock);
+        lockInode(fs, file->inode, lockExclusive);
+        status = writeRange(fs, file->inode, data, offset, size, &put);
+        writeInode(fs, file->inode);
+        unlockInode(fs, file->inode, lockExclusive);
+        pthread_rwlock_unlock(&fs->opLock);
+    }
+
+    if (done != NULL)
+        *done = put;
+    return status;
+}
+
+// Copy up to length bytes at offset to a host file descriptor: a file, a pipe, a socket or a terminal
+// The kernel moves them from the image (copy_file_range() to a file, sendfile() otherwise) where it can
+sfs_status sfs_sendfile(sfs_file_t *file, int fd, uint64_t offset, uint64_t length, uint64_t *sent)
+{
+    sfs_t *fs = file->fs;
+    uint64_t put = 0;
+    sfs_status status = SFS_EBADF;
+
+    if (file->flags & SFS_O_READ)
+    {
+        pthread_rwlock_rdlock(&fs->opLock);
+        lockInode(fs, file->inode, lockShared);
+        status = sendRange(fs, file->inode, fd, offset, length, &put);
+        unlockInode(fs, file->inode, lockShared);
+        pthread_rwlock_unlock(&fs->opLock);
+    }
+
+    if (sent != NULL)
+        *sent = put;
+    return status;
+}
+
+// Read at the position of the handle and move it past what was read
+sfs_status sfs_fread(sfs_file_t *file, void *buffer, size_t size, size_t *done)
+{
+    size_t got;
+    sfs_status status = sfs_pread(file, buffer, size, file->position, &got);
+
+    file->position += got;
+    if (done != NULL)
+        *done = got;
+    return status;
+}
+
+// Write at the position of the handle, or at the end with SFS_O_APPEND, and move it past what was written
+sfs_status sfs_fwrite(sfs_file_t *file, const void *data, size_t size, size_t *done)
+{
+    size_t put;
+    sfs_status status;
+
+    if (file->flags & SFS_O_APPEND)
+        return sfs_append(file, data, size, done);
+
+    status = sfs_pwrite(file, data, size, file->position, &put);
+    file->position += put;
+    if (done != NULL)
+        *done = put;
+    return status;
+}
+
+// Write at the end of the file, wherever other handles have moved it; the position ends up after the data
+sfs_status sfs_append(sfs_file_t *file, const void *data, size_t size, size_t *done)
+{
+    sfs_t *fs = file->fs;
+    uint64_t put = 0, end = 0;
+    sfs_status status = SFS_EBADF;
+
+    if (file->flags & SFS_O_WRITE)
+    {
+        pthread_rwlock_rdlock(&fs->opLock);
+        lockInode(fs, file->inode, lockExclusive);
+        end = fs->_inode_table[file->inode].size;
+        status = writeRange(fs, file->inode, data, end, size, &put);
+        writeInode(fs, file->inode);
+        unlockInode(fs, file->inode, lockExclusive);
+        pthread_rwlock_unlock(&fs->opLock);
+        file->position = end + put;
+    }
+
+    if (done != NULL)
+        *done = put;
+    return status;
+}
+
+// Move the position of the handle; it may go past the end of the file
+sfs_status sfs_seek(sfs_file_t *file, int64_t offset, int whence, uint64_t *position)
+{
+    sfs_t *fs = file->fs;
+    uint64_t base;
+
+    if (whence == SFS_SEEK_SET)
+        base = 0;
+    else if (whence == SFS_SEEK_CUR)
+        base = file->position;
+    else if (whence == SFS_SEEK_END)
+    {
+        pthread_rwlock_rdlock(&fs->opLock);
+        lockInode(fs, file->inode, lockShared);
+        base = fs->_inode_table[file->inode].size;
+        unlockInode(fs, file->inode, lockShared);
+        pthread_rwlock_unlock(&fs->opLock);
+    }
+    else
+        return SFS_EINVAL;
+
+    if (offset < 0 && (uint64_t)-offset > base)
+        return SFS_EINVAL;
+
+    file->position = base + offset;
+    if (position != NULL)
+        *position = file->position;
+    return SFS_OK;
+}
+
+// Cut the file to length bytes, or extend it with zeros; the position stays where it is
+sfs_status sfs_truncate(sfs_file_t *file, uint64_t length)
+{
+    sfs_t *fs = file->fs;
+    sfs_status status;
+
+    if (!(file->flags & SFS_O_WRITE))
+        return SFS_EBADF;
+
+    pthread_rwlock_rdlock(&fs->opLock);
+    lockInode(fs, file->inode, lockExclusive);
+    status = truncateFile(fs, file->inode, length);
+    writeInode(fs, file->inode);
+    unlockInode(fs, file->inode, lockExclusive);
+    pthread_rwlock_unlock(&fs->opLock);
+
+    return status;
+}
+
+// Report usage and the counters of the caches, the journal and reclaim; takes constant time
+sfs_status sfs_usage(sfs_t *fs, sfs_usage_t *usage)
+{
+    memset(usage, 0, sizeof(*usage));
+    usage->blocks = fs->BLB;
+    pthread_mutex_lock(&fs->blockBitmapLock);
+    usage->freeBlocks = fs->freeDiskBlocks;
+    pthread_mutex_unlock(&fs->blockBitmapLock);
+    usage->inodes = fs->INB;
+    pthread_mutex_lock(&fs->inodeBitmapLock);
+    usage->freeInodes = fs->freeInodeEntries;
+    pthread_mutex_unlock(&fs->inodeBitmapLock);
+
+    // the countEvent() counters are read the same way they are bumped
+    usage->dentryEntries = dentryCacheSize;
+    usage->dentryHits = __atomic_load_n(&fs->dentryHits, __ATOMIC_RELAXED);
+    usage->dentryMisses = __atomic_load_n(&fs->dentryMisses, __ATOMIC_RELAXED);
+
+    usage->mapped = fs->diskMap != NULL;
+    usage->cacheBlocks = fs->cacheBlocks;
+    usage->cacheHits = __atomic_load_n(&fs->cacheHits, __ATOMIC_RELAXED);
+    usage->cacheMisses = __atomic_load_n(&fs->cacheMisses, __ATOMIC_RELAXED);
+    usage->cacheEvictions = __atomic_load_n(&fs->cacheEvictions, __ATOMIC_RELAXED);
+    usage->cacheWritebacks = __atomic_load_n(&fs->cacheWritebacks, __ATOMIC_RELAXED);
+
+    usage->journalBlocks = fs->superBlock.journalBlocks;
+    pthread_rwlock_rdlock(&fs->journalLock);
+    usage->journalCommits = fs->journalCommits;
+    usage->journalLogged = fs->journalLogged;
+    usage->journalCheckpoints = fs->journalCheckpoints;
+    usage->journalReplayed = fs->journalReplayed;
+    pthread_rwlock_unlock(&fs->journalLock);
+
+    pthread_mutex_lock(&fs->reclaimLock);
+    usage->reclaimWaiting = fs->reclaimCount;
+    pthread_mutex_unlock(&fs->reclaimLock);
+    usage->reclaimed = __atomic_load_n(&fs->reclaimedInodes, __ATOMIC_RELAXED);
+    return SFS_OK;
+}
+
+// Walk the bitmaps, the inode table and every directory; commits and operations wait meanwhile
+sfs_status sfs_survey(sfs_t *fs, sfs_survey_t *survey)
+{
+    _inode_entry *entry;
+    _dir_header header;
+    uint64_t entries, slots, bound;
+    int i, n, size;
+
+    memset(survey, 0, sizeof(*survey));
+    pthread_rwlock_wrlock(&fs->opLock);
+
+    for (i = fs->superBlock.dataStart; i < fs->BLB && (i = scanFree(fs->_block_bitmap, fs->blockGroupFree, i, fs->BLB)) != -1; i += n)
+    {
+        n = freeRunLength(fs->_block_bitmap, i, fs->BLB, fs->BLB);
+        survey->freeRuns++;
+        if ((uint32_t)n > survey->largestFreeRun)
+            survey->largestFreeRun = n;
+    }
+
+    for (i = fs->superBlock.dataStart; fs->_share_table != NULL && i < fs->BLB; i++)
+    {
+        if (fs->_share_table[i].refs > 1)
+        {
+            survey->sharedBlocks++;
+            survey->savedBlocks += fs->_share_table[i].refs - 1;
+        }
+    }
+
+    for (i = 0; i < fs->INB; i++)
+    {
+        entry = &fs->_inode_table[i];
+        if (!testBit(fs->_inode_bitmap, i))
+            continue;
+        if (entry->flags & inodeFlagOrphan)
+        {
+            survey->orphans++;
+            continue;
+        }
+
+        if (entry->TT[0] == 'F')
+        {
+            // classes grow 64 times each from 1 KiB
+            for (size = 0, bound = 0; size < SFS_SIZE_CLASSES - 1 && entry->size > bound; size++)
+                bound = bound == 0 ? 1024 : bound * 64;
+            survey->files++;
+            survey->filesBySize[size]++;
+            survey->fileBytes += entry->size;
+            survey->fileBlocks += entry->blockCount;
+            survey->fileExtents += entry->extentCount;
+            if (entry->flags & inodeFlagInline)
+                survey->inlineFiles++;
+            if (entry->flags & inodeFlagPacked)
+                survey->packedFiles++;
+            continue;
+        }
+
+        entries = 0;
+        if (entry->flags & inodeFlagIndexed)
+        {
+            readBlock(fs, mapBlock(fs, i, 0), (char *)&header);
+            entries = header.entries;
+            slots = (uint64_t)header.buckets * 4;
+            survey->indexedDirectories++;
+        }
+        else
+        {
+            walkDirectory(fs, i, countEntry, &entries);
+            slots = (uint64_t)entry->blockCount * 4;
+        }
+        survey->directories++;
+        survey->directoriesByFill[entries == 0 || slots == 0 ? 0 : 1 + (entries * 4 - 1) / slots]++;
+        survey->entries += entries;
+        survey->entrySlots += slots;
+    }
+
+    pthread_rwlock_unlock(&fs->opLock);
+    return SFS_OK;
+}
+
+// Report the calls that went to the image; all zero unless it was mounted with perf on
+sfs_status sfs_perf(sfs_t *fs, sfs_perf_t *perf)
+{
+    int i, kind;
+    sfs_perf_counter_t *from, *to;
+
+    memset(perf, 0, sizeof(*perf));
+    perf->enabled = fs->perf;
+    for (kind = 0; kind < perfKinds; kind++)
+    {
+        from = &fs->perfCounters[kind];
+        to = kind == perfRead ? &perf->reads : kind == perfWrite ? &perf->writes : kind == perfFlush ? &perf->flushes : &perf->copies;
+        to->calls = __atomic_load_n(&from->calls, __ATOMIC_RELAXED);
+        to->bytes = __atomic_load_n(&from->bytes, __ATOMIC_RELAXED);
+        to->seeks = __atomic_load_n(&from->seeks, __ATOMIC_RELAXED);
+        for (i = 0; i < SFS_LATENCY_BUCKETS; i++)
+            to->latency[i] = __atomic_load_n(&from->latency[i], __ATOMIC_RELAXED);
+    }
+
+    return SFS_OK;
+}
+
+// Free up to limit orphans left by deferred reclaim (-1 = all of them); returns how many were freed
+int sfs_reclaim(sfs_t *fs, int limit)
+{
+    int done;
+
+    pthread_rwlock_rdlock(&fs->opLock);
+    done = reclaimOrphans(fs, limit);
+    pthread_rwlock_unlock(&fs->opLock);
+
+    return done;
+}
+
+// Freeze the whole tree under a name. Only metadata is copied; the files' blocks are held until the snapshot
+// is deleted, and the tree writes around them. Operations under way are waited for, and new ones wait
+sfs_status sfs_snapshot(sfs_t *fs, const char *name)
+{
+    sfs_status status = SFS_OK;
+    int slot;
+
+    if (name[0] == 0)
+        return SFS_EINVAL;
+    if (strlen(name) > snapshotNameLength)
+        return SFS_ENAMETOOLONG;
+    if (fs->snapshotName != NULL)
+        return SFS_EROFS;
+
+    pthread_rwlock_wrlock(&fs->opLock);
+    if (fs->_snapshot_table == NULL)
+        status = createSnapshotTable(fs);
+    if (status == SFS_OK && findSnapshot(fs, name) != -1)
+        status = SFS_EEXIST;
+    for (slot = 0; status == SFS_OK && slot < maxSnapshots && fs->_snapshot_table[slot].name[0] != 0; slot++)
+        ;
+    if (status == SFS_OK && slot == maxSnapshots)
+        status = SFS_ESNAPFULL;
+    if (status == SFS_OK)
+        status = takeSnapshot(fs, slot, name);
+    pthread_rwlock_unlock(&fs->opLock);
+
+    return status;
+}
+
+// Call visit for each snapshot, in the order of the snapshot table
+sfs_status sfs_list_snapshots(sfs_t *fs, sfs_snapshot_fn visit, void *arg)
+{
+    uint32_t bitmapBlocks = fs->superBlock.blockBitmapBlocks;
+    _snapshot_entry *entry;
+    sfs_snapshot_t snapshot;
+    unsigned char *held;
+    sfs_status status = SFS_OK;
+    int i;
+
+    if ((held = malloc((size_t)bitmapBlocks * 1024)) == NULL)
+        return SFS_ENOMEM;
+
+    pthread_rwlock_rdlock(&fs->opLock);
+    for (i = 0; fs->_snapshot_table != NULL && i < maxSnapshots && status == SFS_OK; i++)
+    {
+        entry = &fs->_snapshot_table[i];
+        if (entry->name[0] == 0)
+            continue;
+        if (!diskRead(fs, entry->start + entry->blocks - bitmapBlocks, bitmapBlocks, (char *)held))
+        {
+            status = SFS_EIO;
+            break;
+        }
+
+        memset(&snapshot, 0, sizeof(snapshot));
+        strcpy(snapshot.name, entry->name);
+        snapshot.taken = entry->taken;
+        snapshot.blocks = countUsed(held, 0, fs->BLB);
+        visit(arg, &snapshot);
+    }
+    pthread_rwlock_unlock(&fs->opLock);
+
+    free(held);
+    return status;
+}
+
+// Delete a snapshot; the blocks it alone held are freed. Operations under way are waited for, and new ones wait
+sfs_status sfs_delete_snapshot(sfs_t *fs, const char *name)
+{
+    sfs_status status;
+    int slot;
+
+    if (fs->snapshotName != NULL)
+        return SFS_EROFS;
+
+    pthread_rwlock_wrlock(&fs->opLock);
+    if (name[0] == 0 || (slot = findSnapshot(fs, name)) == -1)
+        status = SFS_ENOENT;
+    else
+        status = dropSnapshot(fs, slot);
+    pthread_rwlock_unlock(&fs->opLock);
+
+    return status;
+}
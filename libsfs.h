@@ -0,0 +1,225 @@
+// libsfs: the SFS file system as a library
+//
+// Every operation takes the handle of a mounted image, returns a status
+// code and prints nothing, so one process can drive several images and
+// the sfs shell is just one client. Paths are absolute or relative to the
+// handle's current directory, with "." and "..".
+//
+// Files are written whole with sfs_create(), or opened with sfs_open() and
+// read, written, appended to and truncated in place through a file handle;
+// only the blocks a change falls in are written, along with the inode. A
+// block other files share or a snapshot holds is copied first, that block
+// alone, and a compressed file is stored plain first, the whole file.
+//
+// sfs_snapshot() freezes the whole tree under a name, in time proportional
+// to the metadata rather than the data: the snapshot shares the blocks of
+// the files until the tree changes them. A snapshot is mounted read-only by
+// naming it in sfs_options_t.snapshot.
+//
+// A handle may be used from several threads at once: operations on
+// different parts of the tree run in parallel, and sfs_commit() waits for
+// the operations under way. The current directory is shared by all of
+// them. A source, sink or listing callback runs while the library holds
+// locks, so it must not call into the same handle.
+
+#ifndef LIBSFS_H
+#define LIBSFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SFS_NAME_MAX 251         // longest name in a directory
+#define SFS_PATH_MAX 1024        // longest path, including the NUL
+#define SFS_SNAPSHOT_NAME_MAX 39 // longest snapshot name
+#define SFS_LENGTH_UNKNOWN UINT64_MAX
+
+typedef struct sfs sfs_t;           // a mounted image
+typedef struct sfs_file sfs_file_t; // a file opened by sfs_open()
+
+// how sfs_open() opens a file: SFS_O_READ, SFS_O_WRITE or both; the others need SFS_O_WRITE
+#define SFS_O_READ 1
+#define SFS_O_WRITE 2
+#define SFS_O_CREATE 4  // create the file if it does not exist
+#define SFS_O_EXCL 8    // with SFS_O_CREATE: fail with SFS_EEXIST if it does
+#define SFS_O_TRUNC 16  // cut the file to 0 bytes
+#define SFS_O_APPEND 32 // sfs_fwrite() always writes at the end of the file
+
+// where sfs_seek() counts from
+#define SFS_SEEK_SET 0
+#define SFS_SEEK_CUR 1
+#define SFS_SEEK_END 2
+
+// status of an operation
+typedef enum
+{
+    SFS_OK = 0,
+    SFS_ENOENT,       // no such file or directory
+    SFS_EEXIST,       // the name already exists
+    SFS_ENOTDIR,      // a directory was expected
+    SFS_EISDIR,       // a file was expected
+    SFS_ENAMETOOLONG, // name or path too long
+    SFS_ENOSPC,       // no free data blocks
+    SFS_ENOINODE,     // no free inodes
+    SFS_EDIRFULL,     // the directory cannot take more entries
+    SFS_EBUSY,        // the current directory or one above it
+    SFS_EINVAL,       // bad argument
+    SFS_EIO,          // the image, a source or a sink failed
+    SFS_ENOMEM,       // out of memory
+    SFS_EFORMAT,      // not an SFS image
+    SFS_EOLDFORMAT,   // old text format image; convert it with sfsconv
+    SFS_EVERSION,     // unsupported format version
+    SFS_ECORRUPT,     // inconsistent metadata
+    SFS_EBADF,        // the file is not open for that
+    SFS_EROFS,        // the image is a snapshot, mounted read-only
+    SFS_ESNAPFULL     // the snapshot table is full
+} sfs_status;
+
+// how an image is mounted; sfs_mount() takes NULL for the defaults
+typedef struct
+{
+    int cacheBlocks;      // buffer cache slots; 0 = write-through (default 64)
+    int mapImage;         // 1 = access the image through mmap
+    int deferredReclaim;  // 1 = sfs_remove() only unlinks; sfs_reclaim() frees the space
+    int perf;             // 1 = count and time the reads, writes and flushes of the image for sfs_perf()
+    int compress;         // 1 = files written whole are stored compressed when that saves blocks
+    const char *snapshot; // name of a snapshot to mount read-only in place of the tree; NULL = the tree
+} sfs_options_t;
+
+// what a name refers to
+typedef struct
+{
+    char name[SFS_NAME_MAX + 1]; // the name in its directory
+    uint32_t inode;              // inode number
+    int isDirectory;             // 1 = directory, 0 = file
+    uint64_t size;               // file length in bytes; 0 for directories
+    uint32_t blocks;             // blocks mapped by the inode
+} sfs_entry_t;
+
+// usage and counters of a mounted image
+typedef struct
+{
+    uint32_t blocks, freeBlocks;
+    uint32_t inodes, freeInodes;
+    int dentryEntries;
+    long dentryHits, dentryMisses;
+    int mapped;      // 1 = the image is memory-mapped and the cache is off
+    int cacheBlocks; // 0 = write-through
+    long cacheHits, cacheMisses, cacheEvictions, cacheWritebacks;
+    uint32_t journalBlocks; // 0 = no journal
+    long journalCommits, journalLogged, journalCheckpoints, journalReplayed;
+    int reclaimWaiting; // orphan inodes waiting for sfs_reclaim()
+    long reclaimed;     // orphan inodes freed so far
+} sfs_usage_t;
+
+#define SFS_SIZE_CLASSES 6 // files by size: empty, up to 1 KiB, 64 KiB, 4 MiB, 256 MiB, larger
+#define SFS_FILL_CLASSES 5 // directories by entry slots in use: none, up to 25%, 50%, 75%, 100%
+
+// what sfs_survey() finds walking the bitmaps, the inode table and the directories
+typedef struct
+{
+    uint32_t freeRuns;       // runs of consecutive free blocks
+    uint32_t largestFreeRun; // blocks in the longest of them
+    uint32_t files, directories;
+    uint32_t indexedDirectories; // directories with a hashed index
+    uint32_t orphans;            // removed inodes waiting for reclaim
+    uint32_t filesBySize[SFS_SIZE_CLASSES];
+    uint64_t fileBytes;   // contents of all files
+    uint32_t fileBlocks;  // blocks mapped by files
+    uint32_t fileExtents; // extents mapping them; as many as there are files when none is fragmented
+    uint32_t inlineFiles; // files small enough to keep their contents in the inode, with no block
+    uint32_t packedFiles; // files stored compressed
+    uint32_t sharedBlocks; // blocks mapped by more than one file, or more than once
+    uint32_t savedBlocks;  // blocks sharing saved: the mappings of shared blocks past the first
+    uint32_t directoriesByFill[SFS_FILL_CLASSES];
+    uint64_t entries, entrySlots; // names in all directories, and the slots their blocks have
+} sfs_survey_t;
+
+// a snapshot, as sfs_list_snapshots() reports it
+typedef struct
+{
+    char name[SFS_SNAPSHOT_NAME_MAX + 1];
+    int64_t taken;   // when, in seconds since the epoch
+    uint32_t blocks; // blocks its tree holds, shared with the current one or not
+} sfs_snapshot_t;
+
+#define SFS_LATENCY_BUCKETS 20 // bucket i counts calls that took under 2^i microseconds; the last one the rest
+
+// calls of one kind that went to the image, and how long they took
+typedef struct
+{
+    long calls;
+    uint64_t bytes;
+    long seeks; // calls that did not start where the previous read or write ended
+    long latency[SFS_LATENCY_BUCKETS];
+} sfs_perf_counter_t;
+
+// what sfs_perf() reports; all zero unless the image was mounted with sfs_options_t.perf
+typedef struct
+{
+    int enabled;
+    sfs_perf_counter_t reads;   // pread() of blocks, or copies out of a mapped image
+    sfs_perf_counter_t writes;  // pwrite() of blocks, or copies into a mapped image; journal records included
+    sfs_perf_counter_t flushes; // fsync(), fdatasync() and msync()
+    sfs_perf_counter_t copies;  // copy_file_range() and sendfile() out of the image
+} sfs_perf_t;
+
+// Called for each entry of a listed directory
+typedef void (*sfs_list_fn)(void *arg, const sfs_entry_t *entry);
+// Called for each snapshot of a listed image
+typedef void (*sfs_snapshot_fn)(void *arg, const sfs_snapshot_t *snapshot);
+// Fills buffer with up to size bytes of new file contents; returns how many, 0 at the end, -1 on error
+typedef long (*sfs_source_fn)(void *arg, char *buffer, size_t size);
+// Takes the next length bytes of a file being read; returns 0, or -1 to stop with SFS_EIO
+typedef int (*sfs_sink_fn)(void *arg, const char *data, size_t length);
+
+const char *sfs_strerror(sfs_status status);
+
+// Mounting; replays the journal of an image left by a crash
+sfs_status sfs_mount(const char *image, const sfs_options_t *options, sfs_t **fs);
+sfs_status sfs_unmount(sfs_t *fs); // close every file first
+sfs_status sfs_commit(sfs_t *fs);  // log the operations since the last commit as one journal commit
+sfs_status sfs_sync(sfs_t *fs);    // commit and write everything home; the journal ends up empty
+
+// Current directory
+sfs_status sfs_chdir(sfs_t *fs, const char *path);
+const char *sfs_getcwd(sfs_t *fs); // changes with the next sfs_chdir()
+
+// Names
+sfs_status sfs_stat(sfs_t *fs, const char *path, sfs_entry_t *entry);
+sfs_status sfs_list(sfs_t *fs, const char *path, sfs_list_fn visit, void *arg);
+sfs_status sfs_mkdir(sfs_t *fs, const char *path);
+sfs_status sfs_remove(sfs_t *fs, const char *path); // a file or a whole tree
+
+// File contents as a whole
+sfs_status sfs_create(sfs_t *fs, const char *path, const void *data, uint64_t length);
+sfs_status sfs_create_from(sfs_t *fs, const char *path, uint64_t length, sfs_source_fn source, void *arg, uint64_t *written);
+sfs_status sfs_read(sfs_t *fs, const char *path, sfs_sink_fn sink, void *arg);
+
+// Open files; a handle keeps the position of sfs_fread() and sfs_fwrite(), so one thread at a time uses it
+// A file removed while open keeps its contents until its last handle is closed
+sfs_status sfs_open(sfs_t *fs, const char *path, int flags, sfs_file_t **file);
+sfs_status sfs_close(sfs_file_t *file);
+sfs_status sfs_pread(sfs_file_t *file, void *buffer, size_t size, uint64_t offset, size_t *done); // short only at the end
+sfs_status sfs_pwrite(sfs_file_t *file, const void *data, size_t size, uint64_t offset, size_t *done); // a gap reads as zeros
+sfs_status sfs_fread(sfs_file_t *file, void *buffer, size_t size, size_t *done);
+sfs_status sfs_fwrite(sfs_file_t *file, const void *data, size_t size, size_t *done);
+sfs_status sfs_append(sfs_file_t *file, const void *data, size_t size, size_t *done); // at the end, whoever else writes
+sfs_status sfs_seek(sfs_file_t *file, int64_t offset, int whence, uint64_t *position);
+sfs_status sfs_truncate(sfs_file_t *file, uint64_t length); // cut, or extend with zeros
+// Copy up to length bytes at offset to a host file descriptor; the kernel moves them from the image where it can
+sfs_status sfs_sendfile(sfs_file_t *file, int fd, uint64_t offset, uint64_t length, uint64_t *sent);
+
+// Space
+sfs_status sfs_usage(sfs_t *fs, sfs_usage_t *usage);    // constant time
+sfs_status sfs_survey(sfs_t *fs, sfs_survey_t *survey); // walks the whole image; operations wait meanwhile
+int sfs_reclaim(sfs_t *fs, int limit); // free up to limit orphans (-1 = all); returns how many
+
+// Snapshots; taking and deleting one wait for the operations under way, as a commit does
+sfs_status sfs_snapshot(sfs_t *fs, const char *name); // freeze the whole tree as it is now
+sfs_status sfs_list_snapshots(sfs_t *fs, sfs_snapshot_fn visit, void *arg);
+sfs_status sfs_delete_snapshot(sfs_t *fs, const char *name); // blocks only it held are freed
+
+// Instrumentation
+sfs_status sfs_perf(sfs_t *fs, sfs_perf_t *perf);
+
+#endif
@@ -0,0 +1,142 @@
+// mkfs.sfs: create an empty SFS image
+//
+// The image gets a superblock, block and inode bitmaps, an inode table, an
+// optional share table, an empty metadata journal and an empty root
+// directory in inode 0. Everything
+// after the metadata is left as a hole in the image file, so large images
+// are created instantly.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sfs_disk.h"
+
+#define defaultBlocks 1024
+
+// Write one block of the new image
+int putBlock(FILE *image, uint32_t block_number, void *buffer)
+{
+    fseeko(image, (off_t)block_number * 1024, SEEK_SET);
+    return fwrite(buffer, 1, 1024, image) == 1024;
+}
+
+void usage(char *name)
+{
+    printf("Usage: %s [-b <blocks>] [-i <inodes>] [-j <journal blocks>] [-s] <image>\n", name);
+    printf("  -b  total number of 1 KiB blocks (default %d)\n", defaultBlocks);
+    printf("  -i  number of inodes (default: one per four blocks)\n");
+    printf("  -j  blocks of the metadata journal; 0 = none (default: 1/64 of the image, 16 to 8192)\n");
+    printf("  -s  add a share table, so files with the same blocks share them (8 bytes per block)\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    long long blocks = defaultBlocks, inodes = 0, journal = -1;
+    int shared = 0;
+    char *path = NULL;
+    _super_block sb;
+    unsigned char buffer[1024];
+    _inode_entry *root = (_inode_entry *)buffer;
+    _journal_header *header = (_journal_header *)buffer;
+    FILE *image;
+    uint32_t i, b;
+    int ok = 1;
+
+    for (int a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "-b") == 0 && a + 1 < argc)
+            blocks = atoll(argv[++a]);
+        else if (strcmp(argv[a], "-i") == 0 && a + 1 < argc)
+            inodes = atoll(argv[++a]);
+        else if (strcmp(argv[a], "-j") == 0 && a + 1 < argc)
+            journal = atoll(argv[++a]);
+        else if (strcmp(argv[a], "-s") == 0)
+            shared = 1;
+        else if (argv[a][0] != '-' && path == NULL)
+            path = argv[a];
+        else
+            usage(argv[0]);
+    }
+    if (path == NULL)
+        usage(argv[0]);
+
+    if (inodes == 0)
+        inodes = blocks / 4 > 1 ? blocks / 4 : 2;
+    if (journal < 0)
+        journal = defaultJournalBlocks(blocks);
+    if (blocks < 2 || blocks > 0x7fffffff || inodes < 1 || inodes > 0x7fffffff || (journal > 0 && journal < 3) || journal > 0x7fffffff)
+    {
+        printf("Error: Invalid geometry (%lld blocks, %lld inodes, %lld journal blocks).\n", blocks, inodes, journal);
+        return 1;
+    }
+
+    sfsLayout(&sb, blocks, inodes, journal, shared);
+    if (sb.dataStart >= blocks)
+    {
+        printf("Error: %lld blocks cannot hold the metadata for %lld inodes.\n", blocks, inodes);
+        return 1;
+    }
+
+    image = fopen(path, "wb");
+    if (image == NULL)
+    {
+        printf("%s: Cannot create.\n", path);
+        return 1;
+    }
+
+    // superblock; all data blocks and all inodes but the root's are free
+    sb.state = superStateClean;
+    sb.freeBlocks = blocks - sb.dataStart;
+    sb.freeInodes = inodes - 1;
+    memset(buffer, 0, 1024);
+    memcpy(buffer, &sb, sizeof(sb));
+    ok &= putBlock(image, superBlockIndex, buffer);
+
+    // block bitmap; the metadata blocks are in use, the rest is free
+    for (b = 0; b < sb.blockBitmapBlocks; b++)
+    {
+        memset(buffer, 0, 1024);
+        for (i = b * bitsPerBlock; i < sb.dataStart && i < (b + 1) * bitsPerBlock; i++)
+            setBit(buffer, i - b * bitsPerBlock);
+        ok &= putBlock(image, sb.blockBitmapStart + b, buffer);
+    }
+
+    // inode bitmap; only the root directory is in use
+    for (b = 0; b < sb.inodeBitmapBlocks; b++)
+    {
+        memset(buffer, 0, 1024);
+        if (b == 0)
+            setBit(buffer, 0);
+        ok &= putBlock(image, sb.inodeBitmapStart + b, buffer);
+    }
+
+    // inode table; the root directory starts without blocks, the rest stays zero, as does the share table
+    memset(buffer, 0, 1024);
+    memcpy(root->TT, "DI", 2);
+    ok &= putBlock(image, sb.inodeTableStart, buffer);
+
+    // journal; an empty log starts at sequence 1, the records after the header stay zero
+    if (sb.journalBlocks > 0)
+    {
+        memset(buffer, 0, 1024);
+        header->magic = journalMagic;
+        header->sequence = 1;
+        ok &= putBlock(image, sb.journalStart, buffer);
+    }
+
+    fflush(image);
+    ok &= ftruncate(fileno(image), (off_t)blocks * 1024) == 0;
+    ok &= fclose(image) == 0;
+
+    if (!ok)
+    {
+        printf("%s: Write failed.\n", path);
+        return 1;
+    }
+
+    printf("%s: %u blocks (%u for metadata, %u of them journal), %u inodes.\n", path, sb.BLB, sb.dataStart, sb.journalBlocks, sb.INB);
+    return 0;
+}
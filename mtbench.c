@@ -0,0 +1,248 @@
+// mtbench: throughput of one libsfs handle shared by a growing number of threads
+//
+// The image gets a tree of small files, /mtbench/d<i>/f<j>. Each thread then
+// picks operations at random for a few seconds: reads a file or lists a
+// directory of the tree, or (with -w) creates and removes files in a
+// directory of its own. The main thread commits every commitMs, as the shell
+// does in batch mode. The run is repeated for 1, 2, 4, ... threads and the
+// operations per second are printed next to the speedup over one thread.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsfs.h"
+
+#define commitMs 50
+
+// what a worker thread does and what it did
+typedef struct
+{
+    pthread_t thread;
+    int id;
+    unsigned seed;
+    long operations;
+    long failed;
+} _worker;
+
+sfs_t *fs = NULL;
+int dirs = 16, files = 64, fileBytes = 4096, writePercent = 0;
+int running = 0; // workers go on while it is 1
+
+// function declarations
+int countBytes(void *, const char *, size_t);
+void countEntry(void *, const sfs_entry_t *);
+void *work(void *);
+double runRound(int, int);
+double secondsSince(struct timespec *);
+
+// Sink of a read; only counts what went by
+int countBytes(void *arg, const char *data, size_t length)
+{
+    (void)data;
+    *(long *)arg += length;
+    return 0;
+}
+
+void countEntry(void *arg, const sfs_entry_t *entry)
+{
+    (void)entry;
+    (*(long *)arg)++;
+}
+
+// One worker: random reads and listings of the shared tree, creates and removes in its own directory
+void *work(void *arg)
+{
+    _worker *worker = arg;
+    char path[SFS_PATH_MAX], *data = calloc(1, fileBytes);
+    int next = 0, oldest = 0;
+    long seen;
+    sfs_status status;
+
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED))
+    {
+        seen = 0;
+        if ((int)(rand_r(&worker->seed) % 100) < writePercent)
+        {
+            // keep a handful of files: create one, and remove the oldest once there are enough
+            snprintf(path, sizeof(path), "/mtbench/w%d/f%d", worker->id, next++);
+            status = sfs_create(fs, path, data, fileBytes);
+            if (status == SFS_OK && next - oldest > 8)
+            {
+                snprintf(path, sizeof(path), "/mtbench/w%d/f%d", worker->id, oldest++);
+                status = sfs_remove(fs, path);
+            }
+        }
+        else if (rand_r(&worker->seed) % 8 == 0)
+        {
+            snprintf(path, sizeof(path), "/mtbench/d%d", rand_r(&worker->seed) % dirs);
+            status = sfs_list(fs, path, countEntry, &seen);
+        }
+        else
+        {
+            snprintf(path, sizeof(path), "/mtbench/d%d/f%d", rand_r(&worker->seed) % dirs, rand_r(&worker->seed) % files);
+            status = sfs_read(fs, path, countBytes, &seen);
+        }
+
+        worker->operations++;
+        if (status != SFS_OK)
+            worker->failed++;
+    }
+
+    // the next round starts with an empty directory
+    while (oldest < next)
+    {
+        snprintf(path, sizeof(path), "/mtbench/w%d/f%d", worker->id, oldest++);
+        sfs_remove(fs, path);
+    }
+
+    free(data);
+    return NULL;
+}
+
+double secondsSince(struct timespec *from)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from->tv_sec) + (now.tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// Run threads workers for the given number of seconds; returns operations per second
+double runRound(int threads, int seconds)
+{
+    _worker *workers = calloc(threads, sizeof(_worker));
+    struct timespec begin, pause = {0, commitMs * 1000000L};
+    long operations = 0, failed = 0;
+    double elapsed;
+    int i;
+
+    __atomic_store_n(&running, 1, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (i = 0; i < threads; i++)
+    {
+        workers[i].id = i;
+        workers[i].seed = 12345 + i;
+        pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+    }
+
+    while (secondsSince(&begin) < seconds)
+    {
+        nanosleep(&pause, NULL);
+        sfs_commit(fs);
+    }
+
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+    for (i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        operations += workers[i].operations;
+        failed += workers[i].failed;
+    }
+    elapsed = secondsSince(&begin);
+    sfs_commit(fs);
+
+    if (failed > 0)
+        printf("(%ld of %ld operations failed)\n", failed, operations);
+    free(workers);
+    return operations / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    sfs_options_t options = {.cacheBlocks = 64};
+    char path[SFS_PATH_MAX], *data;
+    int maxThreads = sysconf(_SC_NPROCESSORS_ONLN), seconds = 2, threads, i, j;
+    double rate, single = 0;
+    sfs_status status;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            maxThreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            seconds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            writePercent = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0)
+            options.mapImage = 1;
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            options.cacheBlocks = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            dirs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            files = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            fileBytes = atoi(argv[++i]);
+        else if (argv[i][0] != '-' && i == argc - 1)
+            break;
+        else
+            i = argc;
+    }
+    if (i != argc - 1 || maxThreads < 1 || seconds < 1 || dirs < 1 || files < 1 || fileBytes < 0)
+    {
+        printf("Usage: %s [-t <max threads>] [-s <seconds>] [-w <write %%>] [-m] [-c <cache blocks>] [-d <dirs>] [-f <files>] [-b <bytes>] <image>\n", argv[0]);
+        return 1;
+    }
+
+    status = sfs_mount(argv[i], &options, &fs);
+    if (status != SFS_OK)
+    {
+        printf("%s: %s.\n", argv[i], sfs_strerror(status));
+        return 1;
+    }
+
+    // the tree is made once; a second run on the same image reuses it
+    data = malloc(fileBytes + 1);
+    memset(data, 'x', fileBytes);
+    sfs_mkdir(fs, "/mtbench");
+    for (i = 0; i < dirs; i++)
+    {
+        snprintf(path, sizeof(path), "/mtbench/d%d", i);
+        sfs_mkdir(fs, path);
+        for (j = 0; j < files; j++)
+        {
+            snprintf(path, sizeof(path), "/mtbench/d%d/f%d", i, j);
+            status = sfs_create(fs, path, data, fileBytes);
+            if (status != SFS_OK && status != SFS_EEXIST)
+            {
+                printf("%s: %s.\n", path, sfs_strerror(status));
+                sfs_unmount(fs);
+                return 1;
+            }
+        }
+    }
+    for (i = 0; i < maxThreads; i++)
+    {
+        snprintf(path, sizeof(path), "/mtbench/w%d", i);
+        sfs_mkdir(fs, path);
+    }
+    free(data);
+    sfs_sync(fs);
+
+    printf("threads      ops/s  speedup\n");
+    for (threads = 1;; threads *= 2)
+    {
+        if (threads > maxThreads)
+            threads = maxThreads;
+
+        rate = runRound(threads, seconds);
+        if (threads == 1)
+            single = rate;
+        printf("%7d %10.0f %8.2f\n", threads, rate, rate / single);
+
+        if (threads == maxThreads)
+            break;
+    }
+
+    status = sfs_unmount(fs);
+    if (status != SFS_OK)
+    {
+        printf("%s: %s.\n", argv[argc - 1], sfs_strerror(status));
+        return 1;
+    }
+    return 0;
+}
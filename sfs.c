@@ -1,1034 +1,1201 @@
-#include <stdio.h>
-#include <string.h>
-#include <math.h>
-#include <stdlib.h>
-
-#define superBlockIndex 0
-#define blockBitMapIndex 1
-#define inodeBitMapIndex 2
-#define inodeTableIndex 3
-#define maxBlocks 99
-#define maxInodes 127
-
-// structure of an inode entry
-typedef struct
-{
-    char TT[2]; // entry type; "DI" = directory, "FI" = file
-    char XX[2];
-    char YY[2];
-    char ZZ[2];
-} _inode_entry;
-
-// structure of a directory entry
-typedef struct
-{
-    char F;          // '1' = used | '0' = unused
-    char fname[252]; // File/Directory Name
-    char MMM[3];     // Inode table index
-} _directory_entry;
-
-// SFS metadata; read during mounting
-int BLB;                        // total number of blocks
-int INB;                        // total number of entries in inode table
-char _block_bitmap[1024];       // the block bitmap array
-char _inode_bitmap[1024];       // the inode bitmap array
-_inode_entry _inode_table[128]; // the inode table containing 128 inode entries
-
-// useful info
-int freeDiskBlocks;                       // number of available disk blocks
-int freeInodeEntries;                     // number of available entries in inode table
-int currentDirectoryInode = 0;            // index of inode entry of the current directory in the inode table
-char currrentWorkingDirectory[252] = "/"; // name of current directory (useful in the prompt)
-
-FILE *diskFile = NULL; // THE DISK FILE (File Descriptor)
-
-// function declarations
-
-// DISK ACCESS
-void mountMetaData();
-int readBlock(int, char *);
-int writeBlock(int, char *);
-
-// BITMAP ACCESS
-int getBlock();
-void returnBlock(int);
-int getInode();
-void returnInode(int);
-
-// COMMANDS
-void ls();
-void rd();
-void cd(char *);
-void md(char *);
-void stats();
-void create(char *);
-void rm(char *);
-void display(char *);
-
-// HELPERS
-int stoi(char *, int);
-void itos(char *, int, int);
-void printPrompt();
-
-// Convert string to integer
-int stoi(char *s, int n)
-{
-    int i;
-    int ret = 0;
-
-    for (i = 0; i < n; i++)
-    {
-        if (s[i] < 48 || s[i] > 57)
-            return -1; // non-digit
-        ret += pow(10, n - i - 1) * (s[i] - 48);
-    }
-
-    return ret;
-}
-
-// Convert Integer to String
-void itos(char *s, int num, int n)
-{
-    char st[1024];
-    sprintf(st, "%0*d", n, num);
-    strncpy(s, st, n);
-}
-
-// Print Prompt like Shell
-void printPrompt()
-{
-    printf("SFS::%s# ", currrentWorkingDirectory);
-}
-
-// Open file and read metadata + bitmaps + inode table
-void mountMetaData()
-{
-    int i;
-    char buffer[1024];
-
-    diskFile = fopen("sfs.disk", "r+b");
-    if (diskFile == NULL)
-    {
-        printf("Disk file sfs.disk not found.\n");
-        exit(1);
-    }
-
-    // read superblock
-    fread(buffer, 1, 1024, diskFile);
-    BLB = stoi(buffer, 3);
-    INB = stoi(buffer + 3, 3);
-
-    // read block bitmap
-    fread(_block_bitmap, 1, 1024, diskFile);
-    // initialize number of free disk blocks
-    freeDiskBlocks = BLB;
-    for (i = 0; i < BLB; i++)
-        freeDiskBlocks -= (_block_bitmap[i] - 48);
-
-    // read inode bitmap
-    fread(_inode_bitmap, 1, 1024, diskFile);
-    // initialize number of unused inode entries
-    freeInodeEntries = INB;
-    for (i = 0; i < INB; i++)
-        freeInodeEntries -= (_inode_bitmap[i] - 48);
-
-    // read the inode table
-    fread(_inode_table, 1, 1024, diskFile);
-}
-
-// Read block data
-int readBlock(int block_number, char buffer[1024])
-{
-    if (block_number < 0 || block_number > maxBlocks)
-    {
-        return 0;
-    }
-
-    if (diskFile == NULL)
-    {
-        mountMetaData();
-    }
-
-    fseek(diskFile, block_number * 1024, SEEK_SET);
-    fread(buffer, 1, 1024, diskFile);
-
-    return 1;
-}
-
-// Write data in disk file
-int writeBlock(int block_number, char buffer[1024])
-{
-    char empty_buffer[1024];
-
-    if (block_number < 0 || block_number > maxBlocks)
-    {
-        return 0;
-    }
-
-    if (diskFile == NULL)
-    {
-        mountMetaData();
-    }
-
-    fseek(diskFile, block_number * 1024, SEEK_SET); // set file pointer at right position
-
-    if (buffer == NULL)
-    {
-        memset(empty_buffer, '0', 1024);
-        fwrite(empty_buffer, 1, 1024, diskFile);
-    }
-    else
-    {
-        fwrite(buffer, 1, 1024, diskFile);
-    }
-
-    fflush(diskFile);
-
-    return 1;
-}
-
-// Return First Available block index
-int getBlock()
-{
-    if (freeDiskBlocks == 0)
-    {
-        return -1;
-    }
-
-    int i;
-    for (i = 0; i < BLB; i++)
-    {
-        if (_block_bitmap[i] == '0')
-        {
-            break; // 0 means available
-        }
-    }
-
-    _block_bitmap[i] = '1';
-    freeDiskBlocks--;
-
-    writeBlock(blockBitMapIndex, _block_bitmap);
-
-    return i;
-}
-
-// Free unused block
-void returnBlock(int index)
-{
-    if (index > 3 && index <= maxBlocks)
-    {
-        _block_bitmap[index] = '0';
-        freeDiskBlocks++;
-
-        writeBlock(blockBitMapIndex, _block_bitmap);
-    }
-}
-
-// Return first available inode
-int getInode()
-{
-    if (freeInodeEntries == 0)
-    {
-        return -1;
-    }
-
-    int i;
-    for (i = 0; i < INB; i++)
-    {
-        if (_inode_bitmap[i] == '0')
-        {
-            break; // 0 means available
-        }
-    }
-
-    _inode_bitmap[i] = '1';
-    freeInodeEntries--;
-
-    writeBlock(inodeBitMapIndex, _inode_bitmap);
-
-    return i;
-}
-
-// Free unused Inode
-void returnInode(int index)
-{
-    if (index > 0 && index <= maxInodes)
-    {
-        _inode_bitmap[index] = '0';
-        freeInodeEntries++;
-
-        writeBlock(inodeBitMapIndex, _inode_bitmap);
-    }
-}
-
-// Make root directory current working directory
-void rd()
-{
-    currentDirectoryInode = 0; // first inode entry is for root directory
-    currrentWorkingDirectory[0] = '/';
-    currrentWorkingDirectory[1] = 0;
-}
-
-// List all file ans directories in current working directory
-void ls()
-{
-    char inodeType;
-    int blocks[3];
-    _directory_entry _directory_entries[4];
-
-    int total_files = 0, total_dirs = 0;
-
-    int i, j;
-    int e_inode;
-
-    // read inode entry for current directory
-    // in SFS, an inode can point to three blocks at the most
-    inodeType = _inode_table[currentDirectoryInode].TT[0];
-    blocks[0] = stoi(_inode_table[currentDirectoryInode].XX, 2);
-    blocks[1] = stoi(_inode_table[currentDirectoryInode].YY, 2);
-    blocks[2] = stoi(_inode_table[currentDirectoryInode].ZZ, 2);
-
-    // its a directory; so the following should never happen
-    if (inodeType == 'F')
-    {
-        printf("Fatal Error! Aborting.\n");
-        exit(1);
-    }
-
-    // lets traverse the directory entries in all three blocks
-    for (i = 0; i < 3; i++)
-    {
-        if (blocks[i] == 0)
-            continue; // 0 means pointing at nothing
-
-        readBlock(blocks[i], (char *)_directory_entries); // lets read a directory entry; notice the cast
-
-        // so, we got four possible directory entries now
-        for (j = 0; j < 4; j++)
-        {
-            if (_directory_entries[j].F == '0')
-                continue; // means unused entry
-
-            e_inode = stoi(_directory_entries[j].MMM, 3); // this is the inode that has more info about this entry
-
-            if (_inode_table[e_inode].TT[0] == 'F')
-            { // entry is for a file
-                printf("%.252s\t", _directory_entries[j].fname);
-                total_files++;
-            }
-            else if (_inode_table[e_inode].TT[0] == 'D')
-            { // entry is for a directory; print it in BRED
-                printf("\e[1;31m%.252s\e[;;m\t", _directory_entries[j].fname);
-                total_dirs++;
-            }
-        }
-    }
-
-    printf("\n%d file%c and %d director%s.\n", total_files, (total_files <= 1 ? 0 : 's'), total_dirs, (total_dirs <= 1 ? "y" : "ies"));
-}
-
-// Move to directory
-void cd(char *dname)
-{
-    char inodeType;
-    int blocks[3];
-    _directory_entry _directory_entries[4];
-
-    int i, j;
-    int e_inode;
-
-    char found = 0;
-
-    // read inode entry for current directory
-    // in SFS, an inode can point to three blocks at the most
-    inodeType = _inode_table[currentDirectoryInode].TT[0];
-    blocks[0] = stoi(_inode_table[currentDirectoryInode].XX, 2);
-    blocks[1] = stoi(_inode_table[currentDirectoryInode].YY, 2);
-    blocks[2] = stoi(_inode_table[currentDirectoryInode].ZZ, 2);
-
-    // its a directory; so the following should never happen
-    if (inodeType == 'F')
-    {
-        printf("Fatal Error! Aborting.\n");
-        exit(1);
-    }
-
-    // now lets try to see if a directory by the name already exists
-    for (i = 0; i < 3; i++)
-    {
-        if (blocks[i] == 0)
-            continue; // 0 means pointing at nothing
-
-        readBlock(blocks[i], (char *)_directory_entries); // lets read a directory entry; notice the cast
-
-        // so, we got four possible directory entries now
-        for (j = 0; j < 4; j++)
-        {
-            if (_directory_entries[j].F == '0')
-                continue; // means unused entry
-
-            e_inode = stoi(_directory_entries[j].MMM, 3); // this is the inode that has more info about this entry
-
-            if (_inode_table[e_inode].TT[0] == 'D')
-            { // entry is for a directory; can't cd into a file, right?
-                if (strncmp(dname, _directory_entries[j].fname, 252) == 0)
-                {              // and it is the one we are looking for
-                    found = 1; // VOILA
-                    break;
-                }
-            }
-        }
-        if (found)
-            break; // no need to search more
-    }
-
-    if (found)
-    {
-        currentDirectoryInode = e_inode;               // just keep track of which inode entry in the table corresponds to this directory
-        strncpy(currrentWorkingDirectory, dname, 252); // can use it in the prompt
-    }
-    else
-    {
-        printf("%.252s: No such directory.\n", dname);
-    }
-}
-
-// Create new directory
-void md(char *dname)
-{
-    char inodeType;
-    int blocks[3];
-    _directory_entry _directory_entries[4];
-
-    int i, j;
-
-    int empty_dblock = -1, empty_dentry = -1;
-    int empty_ientry;
-
-    // non-empty name
-    if (strlen(dname) == 0)
-    {
-        printf("Usage: md <directory name>\n");
-        return;
-    }
-
-    // do we have free inodes
-    if (freeInodeEntries == 0)
-    {
-        printf("Error: Inode table is full.\n");
-        return;
-    }
-
-    // read inode entry for current directory
-    // in SFS, an inode can point to three blocks at the most
-    inodeType = _inode_table[currentDirectoryInode].TT[0];
-    blocks[0] = stoi(_inode_table[currentDirectoryInode].XX, 2);
-    blocks[1] = stoi(_inode_table[currentDirectoryInode].YY, 2);
-    blocks[2] = stoi(_inode_table[currentDirectoryInode].ZZ, 2);
-
-    // its a directory; so the following should never happen
-    if (inodeType == 'F')
-    {
-        printf("Fatal Error! Aborting.\n");
-        exit(1);
-    }
-
-    // now lets try to see if the name already exists
-    for (i = 0; i < 3; i++)
-    {
-        if (blocks[i] == 0)
-        { // 0 means pointing at nothing
-            if (empty_dblock == -1)
-                empty_dblock = i;
-            continue;
-        }
-
-        readBlock(blocks[i], (char *)_directory_entries); // lets read a directory entry; notice the cast
-
-        // so, we got four possible directory entries now
-        for (j = 0; j < 4; j++)
-        {
-            if (_directory_entries[j].F == '0')
-            { // means unused entry
-                if (empty_dentry == -1)
-                {
-                    empty_dentry = j;
-                    empty_dblock = i;
-                }
-                continue;
-            }
-
-            if (strncmp(dname, _directory_entries[j].fname, 252) == 0)
-            { // compare with user given name
-                printf("%.252s: Already exists.\n", dname);
-                return;
-            }
-        }
-    }
-    // so directory name is new
-
-    // if we did not find an empty directory entry and all three blocks are in use; then no new directory can be made
-    if (empty_dentry == -1 && empty_dblock == -1)
-    {
-        printf("Error: Maximum directory entries reached.\n");
-        return;
-    }
-    else
-    {
-        if (empty_dentry == -1)
-        {
-            empty_dentry = 0;
-
-            if ((blocks[empty_dblock] = getBlock()) == -1)
-            { // first get a new block using the block bitmap
-                printf("Error: Disk is full.\n");
-                return;
-            }
-
-            writeBlock(blocks[empty_dblock], NULL);
-
-            switch (empty_dblock)
-            {
-            case 0:
-                itos(_inode_table[currentDirectoryInode].XX, blocks[empty_dblock], 2);
-                break;
-            case 1:
-                itos(_inode_table[currentDirectoryInode].YY, blocks[empty_dblock], 2);
-                break;
-            case 2:
-                itos(_inode_table[currentDirectoryInode].ZZ, blocks[empty_dblock], 2);
-                break;
-            }
-        }
-
-        empty_ientry = getInode();
-
-        readBlock(blocks[empty_dblock], (char *)_directory_entries);
-        _directory_entries[empty_dentry].F = '1';
-        strncpy(_directory_entries[empty_dentry].fname, dname, 252);
-        itos(_directory_entries[empty_dentry].MMM, empty_ientry, 3);
-        writeBlock(blocks[empty_dblock], (char *)_directory_entries);
-
-        strncpy(_inode_table[empty_ientry].TT, "DI", 2);
-        strncpy(_inode_table[empty_ientry].XX, "00", 2);
-        strncpy(_inode_table[empty_ientry].YY, "00", 2);
-        strncpy(_inode_table[empty_ientry].ZZ, "00", 2);
-
-        writeBlock(inodeTableIndex, (char *)_inode_table);
-    }
-}
-
-void stats()
-{
-    int blocks_free = BLB, inodes_free = INB;
-    int i;
-
-    for (i = 0; i < BLB; i++)
-        blocks_free -= (_block_bitmap[i] - 48);
-    for (i = 0; i < INB; i++)
-        inodes_free -= (_inode_bitmap[i] - 48);
-
-    printf("%d block%c free.\n", blocks_free, (blocks_free <= 1 ? 0 : 's'));
-    printf("%d inode entr%s free.\n", inodes_free, (inodes_free <= 1 ? "y" : "ies"));
-}
-
-void display(char *fname)
-{
-    char inodeType;
-    int blocks[3];
-    _directory_entry _directory_entries[4];
-
-    int i, j;
-    int e_inode;
-
-    char found = 0;
-    char read_buffer[1024];
-
-    inodeType = _inode_table[currentDirectoryInode].TT[0];
-    blocks[0] = stoi(_inode_table[currentDirectoryInode].XX, 2);
-    blocks[1] = stoi(_inode_table[currentDirectoryInode].YY, 2);
-    blocks[2] = stoi(_inode_table[currentDirectoryInode].ZZ, 2);
-
-    // This should never happen
-    if (inodeType == 'F')
-    {
-        printf("Fatal Error! Aborting.\n");
-        exit(1);
-    }
-
-    for (i = 0; i < 3; i++)
-    {
-        if (blocks[i] == 0)
-            continue;
-
-        readBlock(blocks[i], (char *)_directory_entries);
-
-        for (j = 0; j < 4; j++)
-        {
-            if (_directory_entries[j].F == '0')
-                continue;
-
-            e_inode = stoi(_directory_entries[j].MMM, 3);
-
-            if (_inode_table[e_inode].TT[0] == 'F')
-            {
-                if (strncmp(fname, _directory_entries[j].fname, 252) == 0)
-                {
-                    found = 1;
-                    break;
-                }
-            }
-        }
-        if (found)
-        {
-            break;
-        }
-    }
-
-    if (found)
-    {
-        int blocks[3];
-        blocks[0] = stoi(_inode_table[e_inode].XX, 2);
-        blocks[1] = stoi(_inode_table[e_inode].YY, 2);
-        blocks[2] = stoi(_inode_table[e_inode].ZZ, 2);
-
-        for (int i = 0; i < 3; i++)
-        {
-            if (blocks[i] != 0)
-            {
-                readBlock(blocks[i], read_buffer);
-                printf("%s", read_buffer);
-            }
-        }
-        printf("\n");
-    }
-    else
-    {
-        printf("%.252s: No such file.\n", fname);
-    }
-}
-
-void create(char *fname)
-{
-    char inodeType;
-    int blocks[3];
-    int emptyBlockIndex = -1, emptyDirectoryEntryIndex = -1;
-    int createNewBlockFlag = 0;
-    int newInode;
-
-    inodeType = _inode_table[currentDirectoryInode].TT[0];
-
-    // This should never happen
-    if (inodeType == 'F')
-    {
-        printf("Create Error: currentDirectoryInode is a file.\n");
-        exit(1);
-    }
-
-    // Read directory entry blocks
-    blocks[0] = stoi(_inode_table[currentDirectoryInode].XX, 2);
-    blocks[1] = stoi(_inode_table[currentDirectoryInode].YY, 2);
-    blocks[2] = stoi(_inode_table[currentDirectoryInode].ZZ, 2);
-
-    // Check if file already exists in current directory
-    // And find empty block and directory entry
-    for (int i = 0; i < 3; i++)
-    {
-        // If block if empty then set emptyBlockIndex and emptyDirectoryEntryIndex and createNewBlockFlag
-        // Priority: XX > YY > ZZ
-        if (blocks[i] == 0)
-        {
-            emptyBlockIndex = i;
-            emptyDirectoryEntryIndex = 0;
-            createNewBlockFlag = 1;
-            continue;
-        }
-
-        // Read directory entries
-        _directory_entry directories[4];
-        readBlock(blocks[i], (char *)directories);
-
-        // Check if file already exists If not then set emptyBlockIndex and emptyDirectoryEntryIndex and createNewBlockFlag
-        for (int j = 0; j < 4; j++)
-        {
-            if (directories[j].F == '1')
-            {
-                if (strcmp(directories[j].fname, fname) == 0)
-                {
-                    printf("%s: Already exists.\n", fname);
-                    return;
-                }
-            }
-            else
-            {
-                emptyBlockIndex = i;
-                emptyDirectoryEntryIndex = j;
-                createNewBlockFlag = 0;
-            }
-        }
-    }
-
-    // If emptyBlockIndex or emptyDirectoryEntryIndex are not set then file system is full
-    if (emptyBlockIndex == -1 || emptyDirectoryEntryIndex == -1)
-    {
-        printf("File system is full: There is no empty space in this directory!\n");
-        return;
-    }
-    // If createNewBlockFlag is set then create new block and new inode
-    else if (createNewBlockFlag == 1)
-    {
-        int newBlock = getBlock();
-        if (newBlock == -1)
-        {
-            printf("File system is full: No data blocks available!\n");
-            return;
-        }
-
-        writeBlock(newBlock, NULL);
-        newInode = getInode();
-
-        if (newInode == -1)
-        {
-            returnBlock(newBlock);
-            printf("File system is full: No inodes available!\n");
-            return;
-        }
-
-        if (emptyBlockIndex == 0)
-            itos(_inode_table[currentDirectoryInode].XX, newBlock, 2);
-        else if (emptyBlockIndex == 1)
-            itos(_inode_table[currentDirectoryInode].YY, newBlock, 2);
-        else if (emptyBlockIndex == 2)
-            itos(_inode_table[currentDirectoryInode].ZZ, newBlock, 2);
-        blocks[emptyBlockIndex] = newBlock;
-    }
-    // If createNewBlockFlag is not set then create new inode
-    else
-    {
-        newInode = getInode();
-        if (newInode == -1)
-        {
-            printf("File system is full: No inodes available!\n");
-            return;
-        }
-    }
-
-    // Create new directory entry
-    _directory_entry newDirectoryEntry[4];
-    readBlock(blocks[emptyBlockIndex], (char *)newDirectoryEntry);
-
-    // Set new directory entry data
-    newDirectoryEntry[emptyDirectoryEntryIndex].F = '1';
-    strncpy(newDirectoryEntry[emptyDirectoryEntryIndex].fname, fname, 252);
-    itos(newDirectoryEntry[emptyDirectoryEntryIndex].MMM, newInode, 3);
-
-    // Write new directory entry
-    writeBlock(blocks[emptyBlockIndex], (char *)newDirectoryEntry);
-
-    // Set inode table data
-    strncpy(_inode_table[newInode].TT, "FI", 2);
-    strncpy(_inode_table[newInode].XX, "00", 2);
-    strncpy(_inode_table[newInode].YY, "00", 2);
-    strncpy(_inode_table[newInode].ZZ, "00", 2);
-
-    // Write inode table in disk
-    writeBlock(inodeTableIndex, (char *)_inode_table);
-
-    // Creation successfull :)
-    printf("%s has been created, enter the text.\n", fname);
-
-    // Read data from user and write it to file
-    // While loop for reading maximum three blocks data brom the user
-    int i = 0;
-    while (i < 3)
-    {
-        // Create new inode for new data block
-        int newBlock = getBlock();
-        if (newBlock == -1)
-        {
-            printf("File system full: No data blocks!\n");
-            printf("Data will be truncated!\n");
-            return;
-        }
-
-        // Write index of new inode in inode table
-        if (i == 0)
-            itos(_inode_table[newInode].XX, newBlock, 2);
-        else if (i == 1)
-            itos(_inode_table[newInode].YY, newBlock, 2);
-        else if (i == 2)
-            itos(_inode_table[newInode].ZZ, newBlock, 2);
-
-        // Read data until user press ESC(27)
-        int j = 0;
-        char read_buffer[1024];
-        while (j < 1024)
-        {
-            scanf("%c", &read_buffer[j]);
-            if (read_buffer[j] == 27)
-            {
-                read_buffer[j] = '\0';
-                writeBlock(newBlock, read_buffer);
-                fflush(stdin);
-                return;
-            }
-            j++;
-        }
-
-        // Write full block data in disk
-        writeBlock(newBlock, read_buffer);
-
-        // Read abort because of maximum file size
-        i++;
-        if (i == 3)
-        {
-            printf("Maximum file size reached!\n");
-            printf("Data will be truncated!\n");
-            fflush(stdin);
-            return;
-        }
-    }
-}
-
-// Helper function to delete file
-/**
- * Read inode data from inode table
- * Read data blocks index from inode
- * Return data blocks to free block list
- * Return inode to free inode list
- * Write inode table in disk
- */
-int removeFile(int inode)
-{
-    char inodeType = _inode_table[inode].TT[0];
-    if (inodeType == 'D')
-    {
-        printf("Remove file error: inode is a directory!\n");
-        exit(1);
-    }
-    int blocks[3];
-
-    blocks[0] = stoi(_inode_table[inode].XX, 2);
-    blocks[1] = stoi(_inode_table[inode].YY, 2);
-    blocks[2] = stoi(_inode_table[inode].ZZ, 2);
-
-    for (int i = 0; i < 3; i++)
-    {
-        if (blocks[i] == 0)
-            continue;
-        returnBlock(blocks[i]);
-    }
-
-    returnInode(inode);
-    writeBlock(inodeTableIndex, (char *)_inode_table);
-    return 1;
-}
-
-// Recursive helper function to delete directory
-/**
- * Read inode data from inode table
- * Read data blocks index from inode
- * Traverse through all directory entries
- * If directory entry is a file then call removeFile()
- * If directory entry is a directory then call removeDirectory()
- * Return data blocks to free block list
- * Return inode to free inode list
- * Write inode table in disk
- */
-int removeDirectory(int inode)
-{
-    char inodeType = _inode_table[inode].TT[0];
-    if (inodeType == 'F')
-    {
-        printf("Remove directory error: inode is a directory!\n");
-        exit(1);
-    }
-
-    int blocks[3];
-
-    blocks[0] = stoi(_inode_table[inode].XX, 2);
-    blocks[1] = stoi(_inode_table[inode].YY, 2);
-    blocks[2] = stoi(_inode_table[inode].ZZ, 2);
-
-    for (int i = 0; i < 3; i++)
-    {
-        if (blocks[i] == 0)
-            continue;
-
-        _directory_entry directories[4];
-        readBlock(blocks[i], (char *)directories);
-
-        for (int j = 0; j < 4; j++)
-        {
-            if (directories[j].F == '0')
-                continue;
-
-            int del_inode = stoi(directories[j].MMM, 3);
-            inodeType = _inode_table[del_inode].TT[0];
-            if (inodeType == 'F')
-            {
-                if (!removeFile(del_inode))
-                {
-                    printf("Remove File error: removeFile call failed!\n");
-                    exit(1);
-                }
-            }
-            else
-            {
-                if (!removeDirectory(del_inode))
-                {
-                    printf("Remove directory error: recursive removeDirectory call failed!\n");
-                    exit(1);
-                }
-            }
-            directories[j].F = '0';
-        }
-        writeBlock(blocks[i], (char *)directories);
-        returnBlock(blocks[i]);
-    }
-
-    returnInode(inode);
-    writeBlock(inodeTableIndex, (char *)_inode_table);
-    return 1;
-}
-
-// Remove file or directory
-/**
- * Read inode data from inode table
- * Read data blocks index from inode
- * Traverse through all directory entries
- * If directory entry is a file then call removeFile()
- * If directory entry is a directory then call removeDirectory()
- * Return data blocks to free block list
- * Return inode to free inode list
- * Write inode table in disk
- */
-void rm(char *fdname)
-{
-    char inodeType = _inode_table[currentDirectoryInode].TT[0];
-    if (inodeType == 'F')
-    {
-        printf("Remove error: CD_INODE is a file!\n");
-        exit(1);
-    }
-
-    int blocks[3];
-    int flag = 0;
-
-    blocks[0] = stoi(_inode_table[currentDirectoryInode].XX, 2);
-    blocks[1] = stoi(_inode_table[currentDirectoryInode].YY, 2);
-    blocks[2] = stoi(_inode_table[currentDirectoryInode].ZZ, 2);
-
-    for (int i = 0; i < 3; i++)
-    {
-        if (blocks[i] == 0)
-            continue;
-
-        _directory_entry directories[4];
-        readBlock(blocks[i], (char *)directories);
-
-        int cnt = 0;
-
-        for (int j = 0; j < 4; j++)
-        {
-            if (directories[j].F == '0')
-                continue;
-            cnt++;
-            if (strcmp(fdname, directories[j].fname) == 0)
-            {
-                flag = 1;
-                int del_inode = stoi(directories[j].MMM, 3);
-                inodeType = _inode_table[del_inode].TT[0];
-                if (inodeType == 'F')
-                    removeFile(del_inode);
-                else
-                    removeDirectory(del_inode);
-                directories[j].F = '0';
-                cnt--;
-            }
-        }
-        writeBlock(blocks[i], (char *)directories);
-        if (cnt == 0)
-        {
-            returnBlock(blocks[i]);
-
-            if (i == 0)
-                itos(_inode_table[currentDirectoryInode].XX, 0, 2);
-            else if (i == 1)
-                itos(_inode_table[currentDirectoryInode].YY, 0, 2);
-            else if (i == 2)
-                itos(_inode_table[currentDirectoryInode].ZZ, 0, 2);
-
-            writeBlock(inodeTableIndex, (char *)_inode_table);
-        }
-    }
-    if (flag == 0)
-        printf("%s not found in current directory!\n", fdname);
-}
-
-int main()
-{
-    char cmdline[1024];
-    int num_tokens = 0;
-    char tokens[2][256];
-    int i = 0;
-    char *p;
-
-    mountMetaData();
-
-    while (1)
-    {
-        num_tokens = 0;
-        i = 0;
-        printPrompt();
-
-        if (fgets(cmdline, 1024, stdin) == NULL)
-        {
-            printf("\n");
-            break;
-        }
-
-        *strchr(cmdline, '\n') = '\0';
-
-        p = cmdline;
-        while (1 == sscanf(p, "%s", tokens[i]))
-        {
-            p = strstr(p, tokens[i]) + strlen(tokens[i]);
-            i++;
-        }
-        num_tokens = i;
-
-        if (num_tokens == 0)
-            continue;
-
-        if (num_tokens == 1)
-        {
-            if (strcmp(tokens[0], "ls") == 0)
-                ls();
-            else if (strcmp(tokens[0], "exit") == 0)
-                break;
-            else if (strcmp(tokens[0], "stats") == 0)
-                stats();
-            else if (strcmp(tokens[0], "rd") == 0)
-                rd();
-            else
-                continue;
-        }
-
-        if (num_tokens == 2)
-        {
-            if (strcmp(tokens[0], "md") == 0)
-                md(tokens[1]);
-            if (strcmp(tokens[0], "cd") == 0)
-                cd(tokens[1]);
-            if (strcmp(tokens[0], "display") == 0)
-                display(tokens[1]);
-            if (strcmp(tokens[0], "create") == 0)
-                create(tokens[1]);
-            if (strcmp(tokens[0], "rm") == 0)
-                rm(tokens[1]);
-        }
-    }
-
-    return 0;
-}
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <poll.h>
+
+#include "libsfs.h"
+#include "sfs_report.h"
+#include "sfs_trace.h"
+
+#define groupCommitCommands 64 // batch mode commits at least every this many commands
+#define groupCommitMs 50.0     // ... or when the oldest uncommitted command is this old
+#define reclaimStep 256        // orphans freed per step of deferred reclaim
+#define hostPathLength 4096
+
+// what a recursive import or export did
+typedef struct
+{
+    int files;       // files copied
+    int directories; // directories made
+    long long bytes; // bytes copied
+    int failed;      // entries that could not be copied
+} _copy_totals;
+
+// the entries of a directory, collected by collectEntry(); a listing callback must not call back into the library
+typedef struct
+{
+    sfs_entry_t *entries;
+    int count;    // entries used
+    int capacity; // entries allocated
+} _entry_list;
+
+// where the contents of a file being created come from
+typedef struct
+{
+    char *name;  // the file
+    FILE *input; // the command input
+    long left;   // bytes still to read; -1 = up to ESC
+    int started; // 1 = the file exists and contents were asked for
+    int ended;   // 1 = ESC or the end of input was read
+} _content_source;
+
+// how long the commands of one kind took, kept with -p
+typedef struct
+{
+    const char *name; // the command; "commit" is the shell's group commit, "other" whatever is unknown
+    long calls, failed;
+    double totalMs;
+    long latency[SFS_LATENCY_BUCKETS]; // as in sfs_perf_counter_t
+} _command_perf;
+
+sfs_t *fs = NULL;            // the mounted image
+char *diskPath = "sfs.disk"; // path of the disk image
+int batchMode = 0;           // 1 = commands come from a script; no prompts, a status line per command
+int perfEnabled = 0;         // 1 = commands and calls to the image are counted and timed (-p)
+char *perfJsonPath = NULL;   // where the counters go as JSON on exit and on SIGUSR1
+volatile sig_atomic_t perfDumpRequested = 0;
+FILE *trace = NULL;          // where commands are recorded (--trace); NULL = not recorded
+long long payloadBytes = 0;  // contents the last command took from input or a host file, or exported
+
+_command_perf commandPerf[] = {{.name = "ls"}, {.name = "cd"}, {.name = "md"}, {.name = "rd"}, {.name = "create"},
+                               {.name = "display"}, {.name = "rm"}, {.name = "import"}, {.name = "export"},
+                               {.name = "append"}, {.name = "write"}, {.name = "truncate"}, {.name = "stats"},
+                               {.name = "perf"}, {.name = "sync"}, {.name = "snapshot"}, {.name = "commit"},
+                               {.name = "other"}};
+#define commandKinds (int)(sizeof(commandPerf) / sizeof(commandPerf[0]))
+
+// function declarations
+
+// COMMANDS
+void listEntry(void *, const sfs_entry_t *);
+int ls(char *);
+int rd();
+int cd(char *);
+int md(char *);
+int stats(int);
+int printSurvey();
+int display(char *);
+long contentSource(void *, char *, size_t);
+int create(char *, FILE *, char *, long);
+void skipContent(FILE *, char *, long);
+long hostSource(void *, char *, size_t);
+int importFile(char *, char *, _copy_totals *);
+int importTree(char *, char *, _copy_totals *);
+int import(char *, char *, int);
+int exportFile(char *, char *, _copy_totals *);
+void collectEntry(void *, const sfs_entry_t *);
+int exportTree(char *, char *, _copy_totals *);
+int export(char *, char *, int);
+int rm(char *);
+int update(char *, long, char *);
+int resize(char *, long);
+int perf();
+void listSnapshot(void *, const sfs_snapshot_t *);
+int snapshots();
+int snapshot(char *);
+int deleteSnapshot(char *);
+int report(const char *, sfs_status);
+
+// DEFERRED RECLAIM
+int inputPending(FILE *);
+
+// INSTRUMENTATION
+void countCommand(const char *, int, double);
+long percentileUs(const long *, long, double);
+void writeJsonLatency(FILE *, const long *, long);
+int writePerfJson(const char *);
+void perfDumpWanted(int);
+
+// TRACING
+int startTrace(const char *);
+void traceRecord(int, const char *, struct timespec *, struct timespec *, struct timespec *, int);
+
+// HELPERS
+int runCommand(char *, FILE *);
+double elapsedMs(struct timespec *, struct timespec *);
+void printPrompt();
+void stopRequested(int);
+void unmountDisk();
+
+// Print Prompt like Shell
+void printPrompt()
+{
+    printf("SFS::%s# ", sfs_getcwd(fs));
+}
+
+// Signal handler; just interrupts the pending read so main() can flush and exit normally
+void stopRequested(int signum)
+{
+    (void)signum;
+}
+
+// The open transaction and dirty cached blocks must reach the disk however we leave
+void unmountDisk()
+{
+    if (fs != NULL)
+        sfs_unmount(fs);
+    fs = NULL;
+}
+
+// Print why an operation on a path failed; returns 0 so commands can return it
+int report(const char *path, sfs_status status)
+{
+    printf("%s: %s.\n", path, sfs_strerror(status));
+    return 0;
+}
+
+// Make root directory current working directory
+int rd()
+{
+    sfs_chdir(fs, "/");
+    return 1;
+}
+
+// Print one entry of ls() and count it; totals[0] counts files, totals[1] directories
+void listEntry(void *arg, const sfs_entry_t *entry)
+{
+    int *totals = arg;
+
+    if (!entry->isDirectory)
+    { // entry is for a file
+        printf("%s\t", entry->name);
+        totals[0]++;
+    }
+    else
+    { // entry is for a directory; print it in BRED
+        printf("\e[1;31m%s\e[;;m\t", entry->name);
+        totals[1]++;
+    }
+}
+
+// List all file ans directories in a directory
+int ls(char *dname)
+{
+    int totals[2] = {0, 0};
+    int total_files, total_dirs;
+    sfs_status status;
+
+    status = sfs_list(fs, dname, listEntry, totals);
+    if (status != SFS_OK)
+        return report(dname, status);
+
+    total_files = totals[0];
+    total_dirs = totals[1];
+
+    printf("\n%d file%c and %d director%s.\n", total_files, (total_files <= 1 ? 0 : 's'), total_dirs, (total_dirs <= 1 ? "y" : "ies"));
+
+    return 1;
+}
+
+// Move to directory
+int cd(char *dname)
+{
+    sfs_status status = sfs_chdir(fs, dname);
+
+    if (status != SFS_OK)
+        return report(dname, status);
+    return 1;
+}
+
+// Create new directory
+int md(char *dname)
+{
+    sfs_status status;
+
+    // non-empty name
+    if (strlen(dname) == 0)
+    {
+        printf("Usage: md <directory name>\n");
+        return 0;
+    }
+
+    status = sfs_mkdir(fs, dname);
+    if (status != SFS_OK)
+        return report(dname, status);
+
+    return 1;
+}
+
+int stats(int verbose)
+{
+    sfs_usage_t usage;
+
+    sfs_usage(fs, &usage);
+    printf("%u block%c free.\n", usage.freeBlocks, (usage.freeBlocks <= 1 ? 0 : 's'));
+    printf("%u inode entr%s free.\n", usage.freeInodes, (usage.freeInodes <= 1 ? "y" : "ies"));
+    printf("Dentry cache: %d entries, %ld hits, %ld misses.\n", usage.dentryEntries, usage.dentryHits, usage.dentryMisses);
+    if (usage.journalBlocks > 0)
+        printf("Journal: %u blocks, %ld commits, %ld blocks logged, %ld checkpoints, %ld commits replayed at mount.\n", usage.journalBlocks, usage.journalCommits, usage.journalLogged, usage.journalCheckpoints, usage.journalReplayed);
+    else
+        printf("Journal: none.\n");
+    if (usage.reclaimWaiting > 0 || usage.reclaimed > 0)
+        printf("Reclaim: %d inode%s waiting, %ld freed in the background.\n", usage.reclaimWaiting, usage.reclaimWaiting == 1 ? "" : "s", usage.reclaimed);
+
+    if (usage.mapped)
+        printf("Cache: image is memory-mapped; the page cache holds the blocks.\n");
+    else if (usage.cacheBlocks == 0)
+        printf("Cache disabled.\n");
+    else
+    {
+        printf("Cache: %d blocks, %ld hits, %ld misses, %ld evictions, %ld writebacks", usage.cacheBlocks, usage.cacheHits, usage.cacheMisses, usage.cacheEvictions, usage.cacheWritebacks);
+        if (usage.cacheHits + usage.cacheMisses > 0)
+            printf(" (%.1f%% hit rate)", 100.0 * usage.cacheHits / (usage.cacheHits + usage.cacheMisses));
+        printf(".\n");
+    }
+
+    return verbose ? printSurvey() : 1;
+}
+
+// The part of stats -v that walks the image: fragmentation of the free space, files by size, directory fill
+int printSurvey()
+{
+    sfs_survey_t survey;
+
+    sfs_survey(fs, &survey);
+    reportSurvey(&survey);
+    return 1;
+}
+
+// Print a file, exactly its size in bytes; they go to standard output straight from the image where the kernel can
+int display(char *fname)
+{
+    sfs_file_t *file;
+    sfs_status status = sfs_open(fs, fname, SFS_O_READ, &file);
+
+    if (status != SFS_OK)
+        return report(fname, status);
+
+    fflush(stdout);
+    status = sfs_sendfile(file, STDOUT_FILENO, 0, SFS_LENGTH_UNKNOWN, NULL);
+    sfs_close(file);
+    if (status != SFS_OK)
+        return report(fname, status);
+
+    printf("\n");
+    return 1;
+}
+
+// Hand the contents of a file being created to the library; the next left bytes of input, or input up to ESC
+long contentSource(void *arg, char *buffer, size_t size)
+{
+    _content_source *from = arg;
+    size_t n = 0;
+    int c;
+
+    if (!from->started && from->left < 0)
+        printf("%s has been created, enter the text.\n", from->name);
+    from->started = 1;
+
+    if (from->left >= 0)
+    {
+        n = (size_t)from->left < size ? (size_t)from->left : size;
+        n = fread(buffer, 1, n, from->input);
+        from->left -= n;
+        return n;
+    }
+
+    // Read data until user press ESC(27)
+    while (!from->ended && n < size)
+    {
+        c = getc(from->input);
+        if (c == EOF || c == 27) // ESC, or input closed; end the file here
+        {
+            from->ended = 1;
+            // whatever follows ESC on its line is not part of the file
+            while (c != EOF && (c = getc(from->input)) != EOF && c != '\n')
+                ;
+            break;
+        }
+        buffer[n++] = c;
+    }
+    return n;
+}
+
+// Create a file; its contents are the given text, length bytes read from input, or (length < 0) input up to ESC
+int create(char *fname, FILE *input, char *text, long length)
+{
+    _content_source from = {fname, input, length, 0, 0};
+    uint64_t written = 0;
+    sfs_status status;
+
+    if (text != NULL)
+        status = sfs_create(fs, fname, text, strlen(text));
+    else
+        status = sfs_create_from(fs, fname, length >= 0 ? (uint64_t)length : SFS_LENGTH_UNKNOWN, contentSource, &from, &written);
+    payloadBytes = text != NULL ? (long long)strlen(text) : (long long)written;
+    if (status == SFS_OK)
+        return 1;
+
+    if (status == SFS_EIO && text == NULL && length >= 0)
+        printf("Error: Contents end after %llu of %ld bytes.\n", (unsigned long long)written, length);
+    else
+        report(fname, status);
+    if (status == SFS_ENOSPC)
+        printf("Data will be truncated!\n");
+
+    // the rest of the contents must not be taken for commands
+    if (text == NULL && !from.started)
+        skipContent(input, NULL, length);
+    else if (text == NULL && length >= 0)
+        skipContent(input, NULL, from.left);
+    else if (text == NULL && !from.ended)
+        skipContent(input, NULL, -2);
+    return 0;
+}
+
+// Consume the contents meant for a file that could not be created or filled, so the input stays in step
+// length -1 = contents up to ESC, asked for only once the file exists; -2 = the rest of contents being typed
+void skipContent(FILE *input, char *text, long length)
+{
+    char buffer[1024];
+    long chunk;
+    int c;
+
+    // typed contents are only asked for once the file exists
+    if (text != NULL || length == -1)
+        return;
+
+    if (length < 0)
+    {
+        while ((c = getc(input)) != EOF && c != 27)
+            ;
+        while (c != EOF && (c = getc(input)) != EOF && c != '\n')
+            ;
+        return;
+    }
+
+    for (; length > 0; length -= chunk)
+    {
+        chunk = length < 1024 ? length : 1024;
+        if (fread(buffer, 1, chunk, input) != (size_t)chunk)
+            return;
+    }
+}
+
+// Read the next piece of a host file being imported
+long hostSource(void *arg, char *buffer, size_t size)
+{
+    FILE *host = arg;
+    size_t n = fread(buffer, 1, size, host);
+
+    return n == 0 && ferror(host) ? -1 : (long)n;
+}
+
+// Copy a host file into a new SFS file
+int importFile(char *hostPath, char *path, _copy_totals *totals)
+{
+    FILE *host;
+    struct stat info;
+    uint64_t written;
+    sfs_status status;
+
+    host = fopen(hostPath, "rb");
+    if (host == NULL || fstat(fileno(host), &info) != 0)
+    {
+        printf("%s: Cannot open.\n", hostPath);
+        if (host != NULL)
+            fclose(host);
+        totals->failed++;
+        return 0;
+    }
+    setvbuf(host, NULL, _IONBF, 0); // the library reads in large pieces already
+
+    status = sfs_create_from(fs, path, info.st_size, hostSource, host, &written);
+    fclose(host);
+
+    totals->bytes += written;
+    if (status != SFS_OK)
+    {
+        totals->failed++;
+        return report(path, status);
+    }
+
+    totals->files++;
+    return 1;
+}
+
+// Copy a host directory tree into a new SFS directory
+int importTree(char *hostPath, char *path, _copy_totals *totals)
+{
+    DIR *dir;
+    struct dirent *item;
+    struct stat info;
+    char child[hostPathLength], childPath[SFS_PATH_MAX];
+    sfs_status status;
+
+    dir = opendir(hostPath);
+    if (dir == NULL)
+    {
+        printf("%s: Cannot open.\n", hostPath);
+        totals->failed++;
+        return 0;
+    }
+
+    status = sfs_mkdir(fs, path);
+    if (status != SFS_OK)
+    {
+        closedir(dir);
+        totals->failed++;
+        return report(path, status);
+    }
+    totals->directories++;
+
+    while ((item = readdir(dir)) != NULL)
+    {
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0)
+            continue;
+
+        if (strlen(item->d_name) > SFS_NAME_MAX || snprintf(child, sizeof(child), "%s/%s", hostPath, item->d_name) >= (int)sizeof(child) ||
+            snprintf(childPath, sizeof(childPath), "%s/%s", path, item->d_name) >= (int)sizeof(childPath))
+        {
+            printf("%s/%s: Name too long.\n", hostPath, item->d_name);
+            totals->failed++;
+            continue;
+        }
+
+        if (stat(child, &info) != 0)
+        {
+            printf("%s: Cannot open.\n", child);
+            totals->failed++;
+        }
+        else if (S_ISDIR(info.st_mode))
+            importTree(child, childPath, totals);
+        else if (S_ISREG(info.st_mode))
+            importFile(child, childPath, totals);
+    }
+
+    closedir(dir);
+    return 1;
+}
+
+// Copy a host file or (recursive) directory tree to a path in SFS that does not exist yet
+int import(char *hostPath, char *path, int recursive)
+{
+    _copy_totals totals = {0, 0, 0, 0};
+    struct stat info;
+    sfs_entry_t entry;
+    sfs_status status;
+
+    if (stat(hostPath, &info) != 0)
+    {
+        printf("%s: No such file.\n", hostPath);
+        return 0;
+    }
+    if (S_ISDIR(info.st_mode) && !recursive)
+    {
+        printf("%s: Is a directory (use import -r).\n", hostPath);
+        return 0;
+    }
+
+    status = sfs_stat(fs, path, &entry);
+    if (status == SFS_OK)
+        status = SFS_EEXIST;
+    if (status != SFS_ENOENT)
+        return report(path, status);
+
+    if (S_ISDIR(info.st_mode))
+        importTree(hostPath, path, &totals);
+    else
+        importFile(hostPath, path, &totals);
+
+    printf("Imported %d file%s and %d director%s, %lld bytes.\n", totals.files, totals.files == 1 ? "" : "s", totals.directories, totals.directories == 1 ? "y" : "ies", totals.bytes);
+    payloadBytes = totals.bytes;
+    return totals.failed == 0;
+}
+
+// Copy the contents of an SFS file to a host file
+int exportFile(char *path, char *hostPath, _copy_totals *totals)
+{
+    sfs_file_t *file;
+    uint64_t sent;
+    int host;
+    sfs_status status;
+
+    if ((status = sfs_open(fs, path, SFS_O_READ, &file)) != SFS_OK)
+    {
+        totals->failed++;
+        return report(path, status);
+    }
+    host = open(hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (host == -1)
+    {
+        sfs_close(file);
+        printf("%s: Cannot create.\n", hostPath);
+        totals->failed++;
+        return 0;
+    }
+
+    // the kernel copies from the image to the host file, without the bytes passing through the shell
+    status = sfs_sendfile(file, host, 0, SFS_LENGTH_UNKNOWN, &sent);
+    sfs_close(file);
+    if (close(host) != 0 || status == SFS_EIO)
+    {
+        printf("%s: Write failed.\n", hostPath);
+        totals->failed++;
+        return 0;
+    }
+    if (status != SFS_OK)
+    {
+        totals->failed++;
+        return report(path, status);
+    }
+
+    totals->files++;
+    totals->bytes += sent;
+    return 1;
+}
+
+// Add one entry of a listed directory to an _entry_list
+void collectEntry(void *arg, const sfs_entry_t *entry)
+{
+    _entry_list *list = arg;
+
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity == 0 ? 16 : 2 * list->capacity;
+        list->entries = realloc(list->entries, list->capacity * sizeof(sfs_entry_t));
+        if (list->entries == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+
+    list->entries[list->count++] = *entry;
+}
+
+// Copy an SFS directory tree to a host directory, made if it is not there
+// The entries of a directory are collected first and copied after the listing is done
+int exportTree(char *path, char *hostPath, _copy_totals *totals)
+{
+    _entry_list list = {NULL, 0, 0};
+    char child[hostPathLength], childPath[SFS_PATH_MAX];
+    int i;
+
+    if (mkdir(hostPath, 0777) != 0 && errno != EEXIST)
+    {
+        printf("%s: Cannot create.\n", hostPath);
+        totals->failed++;
+        return 0;
+    }
+    totals->directories++;
+
+    sfs_list(fs, path, collectEntry, &list);
+    for (i = 0; i < list.count; i++)
+    {
+        if (snprintf(child, sizeof(child), "%s/%s", hostPath, list.entries[i].name) >= (int)sizeof(child) ||
+            snprintf(childPath, sizeof(childPath), "%s/%s", path, list.entries[i].name) >= (int)sizeof(childPath))
+        {
+            printf("%s/%s: Name too long.\n", hostPath, list.entries[i].name);
+            totals->failed++;
+            continue;
+        }
+
+        if (!list.entries[i].isDirectory)
+            exportFile(childPath, child, totals);
+        else
+            exportTree(childPath, child, totals);
+    }
+    free(list.entries);
+
+    return 1;
+}
+
+// Copy an SFS file or (recursive) directory tree to the host
+int export(char *path, char *hostPath, int recursive)
+{
+    _copy_totals totals = {0, 0, 0, 0};
+    sfs_entry_t entry;
+    sfs_status status;
+
+    status = sfs_stat(fs, path, &entry);
+    if (status != SFS_OK)
+        return report(path, status);
+    if (entry.isDirectory && !recursive)
+    {
+        printf("%s: Is a directory (use export -r).\n", path);
+        return 0;
+    }
+
+    if (entry.isDirectory)
+        exportTree(path, hostPath, &totals);
+    else
+        exportFile(path, hostPath, &totals);
+
+    printf("Exported %d file%s and %d director%s, %lld bytes.\n", totals.files, totals.files == 1 ? "" : "s", totals.directories, totals.directories == 1 ? "y" : "ies", totals.bytes);
+    payloadBytes = totals.bytes;
+    return totals.failed == 0;
+}
+
+// Remove file or directory
+int rm(char *fdname)
+{
+    sfs_status status = sfs_remove(fs, fdname);
+
+    if (status != SFS_OK)
+        return report(fdname, status);
+    return 1;
+}
+
+// Write text into a file at offset, or at its end when offset is -1; only the blocks it falls in are rewritten
+int update(char *fname, long offset, char *text)
+{
+    sfs_file_t *file;
+    sfs_status status = sfs_open(fs, fname, SFS_O_WRITE, &file);
+
+    if (status != SFS_OK)
+        return report(fname, status);
+
+    if (offset < 0)
+        status = sfs_append(file, text, strlen(text), NULL);
+    else
+        status = sfs_pwrite(file, text, strlen(text), offset, NULL);
+    sfs_close(file);
+
+    if (status != SFS_OK)
+        return report(fname, status);
+    return 1;
+}
+
+// Cut a file to length bytes, or extend it with zeros
+int resize(char *fname, long length)
+{
+    sfs_file_t *file;
+    sfs_status status = sfs_open(fs, fname, SFS_O_WRITE, &file);
+
+    if (status != SFS_OK)
+        return report(fname, status);
+
+    status = sfs_truncate(file, length);
+    sfs_close(file);
+
+    if (status != SFS_OK)
+        return report(fname, status);
+    return 1;
+}
+
+// Print how long each kind of command took and what the calls to the image cost
+int perf()
+{
+    static const char *ioNames[4] = {"reads", "writes", "flushes", "copies"};
+    sfs_perf_t io;
+    sfs_perf_counter_t *counters[4] = {&io.reads, &io.writes, &io.flushes, &io.copies};
+    _command_perf *c;
+    int i;
+
+    if (!perfEnabled)
+    {
+        printf("Counters are off; start sfs with -p.\n");
+        return 0;
+    }
+
+    printf("%-9s %8s %7s %11s %9s %9s\n", "command", "calls", "failed", "total ms", "p50 us", "p99 us");
+    for (i = 0; i < commandKinds; i++)
+    {
+        c = &commandPerf[i];
+        if (c->calls > 0)
+            printf("%-9s %8ld %7ld %11.3f %9ld %9ld\n", c->name, c->calls, c->failed, c->totalMs, percentileUs(c->latency, c->calls, 0.5), percentileUs(c->latency, c->calls, 0.99));
+    }
+
+    sfs_perf(fs, &io);
+    printf("%-9s %8s %7s %11s %9s %9s\n", "image", "calls", "seeks", "KiB", "p50 us", "p99 us");
+    for (i = 0; i < 4; i++)
+        printf("%-9s %8ld %7ld %11llu %9ld %9ld\n", ioNames[i], counters[i]->calls, counters[i]->seeks, (unsigned long long)(counters[i]->bytes / 1024), percentileUs(counters[i]->latency, counters[i]->calls, 0.5), percentileUs(counters[i]->latency, counters[i]->calls, 0.99));
+    printf("Latencies are the upper bounds of power-of-two buckets.\n");
+
+    return 1;
+}
+
+// Print one snapshot of snapshots() and count it
+void listSnapshot(void *arg, const sfs_snapshot_t *snapshot)
+{
+    time_t taken = snapshot->taken;
+    char when[32];
+
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&taken));
+    printf("%-*s  %s  %u block%s\n", SFS_SNAPSHOT_NAME_MAX, snapshot->name, when, snapshot->blocks, snapshot->blocks == 1 ? "" : "s");
+    (*(int *)arg)++;
+}
+
+// List the snapshots of the image
+int snapshots()
+{
+    int count = 0;
+    sfs_status status = sfs_list_snapshots(fs, listSnapshot, &count);
+
+    if (status != SFS_OK)
+        return report(diskPath, status);
+    printf("%d snapshot%s.\n", count, count == 1 ? "" : "s");
+    return 1;
+}
+
+// Freeze the whole tree under a name
+int snapshot(char *name)
+{
+    sfs_status status = sfs_snapshot(fs, name);
+
+    if (status != SFS_OK)
+        return report(name, status);
+    return 1;
+}
+
+// Delete a snapshot; the blocks only it held are freed
+int deleteSnapshot(char *name)
+{
+    sfs_status status = sfs_delete_snapshot(fs, name);
+
+    if (status != SFS_OK)
+        return report(name, status);
+    return 1;
+}
+
+// Tell whether a line of input is waiting, so background work would delay a command
+int inputPending(FILE *input)
+{
+    struct pollfd pfd = {fileno(input), POLLIN, 0};
+
+    return poll(&pfd, 1, 0) != 0;
+}
+
+// Count a command, named by the first word of line, that took ms milliseconds
+void countCommand(const char *line, int ok, double ms)
+{
+    size_t length = strcspn(line, " \t\r\n");
+    uint64_t us = (uint64_t)(ms * 1000);
+    int i, bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    _command_perf *c;
+
+    for (i = 0; i < commandKinds - 1; i++)
+    {
+        if (strlen(commandPerf[i].name) == length && strncmp(commandPerf[i].name, line, length) == 0)
+            break;
+    }
+
+    c = &commandPerf[i];
+    c->calls++;
+    c->failed += !ok;
+    c->totalMs += ms;
+    c->latency[bucket < SFS_LATENCY_BUCKETS ? bucket : SFS_LATENCY_BUCKETS - 1]++;
+}
+
+// The upper bound in microseconds of the bucket the given fraction of calls falls within; -1 for the last bucket
+long percentileUs(const long *latency, long calls, double fraction)
+{
+    long seen = 0;
+    int i;
+
+    if (calls == 0)
+        return 0;
+    for (i = 0; i < SFS_LATENCY_BUCKETS - 1; i++)
+    {
+        seen += latency[i];
+        if (seen >= fraction * calls)
+            return 1L << i;
+    }
+    return -1;
+}
+
+// Finish a JSON object with the percentiles and the buckets of a latency histogram
+void writeJsonLatency(FILE *out, const long *latency, long calls)
+{
+    int i;
+
+    fprintf(out, "\"p50Us\": %ld, \"p99Us\": %ld, \"latency\": [", percentileUs(latency, calls, 0.5), percentileUs(latency, calls, 0.99));
+    for (i = 0; i < SFS_LATENCY_BUCKETS; i++)
+        fprintf(out, "%ld%s", latency[i], i < SFS_LATENCY_BUCKETS - 1 ? ", " : "]}");
+}
+
+// Write every counter to path as JSON; latency arrays are bucket counts, bucket i holding calls under 2^i us
+int writePerfJson(const char *path)
+{
+    static const char *ioNames[4] = {"reads", "writes", "flushes", "copies"};
+    sfs_perf_t io;
+    sfs_perf_counter_t *counters[4] = {&io.reads, &io.writes, &io.flushes, &io.copies};
+    sfs_usage_t usage;
+    _command_perf *c;
+    FILE *out = fopen(path, "w");
+    int i;
+
+    if (out == NULL)
+    {
+        printf("%s: Cannot create.\n", path);
+        return 0;
+    }
+
+    sfs_perf(fs, &io);
+    sfs_usage(fs, &usage);
+    fprintf(out, "{\n  \"latencyBuckets\": %d,\n  \"commands\": {", SFS_LATENCY_BUCKETS);
+    for (i = 0; i < commandKinds; i++)
+    {
+        c = &commandPerf[i];
+        fprintf(out, "%s\n    \"%s\": {\"calls\": %ld, \"failed\": %ld, \"totalMs\": %.3f, ", i == 0 ? "" : ",", c->name, c->calls, c->failed, c->totalMs);
+        writeJsonLatency(out, c->latency, c->calls);
+    }
+    fprintf(out, "\n  },\n  \"image\": {");
+    for (i = 0; i < 4; i++)
+    {
+        fprintf(out, "%s\n    \"%s\": {\"calls\": %ld, \"bytes\": %llu, \"seeks\": %ld, ", i == 0 ? "" : ",", ioNames[i], counters[i]->calls, (unsigned long long)counters[i]->bytes, counters[i]->seeks);
+        writeJsonLatency(out, counters[i]->latency, counters[i]->calls);
+    }
+    fprintf(out, "\n  },\n  \"cache\": {\"blocks\": %d, \"hits\": %ld, \"misses\": %ld, \"evictions\": %ld, \"writebacks\": %ld},\n", usage.cacheBlocks,
+            usage.cacheHits, usage.cacheMisses, usage.cacheEvictions, usage.cacheWritebacks);
+    fprintf(out, "  \"journal\": {\"commits\": %ld, \"logged\": %ld, \"checkpoints\": %ld}\n}\n", usage.journalCommits, usage.journalLogged, usage.journalCheckpoints);
+
+    if (fclose(out) != 0)
+    {
+        printf("%s: Write failed.\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+// Signal handler for SIGUSR1; the counters are written once the main loop gets to it
+void perfDumpWanted(int signum)
+{
+    (void)signum;
+    perfDumpRequested = 1;
+}
+
+// Open a trace file and write its header; returns 1, or 0 if it cannot be written
+int startTrace(const char *path)
+{
+    _trace_header header = {traceMagic, traceVersion, 0};
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.started = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    trace = fopen(path, "wb");
+    if (trace == NULL || fwrite(&header, sizeof(header), 1, trace) != 1)
+    {
+        printf("%s: Cannot create.\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+// Record a command line (or, with traceCommit, a group commit) that ran from one clock reading to another
+void traceRecord(int kind, const char *line, struct timespec *begin, struct timespec *from, struct timespec *to, int ok)
+{
+    size_t length = kind == traceCommand ? strcspn(line, "\r\n") : 0;
+    _trace_record record;
+
+    memset(&record, 0, sizeof(record));
+    record.at = (uint64_t)(elapsedMs(begin, from) * 1000);
+    record.payload = kind == traceCommand ? payloadBytes : 0;
+    record.micros = (uint32_t)(elapsedMs(from, to) * 1000);
+    record.length = length < UINT16_MAX ? length : UINT16_MAX;
+    record.kind = kind;
+    record.ok = ok == 1;
+    fwrite(&record, sizeof(record), 1, trace);
+    fwrite(line, 1, record.length, trace);
+    if (kind == traceCommit)
+        fflush(trace);
+}
+
+// Run one command line; returns 1 if it worked, 0 if it failed and -1 for exit
+// The command and its argument are the first two words; what follows them is only allowed for create,
+// import, export and deleting a snapshot:
+//   create <path>            contents are read from input up to ESC; a script creates an empty file
+//   create <path> @<bytes>   contents are the next <bytes> bytes of input, then a newline
+//   create <path> <text>     contents are the rest of the line
+//   import [-r] <host path> <path>, export [-r] <path> <host path>
+//   snapshot -d <name>
+int runCommand(char *line, FILE *input)
+{
+    char *tokens[4], *rest, *end, *p = line;
+    int n = 0, ret, c, recursive;
+    long length;
+
+    while (n < 2)
+    {
+        p += strspn(p, " \t\r\n");
+        if (*p == 0)
+            break;
+        tokens[n++] = p;
+        p += strcspn(p, " \t\r\n");
+        if (*p != 0)
+            *p++ = 0;
+    }
+    rest = p + strspn(p, " \t");
+    rest[strcspn(rest, "\r\n")] = 0;
+
+    if (n == 0)
+        return 1;
+
+    if (n == 2 && strcmp(tokens[0], "create") == 0)
+    {
+        // a script has nobody to press ESC; taking its following lines up to one would swallow them
+        if (*rest == 0)
+            return batchMode ? create(tokens[1], input, "", 0) : create(tokens[1], input, NULL, -1);
+        if (rest[0] == '@' && (length = strtol(rest + 1, &end, 10)) >= 0 && end != rest + 1 && *end == 0)
+        {
+            ret = create(tokens[1], input, NULL, length);
+            // the payload ends with a newline of its own
+            if ((c = getc(input)) != '\n' && c != EOF)
+                ungetc(c, input);
+            return ret;
+        }
+        return create(tokens[1], input, rest, 0);
+    }
+
+    if (n == 2 && strcmp(tokens[0], "append") == 0 && *rest != 0)
+        return update(tokens[1], -1, rest);
+    if (n == 2 && strcmp(tokens[0], "write") == 0 && (length = strtol(rest, &end, 10)) >= 0 && end != rest && (*end == ' ' || *end == '\t'))
+        return update(tokens[1], length, end + strspn(end, " \t"));
+    if (n == 2 && strcmp(tokens[0], "truncate") == 0 && (length = strtol(rest, &end, 10)) >= 0 && end != rest && *end == 0)
+        return resize(tokens[1], length);
+
+    if (n == 2 && strcmp(tokens[0], "snapshot") == 0 && strcmp(tokens[1], "-d") == 0 && *rest != 0 && rest[strcspn(rest, " \t")] == 0)
+        return deleteSnapshot(rest);
+
+    if (n == 2 && (strcmp(tokens[0], "import") == 0 || strcmp(tokens[0], "export") == 0))
+    {
+        // the rest holds one or two more words
+        for (p = rest; n < 4 && *p != 0; n++)
+        {
+            tokens[n] = p;
+            p += strcspn(p, " \t");
+            if (*p != 0)
+                *p++ = 0;
+            p += strspn(p, " \t");
+        }
+        recursive = strcmp(tokens[1], "-r") == 0;
+        if (*p == 0 && n == 3 + recursive)
+        {
+            if (tokens[0][0] == 'i')
+                return import(tokens[1 + recursive], tokens[2 + recursive], recursive);
+            return export(tokens[1 + recursive], tokens[2 + recursive], recursive);
+        }
+    }
+
+    if (n == 1)
+    {
+        if (strcmp(tokens[0], "ls") == 0)
+            return ls(".");
+        else if (strcmp(tokens[0], "exit") == 0)
+            return -1;
+        else if (strcmp(tokens[0], "stats") == 0)
+            return stats(0);
+        else if (strcmp(tokens[0], "perf") == 0)
+            return perf();
+        else if (strcmp(tokens[0], "rd") == 0)
+            return rd();
+        else if (strcmp(tokens[0], "sync") == 0)
+            return sfs_sync(fs) == SFS_OK;
+        else if (strcmp(tokens[0], "snapshot") == 0)
+            return snapshots();
+    }
+
+    if (n == 2 && *rest == 0)
+    {
+        if (strcmp(tokens[0], "ls") == 0)
+            return ls(tokens[1]);
+        if (strcmp(tokens[0], "md") == 0)
+            return md(tokens[1]);
+        if (strcmp(tokens[0], "cd") == 0)
+            return cd(tokens[1]);
+        if (strcmp(tokens[0], "display") == 0)
+            return display(tokens[1]);
+        if (strcmp(tokens[0], "rm") == 0)
+            return rm(tokens[1]);
+        if (strcmp(tokens[0], "stats") == 0 && strcmp(tokens[1], "-v") == 0)
+            return stats(1);
+        if (strcmp(tokens[0], "snapshot") == 0)
+            return snapshot(tokens[1]);
+    }
+
+    printf("%s: Unknown command or wrong number of arguments.\n", tokens[0]);
+    return 0;
+}
+
+// Milliseconds from one clock reading to another
+double elapsedMs(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    char *cmdline = NULL;
+    size_t cmdlineSize = 0;
+    char summary[64];
+    char *scriptPath = NULL, *tracePath = NULL, *traced = NULL;
+    FILE *input = stdin;
+    int quiet = 0, ret, commands = 0, failed = 0, uncommitted = 0;
+    int i = 0;
+    struct sigaction sa;
+    struct timespec begin, before, after, oldest, committing, committed;
+    sfs_options_t options = {.cacheBlocks = 64};
+    sfs_usage_t usage;
+    sfs_status status;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            options.cacheBlocks = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            scriptPath = argv[++i];
+            batchMode = 1;
+        }
+        else if (strcmp(argv[i], "--batch") == 0)
+            batchMode = 1;
+        else if (strcmp(argv[i], "-q") == 0)
+            quiet = 1;
+        else if (strcmp(argv[i], "-m") == 0)
+            options.mapImage = 1;
+        else if (strcmp(argv[i], "-d") == 0)
+            options.deferredReclaim = 1;
+        else if (strcmp(argv[i], "-z") == 0)
+            options.compress = 1;
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            options.snapshot = argv[++i];
+        else if (strcmp(argv[i], "-p") == 0)
+            perfEnabled = 1;
+        else if (strcmp(argv[i], "--perf-json") == 0 && i + 1 < argc)
+        {
+            perfJsonPath = argv[++i];
+            perfEnabled = 1;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            tracePath = argv[++i];
+        else if (argv[i][0] != '-' && i == argc - 1)
+            diskPath = argv[i];
+        else
+        {
+            printf("Usage: %s [-c <cache blocks>] [-m] [-d] [-z] [-s <snapshot>] [-p] [--perf-json <file>] [--trace <file>] [-f <script> | --batch] [-q] [image]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (scriptPath != NULL && (input = fopen(scriptPath, "rb")) == NULL)
+    {
+        printf("%s: Cannot open.\n", scriptPath);
+        return 1;
+    }
+    if (tracePath != NULL && !startTrace(tracePath))
+        return 1;
+
+    options.perf = perfEnabled;
+    status = sfs_mount(diskPath, &options, &fs);
+    if (status != SFS_OK)
+    {
+        printf("%s: %s.\n", diskPath, sfs_strerror(status));
+        return 1;
+    }
+    atexit(unmountDisk); // the open transaction and dirty cached blocks must reach the disk however we leave
+
+    sfs_usage(fs, &usage);
+    if (usage.journalReplayed > 0)
+        printf("%s: Replayed %ld journal commit%s.\n", diskPath, usage.journalReplayed, usage.journalReplayed == 1 ? "" : "s");
+
+    // no SA_RESTART: Ctrl-C makes reading the next command fail and we leave through the normal exit path
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stopRequested;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    if (perfJsonPath != NULL)
+    {
+        sa.sa_handler = perfDumpWanted;
+        sigaction(SIGUSR1, &sa, NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    oldest = begin;
+    while (1)
+    {
+        if (perfDumpRequested)
+        {
+            perfDumpRequested = 0;
+            writePerfJson(perfJsonPath);
+        }
+
+        // deferred reclaim runs while the shell waits for the user
+        while (!batchMode && !inputPending(input) && sfs_reclaim(fs, reclaimStep) > 0)
+            sfs_commit(fs);
+
+        if (!batchMode)
+            printPrompt();
+
+        if (getline(&cmdline, &cmdlineSize, input) == -1)
+        {
+            // SIGUSR1 only asks for the counters
+            if (perfDumpRequested && ferror(input) && errno == EINTR)
+            {
+                clearerr(input);
+                continue;
+            }
+            if (!batchMode)
+                printf("\n");
+            break;
+        }
+
+        // blank lines and comments
+        if (cmdline[strspn(cmdline, " \t\r\n")] == 0 || cmdline[strspn(cmdline, " \t")] == '#')
+            continue;
+
+        snprintf(summary, sizeof(summary), "%.*s", (int)strcspn(cmdline, "\r\n"), cmdline);
+        if (trace != NULL)
+        {
+            // runCommand() cuts the line into words
+            free(traced);
+            traced = strdup(cmdline);
+        }
+        payloadBytes = 0;
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        ret = runCommand(cmdline, input);
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        if (trace != NULL && traced != NULL && ret != -1)
+            traceRecord(traceCommand, traced, &begin, &before, &after, ret);
+
+        if (ret == -1)
+            break;
+        commands++;
+        failed += ret == 0;
+        if (perfEnabled)
+            countCommand(summary, ret, elapsedMs(&before, &after));
+
+        // a script never waits for input; it reclaims a step after each command instead
+        if (batchMode)
+            sfs_reclaim(fs, reclaimStep);
+
+        // group commit: interactive commands are committed one by one, a script in groups
+        if (uncommitted++ == 0)
+            oldest = before;
+        if (!batchMode || uncommitted >= groupCommitCommands || elapsedMs(&oldest, &after) >= groupCommitMs)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &committing);
+            status = sfs_commit(fs);
+            clock_gettime(CLOCK_MONOTONIC, &committed);
+            if (perfEnabled)
+                countCommand("commit", status == SFS_OK, elapsedMs(&committing, &committed));
+            if (trace != NULL)
+                traceRecord(traceCommit, "", &begin, &committing, &committed, status == SFS_OK);
+            uncommitted = 0;
+        }
+        if (batchMode && (ret == 0 || !quiet))
+            printf("[%s] %d: %s (%.3f ms)\n", ret ? "ok" : "FAILED", commands, summary, elapsedMs(&before, &after));
+    }
+
+    if (batchMode)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        printf("%d command%s, %d failed, %.3f ms elapsed.\n", commands, commands == 1 ? "" : "s", failed, elapsedMs(&begin, &after));
+    }
+
+    if (perfJsonPath != NULL)
+        writePerfJson(perfJsonPath);
+    if (trace != NULL && fclose(trace) != 0)
+        printf("%s: Write failed.\n", tracePath);
+
+    free(traced);
+    free(cmdline);
+    return batchMode && failed > 0;
+}
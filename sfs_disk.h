@@ -0,0 +1,256 @@
+// On-disk format of an SFS image (format version 6)
+//
+// All multi-byte fields are little-endian. Block 0 holds the superblock,
+// followed by the block bitmap, the inode bitmap, the inode table, the
+// share table if the image has one and the metadata journal; the superblock
+// records where each region starts and how many blocks it spans. Bitmaps
+// use one bit per block/inode, least significant bit first. The snapshot
+// table, once a snapshot was taken, is a block in the data area.
+
+#ifndef SFS_DISK_H
+#define SFS_DISK_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "SFS images are little-endian; big-endian hosts are not supported"
+#endif
+
+#define sfsMagic "\177SFS"
+#define sfsVersion 6       // 3: inline files (inodeFlagInline); 4: compressed files; 5: the share table; 6: snapshots
+#define sfsOldestVersion 2 // oldest version still mounted; it is raised to sfsVersion at mount
+
+#define superBlockIndex 0
+#define superStateClean 1 // unmounted cleanly; the free counts in the superblock match the bitmaps
+#define bitsPerBlock 8192 // bitmap entries held by one block
+#define maxNameLength 251
+
+// structure of the superblock
+typedef struct
+{
+    char magic[4];              // sfsMagic
+    uint32_t version;           // sfsVersion
+    uint32_t BLB;               // total number of blocks
+    uint32_t INB;               // total number of entries in inode table
+    uint32_t blockBitmapStart;  // first block of the block bitmap
+    uint32_t blockBitmapBlocks; // blocks used by the block bitmap
+    uint32_t inodeBitmapStart;  // first block of the inode bitmap
+    uint32_t inodeBitmapBlocks; // blocks used by the inode bitmap
+    uint32_t inodeTableStart;   // first block of the inode table
+    uint32_t inodeTableBlocks;  // blocks used by the inode table
+    uint32_t dataStart;         // first block available for data
+    uint32_t journalStart;      // first block of the journal; 0 = no journal
+    uint32_t journalBlocks;     // blocks used by the journal
+    uint32_t state;             // superStateClean, or 0 while mounted and after a crash
+    uint32_t freeBlocks;        // free blocks when the image was last unmounted
+    uint32_t freeInodes;        // free inodes when the image was last unmounted
+    uint32_t shareStart;        // first block of the share table; 0 = none, no block is shared
+    uint32_t shareBlocks;       // blocks used by the share table
+    uint32_t snapshotBlock;     // the snapshot table; 0 = no snapshot was ever taken
+} _super_block;
+
+// structure of an extent; a run of consecutive blocks
+typedef struct
+{
+    uint32_t start;  // first block of the run
+    uint32_t length; // number of blocks in the run
+} _extent;
+
+#define inodeExtents 12 // extents stored in the inode itself
+
+#define inodeFlagIndexed 0x0001 // directory with a hashed index instead of a list of blocks
+#define inodeFlagOrphan 0x0002  // removed from the tree; its blocks (and children) wait to be reclaimed
+#define inodeFlagInline 0x0004  // file whose contents live in the inode, in place of its extents
+#define inodeFlagPacked 0x0008  // file stored as compressed chunks (_chunk_header)
+
+// structure of an inode entry
+typedef struct
+{
+    char TT[2];             // entry type; "DI" = directory, "FI" = file
+    uint16_t flags;         // inodeFlag* bits
+    uint32_t extentCount;   // number of extents mapping the contents
+    uint32_t blockCount;    // number of blocks mapped by the extents
+    uint32_t extentBlock;   // first overflow extent block; 0 = none
+    uint64_t size;          // file length in bytes; 0 for directories
+    uint32_t reserved[2];   // unused; zero
+    _extent ext[inodeExtents]; // first extents, in file order; the contents of an inline file instead
+} _inode_entry;
+
+#define inlineBytes (inodeExtents * sizeof(_extent)) // largest file kept in its inode
+
+#define chunkBytes 65536 // file bytes per compressed chunk
+
+// start of a compressed chunk; the blocks of a packed file are a series of chunks, each starting on a
+// block, that hold chunkBytes of the file each (the last one less). The bytes are an LZ4 block: sequences
+// of a token (literal count << 4 | match length - 4, 15 meaning more follow in bytes of 255 and a last
+// one below it), the literals, and a 16-bit little-endian match offset; the last sequence has no match
+typedef struct
+{
+    uint32_t rawBytes;    // bytes of the file in the chunk
+    uint32_t packedBytes; // bytes that follow; equal to rawBytes when they are stored as they are
+} _chunk_header;
+
+// The share table has an entry per block of the image. A block written by
+// a file on an image with a share table is looked up by its contents
+// first, and when another block holds the same bytes, the file maps that
+// one instead; the entry counts the files mapping it, and the block is
+// only freed when the last of them lets it go.
+
+// structure of a share table entry
+typedef struct
+{
+    uint32_t refs;        // files mapping the block; 0 = not shared, it belongs to one file or is free
+    uint32_t fingerprint; // FNV-1a of its contents while refs > 0
+} _share_entry;
+
+#define sharesPerBlock (1024 / sizeof(_share_entry))
+
+// A snapshot freezes the whole tree. Its copy of the inode bitmap and the
+// inode table is kept in a run of blocks of the data area, followed by a
+// bitmap of every block the frozen tree holds: the blocks of its files,
+// which it shares with the tree as long as they are not changed, and
+// blocks of its own for the copy, its directories and overflow extent
+// blocks. A block some snapshot holds is neither written in place nor
+// freed; a file writing into one gets blocks of its own first.
+
+#define maxSnapshots 16       // entries of the snapshot table
+#define snapshotNameLength 39 // longest snapshot name
+
+// structure of a snapshot table entry
+typedef struct
+{
+    char name[snapshotNameLength + 1]; // NUL-terminated; empty = unused entry
+    uint64_t taken;                    // when, in seconds since the epoch
+    uint32_t start;                    // first block of its inode bitmap, inode table and block bitmap
+    uint32_t blocks;                   // blocks of that run
+    uint32_t reserved[2];              // unused; zero
+} _snapshot_entry;
+
+#define blockExtents 127 // extents stored in one overflow extent block
+
+// structure of an overflow extent block; extents past the ones in the inode, chained
+typedef struct
+{
+    uint32_t next;  // next overflow extent block; 0 = last
+    uint32_t count; // extents used in this block
+    _extent ext[blockExtents];
+} _extent_block;
+
+// structure of a directory entry
+typedef struct
+{
+    char F;                     // 1 = used | 0 = unused
+    char fname[maxNameLength];  // File/Directory Name
+    uint32_t MMM;               // Inode table index
+} _directory_entry;
+
+// An indexed directory maps a header block and the index blocks; the index
+// is an extendible hash table of 2^depth slots, each pointing at a bucket
+// block of four directory entries. Buckets are not part of the extent map.
+
+// structure of the header of an indexed directory; its first block
+typedef struct
+{
+    uint32_t depth;         // global depth; the index has 2^depth slots
+    uint32_t entries;       // names stored in the directory
+    uint32_t buckets;       // bucket blocks in use
+    uint32_t reserved[253]; // unused; zero (pads the header to a whole block)
+} _dir_header;
+
+// structure of an index slot of an indexed directory
+typedef struct
+{
+    uint32_t bucket; // bucket block for the names whose hash ends in the slot number
+    uint32_t depth;  // low hash bits shared by all names in the bucket
+} _dir_slot;
+
+#define slotsPerBlock (1024 / sizeof(_dir_slot))
+#define maxDirectoryDepth 24
+
+#define inodesPerBlock (1024 / sizeof(_inode_entry))
+
+// The journal is a log of metadata block images. Its first block is the
+// journal header; commits follow it back to back. A commit is one or more
+// records sharing a sequence number, each a descriptor block followed by
+// the images of the blocks it lists; the last record of a commit is flagged.
+// Records are valid only in sequence order from the header's number on, so
+// resetting the log just means writing a header with a higher number.
+
+#define journalMagic 0x4c4e524a // "JRNL"
+#define journalRecordLast 0x0001 // the record completes its commit
+#define recordBlocks 251         // block images described by one record
+
+// structure of the journal header; first block of the journal
+typedef struct
+{
+    uint32_t magic;         // journalMagic
+    uint32_t sequence;      // sequence number of the first valid commit
+    uint32_t reserved[254]; // unused; zero
+} _journal_header;
+
+// structure of a journal record descriptor
+typedef struct
+{
+    uint32_t magic;               // journalMagic
+    uint32_t sequence;            // sequence number of the commit
+    uint32_t count;               // block images following the descriptor
+    uint32_t flags;               // journalRecord* bits
+    uint32_t checksum;            // FNV-1a of the descriptor (this field zero) and the images
+    uint32_t block[recordBlocks]; // home location of each image
+} _journal_record;
+
+// Default journal size for an image: 1/64 of it, at least 16 and at most 8192 blocks
+static inline uint32_t defaultJournalBlocks(uint32_t blocks)
+{
+    uint32_t journal = blocks / 64;
+
+    return journal < 16 ? 16 : journal > 8192 ? 8192 : journal;
+}
+
+// Fill in the layout of an image with the given number of blocks, inodes and journal blocks (0 = no journal),
+// and a share table if shared is 1. The free counts are left for the caller, with the state saying whether
+// they are filled in
+static inline void sfsLayout(_super_block *sb, uint32_t blocks, uint32_t inodes, uint32_t journal, int shared)
+{
+    memset(sb, 0, sizeof(*sb));
+    memcpy(sb->magic, sfsMagic, 4);
+    sb->version = sfsVersion;
+    sb->BLB = blocks;
+    sb->INB = inodes;
+    sb->blockBitmapStart = superBlockIndex + 1;
+    sb->blockBitmapBlocks = (blocks + bitsPerBlock - 1) / bitsPerBlock;
+    sb->inodeBitmapStart = sb->blockBitmapStart + sb->blockBitmapBlocks;
+    sb->inodeBitmapBlocks = (inodes + bitsPerBlock - 1) / bitsPerBlock;
+    sb->inodeTableStart = sb->inodeBitmapStart + sb->inodeBitmapBlocks;
+    sb->inodeTableBlocks = (inodes + inodesPerBlock - 1) / inodesPerBlock;
+    sb->shareStart = shared ? sb->inodeTableStart + sb->inodeTableBlocks : 0;
+    sb->shareBlocks = shared ? (blocks + sharesPerBlock - 1) / sharesPerBlock : 0;
+    sb->journalStart = journal > 0 ? sb->inodeTableStart + sb->inodeTableBlocks + sb->shareBlocks : 0;
+    sb->journalBlocks = journal;
+    sb->dataStart = sb->inodeTableStart + sb->inodeTableBlocks + sb->shareBlocks + journal;
+}
+
+// Blocks of the run a snapshot keeps its inode bitmap, inode table and block bitmap in
+static inline uint32_t snapshotRunBlocks(const _super_block *sb)
+{
+    return sb->inodeBitmapBlocks + sb->inodeTableBlocks + sb->blockBitmapBlocks;
+}
+
+// Bitmap access; bit i lives in byte i / 8
+static inline int testBit(const unsigned char *map, int i)
+{
+    return (map[i >> 3] >> (i & 7)) & 1;
+}
+
+static inline void setBit(unsigned char *map, int i)
+{
+    map[i >> 3] |= 1 << (i & 7);
+}
+
+static inline void clearBit(unsigned char *map, int i)
+{
+    map[i >> 3] &= ~(1 << (i & 7));
+}
+
+#endif
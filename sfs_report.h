@@ -0,0 +1,43 @@
+// Reports printed the same way by the sfs shell and by sfsc
+
+#ifndef SFS_REPORT_H
+#define SFS_REPORT_H
+
+#include <stdio.h>
+
+#include "libsfs.h"
+
+// Print what sfs_survey() found: fragmentation of the free space, files by size, directory fill
+static inline void reportSurvey(const sfs_survey_t *survey)
+{
+    static const char *sizeNames[SFS_SIZE_CLASSES] = {"empty", "<=1K", "<=64K", "<=4M", "<=256M", ">256M"};
+    static const char *fillNames[SFS_FILL_CLASSES] = {"empty", "<=25%", "<=50%", "<=75%", "<=100%"};
+    int i;
+
+    printf("Free space: %u run%s, the largest %u blocks.\n", survey->freeRuns, survey->freeRuns == 1 ? "" : "s", survey->largestFreeRun);
+
+    printf("Files: %u, %llu bytes in %u blocks", survey->files, (unsigned long long)survey->fileBytes, survey->fileBlocks);
+    if (survey->files > 0)
+        printf(", %.2f extents per file", (double)survey->fileExtents / survey->files);
+    if (survey->inlineFiles > 0)
+        printf(", %u kept in the inode", survey->inlineFiles);
+    if (survey->packedFiles > 0)
+        printf(", %u compressed", survey->packedFiles);
+    printf(".\n  by size:");
+    for (i = 0; i < SFS_SIZE_CLASSES; i++)
+        printf(" %s %u%s", sizeNames[i], survey->filesBySize[i], i < SFS_SIZE_CLASSES - 1 ? "," : ".\n");
+    if (survey->sharedBlocks > 0)
+        printf("  sharing: %u block%s shared, %u saved.\n", survey->sharedBlocks, survey->sharedBlocks == 1 ? "" : "s", survey->savedBlocks);
+
+    printf("Directories: %u, %u indexed, %llu entries in %llu slots", survey->directories, survey->indexedDirectories, (unsigned long long)survey->entries, (unsigned long long)survey->entrySlots);
+    if (survey->entrySlots > 0)
+        printf(" (%.1f%% full)", 100.0 * survey->entries / survey->entrySlots);
+    printf(".\n  by fill:");
+    for (i = 0; i < SFS_FILL_CLASSES; i++)
+        printf(" %s %u%s", fillNames[i], survey->directoriesByFill[i], i < SFS_FILL_CLASSES - 1 ? "," : ".\n");
+
+    if (survey->orphans > 0)
+        printf("Orphans: %u inode%s removed but not yet freed.\n", survey->orphans, survey->orphans == 1 ? "" : "s");
+}
+
+#endif
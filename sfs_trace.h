@@ -0,0 +1,42 @@
+// Traces of the commands run by the sfs shell
+//
+// sfs --trace <file> records every command it runs, and every group commit
+// it makes, with when it started and how long it took; sfs-replay runs a
+// trace again on a copy of an image. A trace is a header followed by
+// records, each a fixed part and then the command line without its
+// newline. All multi-byte fields are little-endian. The contents a command
+// read from its input or from a host file are not kept, only their size;
+// a replay makes up contents of that size.
+
+#ifndef SFS_TRACE_H
+#define SFS_TRACE_H
+
+#include <stdint.h>
+
+#define traceMagic 0x45435254 // "TRCE"
+#define traceVersion 1
+
+// kinds of records
+#define traceCommand 0 // a command line
+#define traceCommit 1  // the shell committed what the commands before did; no line
+
+// start of a trace
+typedef struct
+{
+    uint32_t magic;   // traceMagic
+    uint32_t version; // traceVersion
+    uint64_t started; // wall clock time the trace started, in microseconds since the epoch
+} _trace_header;
+
+// fixed part of a record
+typedef struct
+{
+    uint64_t at;      // microseconds from the start of the trace to the start of the command
+    uint64_t payload; // bytes of contents taken from input or a host file (create, import) or written out (export)
+    uint32_t micros;  // how long it took
+    uint16_t length;  // bytes of the command line that follows
+    uint8_t kind;     // traceCommand or traceCommit
+    uint8_t ok;       // 1 = it worked
+} _trace_record;
+
+#endif
@@ -0,0 +1,354 @@
+// sfsbench: operations per second and latency of the core file system operations
+//
+// Each workload runs on a tree of its own under /sfsbench and times every
+// operation on its own, the way the shell runs them: create-heavy creates
+// files spread over directories, lookup-heavy changes into random
+// directories of that tree, read-heavy copies random files of it out as
+// display does, deep-tree resolves paths at the bottom of a long chain of
+// directories and recursive-delete removes whole directories of files.
+// Commits are made every commitOps operations, as the shell's group commit
+// does; they count in the throughput but not in the latency of an
+// operation. Results go to standard output as a table, and optionally to a
+// CSV and a JSON file with a label (a version, say) on every row.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsfs.h"
+
+#define commitOps 64 // operations between two commits
+
+// what one workload measured
+typedef struct
+{
+    const char *name;
+    long operations;
+    long failed;
+    double seconds;  // wall time, commits included
+    double *latency; // microseconds of each operation
+} _result;
+
+sfs_t *fs = NULL;
+int operations = 4096, dirs = 64, fileBytes = 1024, depth = 32;
+int devNull = -1; // where read-heavy sends the files
+char *data = NULL;
+
+// function declarations
+double nowUs();
+void begin(_result *, const char *);
+void timeOperation(_result *, sfs_status, double);
+void end(_result *, double);
+int compareDoubles(const void *, const void *);
+double percentile(_result *, double);
+void createHeavy(_result *);
+void lookupHeavy(_result *);
+void readHeavy(_result *);
+void deepTree(_result *);
+void recursiveDelete(_result *);
+void report(_result *, int, const char *, const char *, const char *);
+
+// Microseconds on the monotonic clock
+double nowUs()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+void begin(_result *result, const char *name)
+{
+    result->name = name;
+    result->operations = 0;
+    result->failed = 0;
+    result->latency = malloc(operations * sizeof(double));
+}
+
+// Record an operation that started at start; a commit follows every commitOps of them
+void timeOperation(_result *result, sfs_status status, double start)
+{
+    result->latency[result->operations++] = nowUs() - start;
+    if (status != SFS_OK)
+        result->failed++;
+    if (result->operations % commitOps == 0)
+        sfs_commit(fs);
+}
+
+void end(_result *result, double start)
+{
+    sfs_commit(fs);
+    result->seconds = (nowUs() - start) / 1e6;
+    qsort(result->latency, result->operations, sizeof(double), compareDoubles);
+}
+
+int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Latency in microseconds that the given fraction of the operations did not exceed
+double percentile(_result *result, double fraction)
+{
+    long i = (long)(fraction * result->operations + 0.5) - 1;
+
+    if (result->operations == 0)
+        return 0;
+    return result->latency[i < 0 ? 0 : i];
+}
+
+// Files of fileBytes spread over dirs directories; they stay for the workloads after it
+void createHeavy(_result *result)
+{
+    char path[SFS_PATH_MAX];
+    double start, first;
+    int i;
+
+    sfs_mkdir(fs, "/sfsbench/c");
+    for (i = 0; i < dirs; i++)
+    {
+        snprintf(path, sizeof(path), "/sfsbench/c/d%d", i);
+        sfs_mkdir(fs, path);
+    }
+    sfs_commit(fs);
+
+    begin(result, "create-heavy");
+    first = nowUs();
+    for (i = 0; i < operations; i++)
+    {
+        snprintf(path, sizeof(path), "/sfsbench/c/d%d/f%d", i % dirs, i / dirs);
+        start = nowUs();
+        timeOperation(result, sfs_create(fs, path, data, fileBytes), start);
+    }
+    end(result, first);
+}
+
+// Change into random directories of the create-heavy tree
+void lookupHeavy(_result *result)
+{
+    char path[SFS_PATH_MAX];
+    unsigned seed = 1;
+    double start, first;
+    int i;
+
+    begin(result, "lookup-heavy");
+    first = nowUs();
+    for (i = 0; i < operations; i++)
+    {
+        snprintf(path, sizeof(path), "/sfsbench/c/d%d", rand_r(&seed) % dirs);
+        start = nowUs();
+        timeOperation(result, sfs_chdir(fs, path), start);
+    }
+    end(result, first);
+    sfs_chdir(fs, "/");
+}
+
+// Copy random files of the create-heavy tree to /dev/null the way display does
+void readHeavy(_result *result)
+{
+    char path[SFS_PATH_MAX];
+    unsigned seed = 2;
+    double start, first;
+    sfs_file_t *file;
+    sfs_status status;
+    int i;
+
+    begin(result, "read-heavy");
+    first = nowUs();
+    for (i = 0; i < operations; i++)
+    {
+        snprintf(path, sizeof(path), "/sfsbench/c/d%d/f%d", rand_r(&seed) % dirs, rand_r(&seed) % (operations / dirs > 0 ? operations / dirs : 1));
+        start = nowUs();
+        status = sfs_open(fs, path, SFS_O_READ, &file);
+        if (status == SFS_OK)
+        {
+            status = sfs_sendfile(file, devNull, 0, SFS_LENGTH_UNKNOWN, NULL);
+            sfs_close(file);
+        }
+        timeOperation(result, status, start);
+    }
+    end(result, first);
+}
+
+// Look up files at the bottom of a chain of depth directories by their absolute paths
+void deepTree(_result *result)
+{
+    char path[SFS_PATH_MAX], *p = path;
+    unsigned seed = 3;
+    double start, first;
+    sfs_entry_t entry;
+    int i, length;
+
+    p += snprintf(path, sizeof(path), "/sfsbench/deep");
+    sfs_mkdir(fs, path);
+    for (i = 0; i < depth && p - path < SFS_PATH_MAX - 32; i++)
+    {
+        p += snprintf(p, sizeof(path) - (p - path), "/l%d", i);
+        sfs_mkdir(fs, path);
+    }
+    length = p - path;
+    for (i = 0; i < dirs; i++)
+    {
+        snprintf(p, sizeof(path) - length, "/f%d", i);
+        sfs_create(fs, path, data, fileBytes);
+    }
+    sfs_commit(fs);
+
+    begin(result, "deep-tree");
+    first = nowUs();
+    for (i = 0; i < operations; i++)
+    {
+        snprintf(p, sizeof(path) - length, "/f%d", rand_r(&seed) % dirs);
+        start = nowUs();
+        timeOperation(result, sfs_stat(fs, path, &entry), start);
+    }
+    end(result, first);
+}
+
+// Remove the directories of the create-heavy tree one by one, files and all; a directory is one operation
+void recursiveDelete(_result *result)
+{
+    char path[SFS_PATH_MAX];
+    double start, first;
+    int i;
+
+    begin(result, "recursive-delete");
+    first = nowUs();
+    for (i = 0; i < dirs; i++)
+    {
+        snprintf(path, sizeof(path), "/sfsbench/c/d%d", i);
+        start = nowUs();
+        timeOperation(result, sfs_remove(fs, path), start);
+    }
+    end(result, first);
+}
+
+// Print the results as a table and write them to the CSV and JSON files asked for
+void report(_result *results, int count, const char *label, const char *csvPath, const char *jsonPath)
+{
+    FILE *csv = NULL, *json = NULL;
+    _result *r;
+    int i;
+
+    if (csvPath != NULL && (csv = fopen(csvPath, "w")) == NULL)
+        printf("%s: Cannot create.\n", csvPath);
+    if (jsonPath != NULL && (json = fopen(jsonPath, "w")) == NULL)
+        printf("%s: Cannot create.\n", jsonPath);
+
+    printf("%-17s %8s %11s %9s %9s %9s\n", "workload", "ops", "ops/s", "p50 us", "p99 us", "max us");
+    if (csv != NULL)
+        fprintf(csv, "label,workload,ops,failed,seconds,ops_per_sec,p50_us,p99_us,max_us\n");
+    if (json != NULL)
+        fprintf(json, "{\n  \"label\": \"%s\",\n  \"fileBytes\": %d,\n  \"workloads\": [", label, fileBytes);
+
+    for (i = 0; i < count; i++)
+    {
+        r = &results[i];
+        printf("%-17s %8ld %11.0f %9.1f %9.1f %9.1f\n", r->name, r->operations, r->operations / r->seconds, percentile(r, 0.5), percentile(r, 0.99), percentile(r, 1));
+        if (r->failed > 0)
+            printf("  (%ld failed)\n", r->failed);
+        if (csv != NULL)
+            fprintf(csv, "%s,%s,%ld,%ld,%.6f,%.1f,%.2f,%.2f,%.2f\n", label, r->name, r->operations, r->failed, r->seconds, r->operations / r->seconds, percentile(r, 0.5), percentile(r, 0.99), percentile(r, 1));
+        if (json != NULL)
+            fprintf(json, "%s\n    {\"workload\": \"%s\", \"ops\": %ld, \"failed\": %ld, \"seconds\": %.6f, \"opsPerSec\": %.1f, \"p50Us\": %.2f, \"p99Us\": %.2f, \"maxUs\": %.2f}", i == 0 ? "" : ",",
+                    r->name, r->operations, r->failed, r->seconds, r->operations / r->seconds, percentile(r, 0.5), percentile(r, 0.99), percentile(r, 1));
+    }
+
+    if (csv != NULL && fclose(csv) != 0)
+        printf("%s: Write failed.\n", csvPath);
+    if (json != NULL)
+    {
+        fprintf(json, "\n  ]\n}\n");
+        if (fclose(json) != 0)
+            printf("%s: Write failed.\n", jsonPath);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    sfs_options_t options = {.cacheBlocks = 64};
+    const char *label = "", *csvPath = NULL, *jsonPath = NULL;
+    _result results[5];
+    sfs_status status;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            operations = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            dirs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            fileBytes = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-D") == 0 && i + 1 < argc)
+            depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            options.cacheBlocks = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0)
+            options.mapImage = 1;
+        else if (strcmp(argv[i], "-z") == 0)
+            options.compress = 1;
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            label = argv[++i];
+        else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc)
+            csvPath = argv[++i];
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+            jsonPath = argv[++i];
+        else if (argv[i][0] != '-' && i == argc - 1)
+            break;
+        else
+            i = argc;
+    }
+    if (i != argc - 1 || operations < 1 || dirs < 1 || dirs > operations || fileBytes < 0 || depth < 1)
+    {
+        printf("Usage: %s [-n <ops>] [-d <dirs>] [-b <bytes>] [-D <depth>] [-c <cache blocks>] [-m] [-z] [-l <label>] [--csv <file>] [--json <file>] <image>\n", argv[0]);
+        return 1;
+    }
+
+    status = sfs_mount(argv[i], &options, &fs);
+    if (status != SFS_OK)
+    {
+        printf("%s: %s.\n", argv[i], sfs_strerror(status));
+        return 1;
+    }
+    if (sfs_mkdir(fs, "/sfsbench") != SFS_OK)
+    {
+        printf("%s: Needs an image without /sfsbench.\n", argv[i]);
+        sfs_unmount(fs);
+        return 1;
+    }
+
+    data = malloc(fileBytes + 1);
+    memset(data, 'x', fileBytes);
+    devNull = open("/dev/null", O_WRONLY);
+
+    createHeavy(&results[0]);
+    lookupHeavy(&results[1]);
+    readHeavy(&results[2]);
+    deepTree(&results[3]);
+    recursiveDelete(&results[4]);
+
+    // the image is left as it was found
+    sfs_remove(fs, "/sfsbench");
+    sfs_sync(fs);
+
+    report(results, 5, label, csvPath, jsonPath);
+
+    for (i = 0; i < 5; i++)
+        free(results[i].latency);
+    free(data);
+    close(devNull);
+
+    status = sfs_unmount(fs);
+    if (status != SFS_OK)
+    {
+        printf("%s: %s.\n", argv[argc - 1], sfs_strerror(status));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,334 @@
+// sfsc: thin client of sfsd; runs one command on the image the daemon serves
+//
+// Paths are taken from the root of the image, since the daemon has no
+// current directory per client. File contents go between the daemon and
+// standard input or output, or a host file.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libsfs.h"
+#include "sfs_report.h"
+#include "sfsd_proto.h"
+
+int server = -1; // socket connected to sfsd
+
+// function declarations
+int connectTo(const char *);
+int request(int, const char *, const void *, size_t);
+int reply(int *, void *, size_t, size_t *, int);
+int list(const char *);
+int statPath(const char *);
+int get(const char *, const char *);
+int put(const char *, const char *);
+int simple(int, const char *);
+int stats(int);
+int reclaim(int);
+void printUsage(const char *);
+
+// Connect to the daemon's socket; returns 0 or -1
+int connectTo(const char *path)
+{
+    struct sockaddr_un address;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+        return -1;
+    strcpy(address.sun_path, path);
+
+    server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server == -1 || connect(server, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        printf("%s: Cannot connect to sfsd (%s).\n", path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Send a request; with a path its NUL is sent along
+int request(int type, const char *path, const void *argument, size_t length)
+{
+    if (path != NULL)
+        return sendFrame(server, type, 0, path, strlen(path) + 1);
+    return sendFrame(server, type, 0, argument, length);
+}
+
+// Read the frames of a reply: file contents go to out (a file descriptor), entries are printed and the
+// payload of the final frame goes to result, its length to *length if it is not NULL. status gets the
+// status; returns 0, or -1 if the daemon went away
+int reply(int *status, void *result, size_t resultSize, size_t *length, int out)
+{
+    _sfsd_frame frame;
+    char *payload = malloc(sfsdMaxPayload);
+    sfs_entry_t entry;
+    size_t at, n;
+
+    while (payload != NULL && receiveAll(server, &frame, sizeof(frame)) == 0 && frame.length <= sfsdMaxPayload &&
+           receiveAll(server, payload, frame.length) == 0)
+    {
+        if (frame.type == sfsdDone)
+        {
+            memcpy(result, payload, frame.length < resultSize ? frame.length : resultSize);
+            if (length != NULL)
+                *length = frame.length;
+            *status = frame.status;
+            free(payload);
+            return 0;
+        }
+
+        if (frame.type == sfsdData && sendAll(out, payload, frame.length) != 0)
+        {
+            free(payload);
+            printf("Write failed.\n");
+            return -1;
+        }
+
+        for (at = 0; frame.type == sfsdEntries && (n = unpackEntry(payload + at, frame.length - at, &entry)) > 0; at += n)
+        {
+            if (entry.isDirectory)
+                printf("%s/\n", entry.name);
+            else
+                printf("%s\t%llu\n", entry.name, (unsigned long long)entry.size);
+        }
+    }
+
+    free(payload);
+    printf("Connection to sfsd lost.\n");
+    return -1;
+}
+
+// Print the entries of a directory, one per line; directories end in a slash
+int list(const char *path)
+{
+    int status;
+
+    if (request(sfsdList, path, NULL, 0) != 0 || reply(&status, NULL, 0, NULL, -1) != 0)
+        return 0;
+    if (status != SFS_OK)
+        printf("%s: %s.\n", path, sfs_strerror(status));
+    return status == SFS_OK;
+}
+
+int statPath(const char *path)
+{
+    char result[sfsdEntrySize + SFS_NAME_MAX];
+    sfs_entry_t entry;
+    int status;
+
+    memset(result, 0, sizeof(result));
+    if (request(sfsdStat, path, NULL, 0) != 0 || reply(&status, result, sizeof(result), NULL, -1) != 0)
+        return 0;
+    if (status != SFS_OK)
+    {
+        printf("%s: %s.\n", path, sfs_strerror(status));
+        return 0;
+    }
+
+    unpackEntry(result, sizeof(result), &entry);
+    printf("%s: %s, inode %u, %llu bytes, %u blocks.\n", entry.name, entry.isDirectory ? "directory" : "file", entry.inode, (unsigned long long)entry.size, entry.blocks);
+    return 1;
+}
+
+// Copy a file to a host file, or to standard output
+int get(const char *path, const char *hostPath)
+{
+    int out = 1, status;
+
+    if (hostPath != NULL && (out = open(hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+    {
+        printf("%s: Cannot create.\n", hostPath);
+        return 0;
+    }
+
+    if (request(sfsdRead, path, NULL, 0) != 0 || reply(&status, NULL, 0, NULL, out) != 0)
+        return 0;
+    if ((hostPath != NULL && close(out) != 0) || status != SFS_OK)
+    {
+        printf("%s: %s.\n", path, status != SFS_OK ? sfs_strerror(status) : "Write failed");
+        return 0;
+    }
+    return 1;
+}
+
+// Create a file from a host file, or from standard input
+int put(const char *path, const char *hostPath)
+{
+    char *buffer;
+    uint64_t written = 0;
+    ssize_t n;
+    int in = 0, status;
+
+    if (hostPath != NULL && (in = open(hostPath, O_RDONLY)) == -1)
+    {
+        printf("%s: Cannot open.\n", hostPath);
+        return 0;
+    }
+    if ((buffer = malloc(sfsdMaxPayload)) == NULL || request(sfsdCreate, path, NULL, 0) != 0)
+    {
+        free(buffer);
+        return 0;
+    }
+
+    // the contents go as data frames; the empty one ends them, also when the input fails
+    while ((n = read(in, buffer, sfsdMaxPayload)) > 0 || (n == -1 && errno == EINTR))
+    {
+        if (n > 0 && sendFrame(server, sfsdData, 0, buffer, n) != 0)
+            break;
+    }
+    free(buffer);
+    if (sendFrame(server, sfsdData, 0, NULL, 0) != 0 || reply(&status, &written, sizeof(written), NULL, -1) != 0)
+        return 0;
+
+    if (status != SFS_OK)
+    {
+        printf("%s: %s (%llu bytes written).\n", path, sfs_strerror(status), (unsigned long long)written);
+        return 0;
+    }
+    if (n == -1)
+    {
+        printf("%s: Read failed.\n", hostPath != NULL ? hostPath : "stdin");
+        return 0;
+    }
+    return 1;
+}
+
+// A request with nothing to show but its status
+int simple(int type, const char *path)
+{
+    int status;
+
+    if (request(type, path, NULL, 0) != 0 || reply(&status, NULL, 0, NULL, -1) != 0)
+        return 0;
+    if (status != SFS_OK)
+        printf("%s: %s.\n", path != NULL ? path : "sfsd", sfs_strerror(status));
+    return status == SFS_OK;
+}
+
+int stats(int verbose)
+{
+    char packed[sfsdSurveyCounters * 8];
+    sfs_usage_t usage;
+    sfs_survey_t survey;
+    size_t length;
+    int status;
+
+    if (request(sfsdUsage, NULL, NULL, 0) != 0 || reply(&status, packed, sizeof(packed), &length, -1) != 0)
+        return 0;
+    if (!unpackUsage(packed, length, &usage))
+    {
+        printf("sfsd: Reply too short; the daemon is older than sfsc.\n");
+        return 0;
+    }
+
+    printf("%u block%c free.\n", usage.freeBlocks, (usage.freeBlocks <= 1 ? 0 : 's'));
+    printf("%u inode entr%s free.\n", usage.freeInodes, (usage.freeInodes <= 1 ? "y" : "ies"));
+    printf("Dentry cache: %d entries, %ld hits, %ld misses.\n", usage.dentryEntries, usage.dentryHits, usage.dentryMisses);
+    if (usage.journalBlocks > 0)
+        printf("Journal: %u blocks, %ld commits, %ld blocks logged, %ld checkpoints, %ld commits replayed at mount.\n", usage.journalBlocks, usage.journalCommits, usage.journalLogged, usage.journalCheckpoints, usage.journalReplayed);
+    if (usage.reclaimWaiting > 0 || usage.reclaimed > 0)
+        printf("Reclaim: %d inode%s waiting, %ld freed in the background.\n", usage.reclaimWaiting, usage.reclaimWaiting == 1 ? "" : "s", usage.reclaimed);
+    if (usage.mapped)
+        printf("Cache: image is memory-mapped; the page cache holds the blocks.\n");
+    else if (usage.cacheBlocks > 0)
+        printf("Cache: %d blocks, %ld hits, %ld misses, %ld evictions, %ld writebacks.\n", usage.cacheBlocks, usage.cacheHits, usage.cacheMisses, usage.cacheEvictions, usage.cacheWritebacks);
+    if (!verbose)
+        return 1;
+
+    if (request(sfsdSurvey, NULL, NULL, 0) != 0 || reply(&status, packed, sizeof(packed), &length, -1) != 0)
+        return 0;
+    if (!unpackSurvey(packed, length, &survey))
+    {
+        printf("sfsd: Reply too short; the daemon is older than sfsc.\n");
+        return 0;
+    }
+    reportSurvey(&survey);
+    return 1;
+}
+
+int reclaim(int limit)
+{
+    int32_t freed = 0, argument = limit;
+    int status;
+
+    if (request(sfsdReclaim, NULL, &argument, sizeof(argument)) != 0 || reply(&status, &freed, sizeof(freed), NULL, -1) != 0)
+        return 0;
+    printf("%d inode%s freed.\n", freed, freed == 1 ? "" : "s");
+    return 1;
+}
+
+void printUsage(const char *program)
+{
+    printf("Usage: %s [-s <socket>] <command> [arguments]\n", program);
+    printf("  ls <path>               list a directory\n");
+    printf("  stat <path>             describe a file or directory\n");
+    printf("  md <path>               make a directory\n");
+    printf("  rm <path>               remove a file or a whole tree\n");
+    printf("  get <path> [host file]  copy a file out (default: standard output)\n");
+    printf("  put <path> [host file]  create a file (default: from standard input)\n");
+    printf("  stats [-v]              usage and counters; -v surveys the whole image\n");
+    printf("  commit                  make everything done so far durable\n");
+    printf("  sync                    commit and empty the journal\n");
+    printf("  reclaim [limit]         free orphans left by deferred reclaim\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *socketPath = sfsdSocket, *command, *path, *extra;
+    int i = 1, ok;
+
+    if (argc > 2 && strcmp(argv[1], "-s") == 0)
+    {
+        socketPath = argv[2];
+        i = 3;
+    }
+    if (i >= argc || argc - i > 3)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+    command = argv[i];
+    path = i + 1 < argc ? argv[i + 1] : NULL;
+    extra = i + 2 < argc ? argv[i + 2] : NULL;
+
+    if (connectTo(socketPath) != 0)
+        return 1;
+    signal(SIGPIPE, SIG_IGN); // a daemon that goes away makes a write fail
+
+    if (strcmp(command, "ls") == 0 && extra == NULL)
+        ok = list(path != NULL ? path : "/");
+    else if (strcmp(command, "stat") == 0 && path != NULL && extra == NULL)
+        ok = statPath(path);
+    else if (strcmp(command, "md") == 0 && path != NULL && extra == NULL)
+        ok = simple(sfsdMkdir, path);
+    else if (strcmp(command, "rm") == 0 && path != NULL && extra == NULL)
+        ok = simple(sfsdRemove, path);
+    else if (strcmp(command, "get") == 0 && path != NULL)
+        ok = get(path, extra);
+    else if (strcmp(command, "put") == 0 && path != NULL)
+        ok = put(path, extra);
+    else if (strcmp(command, "stats") == 0 && extra == NULL && (path == NULL || strcmp(path, "-v") == 0))
+        ok = stats(path != NULL);
+    else if (strcmp(command, "commit") == 0 && path == NULL)
+        ok = simple(sfsdCommit, NULL);
+    else if (strcmp(command, "sync") == 0 && path == NULL)
+        ok = simple(sfsdSync, NULL);
+    else if (strcmp(command, "reclaim") == 0 && extra == NULL)
+        ok = reclaim(path != NULL ? atoi(path) : -1);
+    else
+    {
+        printUsage(argv[0]);
+        ok = 0;
+    }
+
+    close(server);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,191 @@
+// sfsconv: convert a version 1 (text format) SFS image to the binary format
+//
+// Version 1 stores BLB/INB as ASCII digits, one ASCII byte per bitmap bit,
+// block pointers as two ASCII digits and inode numbers as three. The
+// converter walks every used inode, gives its blocks new consecutive numbers
+// after the (larger) binary inode table and the journal, maps them with one
+// extent and rewrites directory blocks in the new entry layout. Empty slots
+// between directory blocks are dropped. File blocks are copied unchanged.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "sfs_disk.h"
+
+#define v1InodeTableIndex 3
+
+// structure of a version 1 inode entry
+typedef struct
+{
+    char TT[2];
+    char XX[2];
+    char YY[2];
+    char ZZ[2];
+} _v1_inode_entry;
+
+// structure of a version 1 directory entry
+typedef struct
+{
+    char F;
+    char fname[252];
+    char MMM[3];
+} _v1_directory_entry;
+
+// Convert string to integer
+int stoi(char *s, int n)
+{
+    int i;
+    int ret = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if (s[i] < 48 || s[i] > 57)
+            return -1; // non-digit
+        ret = ret * 10 + (s[i] - 48);
+    }
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *in, *out;
+    char *oldImage, *newImage;
+    _v1_inode_entry *oldTable;
+    _inode_entry *newTable;
+    _super_block *sb;
+    _journal_header *journal;
+    int BLB, INB;
+    int *remap;
+    unsigned char *blockBitmap, *inodeBitmap;
+    int nextBlock;
+    int i, j, k;
+
+    if (argc != 3)
+    {
+        printf("Usage: %s <version 1 image> <new image>\n", argv[0]);
+        return 1;
+    }
+
+    in = fopen(argv[1], "rb");
+    if (in == NULL)
+    {
+        printf("%s: Cannot open.\n", argv[1]);
+        return 1;
+    }
+
+    oldImage = calloc(1000, 1024);
+    if (fread(oldImage, 1, 1024, in) != 1024 || (BLB = stoi(oldImage, 3)) <= 0 || (INB = stoi(oldImage + 3, 3)) <= 0)
+    {
+        printf("%s: Not a version 1 SFS image.\n", argv[1]);
+        return 1;
+    }
+    fread(oldImage + 1024, 1, (BLB - 1) * 1024, in);
+    fclose(in);
+
+    newImage = calloc(BLB, 1024);
+    remap = calloc(BLB, sizeof(int));
+    sb = (_super_block *)newImage;
+    sfsLayout(sb, BLB, INB, defaultJournalBlocks(BLB), 0);
+    if (sb->dataStart >= (uint32_t)BLB)
+    {
+        printf("%s: %d blocks are too few for the new layout.\n", argv[1], BLB);
+        return 1;
+    }
+    nextBlock = sb->dataStart;
+    journal = (_journal_header *)(newImage + sb->journalStart * 1024);
+    journal->magic = journalMagic;
+    journal->sequence = 1;
+    blockBitmap = (unsigned char *)newImage + sb->blockBitmapStart * 1024;
+    inodeBitmap = (unsigned char *)newImage + sb->inodeBitmapStart * 1024;
+    oldTable = (_v1_inode_entry *)(oldImage + v1InodeTableIndex * 1024);
+    newTable = (_inode_entry *)(newImage + sb->inodeTableStart * 1024);
+
+    for (i = 0; i < nextBlock; i++)
+        setBit(blockBitmap, i);
+
+    for (i = 0; i < INB; i++)
+    {
+        char *ptr[3] = {oldTable[i].XX, oldTable[i].YY, oldTable[i].ZZ};
+        _inode_entry *entry = &newTable[i];
+
+        if (oldImage[2 * 1024 + i] != '1')
+            continue;
+
+        setBit(inodeBitmap, i);
+        memcpy(newTable[i].TT, oldTable[i].TT, 2);
+
+        for (j = 0; j < 3; j++)
+        {
+            int old = stoi(ptr[j], 2);
+            char *from, *to;
+
+            if (old <= 0)
+                continue;
+            if (old >= BLB || remap[old] != 0)
+            {
+                printf("%s: Inode %d has a bad block pointer; dropped.\n", argv[1], i);
+                continue;
+            }
+            if (nextBlock >= BLB)
+            {
+                printf("%s: Data does not fit in %d blocks.\n", argv[1], BLB);
+                return 1;
+            }
+
+            // the blocks of one inode are numbered consecutively, so they form a single extent
+            remap[old] = nextBlock++;
+            if (entry->extentCount == 0)
+            {
+                entry->ext[0].start = remap[old];
+                entry->extentCount = 1;
+            }
+            entry->ext[0].length++;
+            entry->blockCount++;
+            setBit(blockBitmap, remap[old]);
+
+            from = oldImage + old * 1024;
+            to = newImage + remap[old] * 1024;
+            if (oldTable[i].TT[0] == 'F')
+            {
+                // version 1 files end at the first NUL of their last block
+                memcpy(to, from, 1024);
+                entry->size = (uint64_t)(entry->blockCount - 1) * 1024 + strnlen(from, 1024);
+                continue;
+            }
+
+            // directory block; four entries in the new layout
+            for (k = 0; k < 4; k++)
+            {
+                _v1_directory_entry *oldEntry = (_v1_directory_entry *)from + k;
+                _directory_entry *newEntry = (_directory_entry *)to + k;
+
+                if (oldEntry->F != '1')
+                    continue;
+
+                newEntry->F = 1;
+                strncpy(newEntry->fname, oldEntry->fname, maxNameLength);
+                newEntry->MMM = stoi(oldEntry->MMM, 3);
+                if (memchr(oldEntry->fname, 0, maxNameLength) == NULL)
+                    printf("%.252s: Name truncated to %d characters.\n", oldEntry->fname, maxNameLength);
+            }
+        }
+    }
+
+    // blocks were handed out from dataStart on, so the free ones are the rest
+    sb->state = superStateClean;
+    sb->freeBlocks = BLB - nextBlock;
+    for (i = 0; i < INB; i++)
+        sb->freeInodes += !testBit(inodeBitmap, i);
+
+    out = fopen(argv[2], "wb");
+    if (out == NULL || fwrite(newImage, 1024, BLB, out) != (size_t)BLB || fclose(out) != 0)
+    {
+        printf("%s: Cannot write.\n", argv[2]);
+        return 1;
+    }
+
+    printf("Converted %d blocks and %d inodes; %d blocks in use.\n", BLB, INB, nextBlock);
+    return 0;
+}
@@ -0,0 +1,689 @@
+// sfsd: serve one mounted SFS image to many clients over a Unix domain socket
+//
+// The image is mounted once, so its metadata, the buffer cache and the
+// dentry cache stay warm between client invocations. An epoll loop accepts
+// connections and reads requests (see sfsd_proto.h); a connection with a
+// complete request is handed to a pool of worker threads, which run it on
+// the shared libsfs handle and write the reply. While a worker has a
+// connection, the loop does not watch it (EPOLLONESHOT), so the requests of
+// one connection are answered in order. Changes are committed in groups,
+// every groupCommitMs; a client that needs durability sends sfsdCommit.
+//
+// A worker never waits on a client while it is inside the library: the
+// contents of a new file are collected before the file is created, so a
+// slow upload holds no lock that other requests or a commit could need.
+// A client that stops in the middle of a request is dropped after
+// receiveTimeoutSec.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "libsfs.h"
+#include "sfsd_proto.h"
+
+#define defaultWorkers 8
+#define groupCommitMs 50 // changes are committed at least this often
+#define reclaimStep 256  // orphans freed per idle tick with deferred reclaim
+#define maxEvents 64
+#define receiveTimeoutSec 30 // longest wait for the rest of a request
+
+// a client connection
+typedef struct _connection
+{
+    int fd;
+    char *buffer;                  // bytes read ahead by the event loop, not yet handled
+    size_t start, used;            // unhandled bytes are buffer[start, used)
+    struct _connection *next;      // next in the work queue
+    struct _connection *prev, *up; // neighbours in the list of open connections
+} _connection;
+
+// the contents of a file being created, collected from its sfsdData frames
+typedef struct
+{
+    char *data;
+    size_t size, capacity;
+    size_t taken;  // bytes handed to the library so far
+    int tooLarge;  // 1 = the contents did not fit in memory; they were read and dropped
+} _upload;
+
+// sfsdEntries frames being filled for a listing
+typedef struct
+{
+    int fd;
+    char buffer[sfsdMaxPayload];
+    size_t used;
+    int failed; // 1 = the client went away
+} _reply;
+
+sfs_t *fs = NULL;
+int epollFd = -1;
+int stopPipe[2] = {-1, -1}; // the signal handler writes here to end the event loop
+int deferredReclaim = 0;
+int stopping = 0;
+long changes = 0; // changes since the last group commit
+
+// work queue; connections with a complete request
+pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queueReady = PTHREAD_COND_INITIALIZER;
+_connection *queueHead = NULL, *queueTail = NULL;
+
+// open connections, so they can be shut down when the daemon stops
+pthread_mutex_t connectionsLock = PTHREAD_MUTEX_INITIALIZER;
+_connection *connections = NULL;
+
+// function declarations
+
+// CONNECTIONS
+_connection *openConnection(int);
+void closeConnection(_connection *);
+int readAhead(_connection *);
+int requestReady(_connection *);
+int takeBytes(_connection *, void *, size_t);
+void watch(_connection *);
+
+// WORK QUEUE
+void enqueue(_connection *);
+_connection *dequeue();
+void *worker(void *);
+void *committer(void *);
+
+// REQUESTS
+int serve(_connection *);
+int collectUpload(_connection *, _upload *);
+long uploadSource(void *, char *, size_t);
+int flushReply(_reply *);
+void replyEntry(void *, const sfs_entry_t *);
+int replyFile(int, const char *, sfs_status *);
+
+// HELPERS
+int listenOn(const char *);
+void stopRequested(int);
+
+// Register a new client connection
+_connection *openConnection(int fd)
+{
+    _connection *c = calloc(1, sizeof(_connection));
+
+    if (c == NULL || (c->buffer = malloc(2 * (sizeof(_sfsd_frame) + sfsdMaxPayload))) == NULL)
+    {
+        free(c);
+        close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+
+    pthread_mutex_lock(&connectionsLock);
+    c->up = connections;
+    if (connections != NULL)
+        connections->prev = c;
+    connections = c;
+    pthread_mutex_unlock(&connectionsLock);
+
+    return c;
+}
+
+void closeConnection(_connection *c)
+{
+    pthread_mutex_lock(&connectionsLock);
+    if (c->prev != NULL)
+        c->prev->up = c->up;
+    else
+        connections = c->up;
+    if (c->up != NULL)
+        c->up->prev = c->prev;
+    pthread_mutex_unlock(&connectionsLock);
+
+    close(c->fd); // also takes it out of the epoll set
+    free(c->buffer);
+    free(c);
+}
+
+// Read what the socket has without blocking; returns 0, or -1 if the client is gone or sent too much
+int readAhead(_connection *c)
+{
+    size_t capacity = 2 * (sizeof(_sfsd_frame) + sfsdMaxPayload);
+    ssize_t n;
+
+    if (c->start > 0)
+    {
+        memmove(c->buffer, c->buffer + c->start, c->used - c->start);
+        c->used -= c->start;
+        c->start = 0;
+    }
+
+    while (c->used < capacity)
+    {
+        n = recv(c->fd, c->buffer + c->used, capacity - c->used, MSG_DONTWAIT);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return requestReady(c) == 1 ? 0 : -1; // requests sent before the client left are still answered
+        c->used += n;
+    }
+
+    // a full buffer always holds a whole request
+    return requestReady(c) ? 0 : -1;
+}
+
+// Tell whether a whole request frame is waiting; -1 if its header is bad
+int requestReady(_connection *c)
+{
+    _sfsd_frame frame;
+
+    if (c->used - c->start < sizeof(frame))
+        return 0;
+
+    memcpy(&frame, c->buffer + c->start, sizeof(frame));
+    if (frame.length > sfsdMaxPayload)
+        return -1;
+    return c->used - c->start >= sizeof(frame) + frame.length;
+}
+
+// Take the next bytes of the request stream: what the event loop read ahead first, then the socket
+int takeBytes(_connection *c, void *out, size_t length)
+{
+    size_t n = c->used - c->start < length ? c->used - c->start : length;
+
+    memcpy(out, c->buffer + c->start, n);
+    c->start += n;
+    return n == length ? 0 : receiveAll(c->fd, (char *)out + n, length - n);
+}
+
+// Hand a connection back to the event loop
+void watch(_connection *c)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = c;
+    if (epoll_ctl(epollFd, EPOLL_CTL_MOD, c->fd, &event) != 0)
+        closeConnection(c);
+}
+
+void enqueue(_connection *c)
+{
+    pthread_mutex_lock(&queueLock);
+    c->next = NULL;
+    if (queueTail != NULL)
+        queueTail->next = c;
+    else
+        queueHead = c;
+    queueTail = c;
+    pthread_cond_signal(&queueReady);
+    pthread_mutex_unlock(&queueLock);
+}
+
+// Wait for a connection with a request; NULL once the daemon stops and the queue is empty
+_connection *dequeue()
+{
+    _connection *c;
+
+    pthread_mutex_lock(&queueLock);
+    while (queueHead == NULL && !__atomic_load_n(&stopping, __ATOMIC_RELAXED))
+        pthread_cond_wait(&queueReady, &queueLock);
+
+    c = queueHead;
+    if (c != NULL)
+    {
+        queueHead = c->next;
+        if (queueHead == NULL)
+            queueTail = NULL;
+    }
+    pthread_mutex_unlock(&queueLock);
+
+    return c;
+}
+
+// Worker thread; serves the requests waiting on a connection, then gives it back to the event loop
+void *worker(void *arg)
+{
+    _connection *c;
+    int ready;
+
+    (void)arg;
+    while ((c = dequeue()) != NULL)
+    {
+        while ((ready = requestReady(c)) == 1 && serve(c) == 0)
+            ;
+
+        if (ready != 0)
+            closeConnection(c);
+        else
+            watch(c);
+    }
+
+    return NULL;
+}
+
+// Group commit thread; commits the changes of the last groupCommitMs, and frees orphans while idle
+void *committer(void *arg)
+{
+    struct timespec pause = {0, groupCommitMs * 1000000L};
+
+    (void)arg;
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED))
+    {
+        nanosleep(&pause, NULL);
+        if (__atomic_exchange_n(&changes, 0, __ATOMIC_RELAXED) > 0)
+            sfs_commit(fs);
+        else if (deferredReclaim && sfs_reclaim(fs, reclaimStep) > 0)
+            sfs_commit(fs);
+    }
+
+    return NULL;
+}
+
+// Read the sfsdData frames of a file being created, up to the empty one; returns 0, or -1 if the client
+// broke the protocol or went away
+int collectUpload(_connection *c, _upload *upload)
+{
+    _sfsd_frame frame;
+    char discard[4096], *grown;
+    size_t capacity, n;
+
+    for (;;)
+    {
+        if (takeBytes(c, &frame, sizeof(frame)) != 0 || frame.type != sfsdData || frame.length > sfsdMaxPayload)
+            return -1;
+        if (frame.length == 0)
+            return 0;
+
+        if (!upload->tooLarge && upload->capacity - upload->size < frame.length)
+        {
+            for (capacity = upload->capacity > 0 ? upload->capacity : sfsdMaxPayload; capacity - upload->size < frame.length;)
+                capacity *= 2;
+            if ((grown = realloc(upload->data, capacity)) != NULL)
+            {
+                upload->data = grown;
+                upload->capacity = capacity;
+            }
+            else
+                upload->tooLarge = 1;
+        }
+
+        if (!upload->tooLarge)
+        {
+            if (takeBytes(c, upload->data + upload->size, frame.length) != 0)
+                return -1;
+            upload->size += frame.length;
+            continue;
+        }
+
+        // the next request follows the contents, so they are read anyway
+        for (; frame.length > 0; frame.length -= n)
+        {
+            n = frame.length < sizeof(discard) ? frame.length : sizeof(discard);
+            if (takeBytes(c, discard, n) != 0)
+                return -1;
+        }
+    }
+}
+
+// Hand the collected contents of a file being created to the library
+long uploadSource(void *arg, char *buffer, size_t size)
+{
+    _upload *upload = arg;
+    size_t n = upload->size - upload->taken < size ? upload->size - upload->taken : size;
+
+    memcpy(buffer, upload->data + upload->taken, n);
+    upload->taken += n;
+    return n;
+}
+
+// Send what a reply collected as one frame
+int flushReply(_reply *reply)
+{
+    if (reply->used > 0 && !reply->failed && sendFrame(reply->fd, sfsdEntries, 0, reply->buffer, reply->used) != 0)
+        reply->failed = 1;
+    reply->used = 0;
+    return reply->failed ? -1 : 0;
+}
+
+// Add an entry of a listed directory to the reply
+void replyEntry(void *arg, const sfs_entry_t *entry)
+{
+    _reply *reply = arg;
+
+    if (sizeof(reply->buffer) - reply->used < sfsdEntrySize + SFS_NAME_MAX)
+        flushReply(reply);
+    reply->used += packEntry(entry, reply->buffer + reply->used);
+}
+
+// Send the contents of a file as sfsdData frames; after each header the kernel moves the payload from
+// the image to the socket. Returns 0, or -1 if a frame could not be sent whole and the connection must be closed
+int replyFile(int fd, const char *path, sfs_status *status)
+{
+    _sfsd_frame frame = {0, sfsdData, 0};
+    sfs_file_t *file;
+    uint64_t size, offset, sent = 0;
+
+    if ((*status = sfs_open(fs, path, SFS_O_READ, &file)) != SFS_OK)
+        return 0;
+
+    sfs_seek(file, 0, SFS_SEEK_END, &size);
+    for (offset = 0; offset < size && *status == SFS_OK; offset += sent)
+    {
+        frame.length = size - offset < sfsdMaxPayload ? size - offset : sfsdMaxPayload;
+        if (sendAll(fd, &frame, sizeof(frame)) != 0 ||
+            (*status = sfs_sendfile(file, fd, offset, frame.length, &sent)) != SFS_OK || sent != frame.length)
+        {
+            sfs_close(file);
+            return -1;
+        }
+    }
+
+    sfs_close(file);
+    return 0;
+}
+
+// Run the request at the front of a connection and reply; returns 0, or -1 if the connection must be closed
+int serve(_connection *c)
+{
+    _sfsd_frame request;
+    char path[SFS_PATH_MAX], result[sfsdEntrySize + SFS_NAME_MAX + (sfsdUsageCounters + sfsdSurveyCounters) * 8];
+    size_t resultLength = 0;
+    sfs_entry_t entry;
+    sfs_usage_t usage;
+    sfs_survey_t survey;
+    uint64_t written;
+    int32_t limit;
+    _upload upload = {NULL, 0, 0, 0, 0};
+    _reply *reply;
+    sfs_status status = SFS_OK;
+
+    takeBytes(c, &request, sizeof(request));
+    memset(path, 0, sizeof(path));
+    if (request.type == sfsdReclaim)
+    {
+        if (request.length != sizeof(limit))
+            return -1;
+        takeBytes(c, &limit, sizeof(limit));
+    }
+    else if (request.length > 0)
+    {
+        // a path argument, NUL included
+        if (request.length > sizeof(path))
+            return -1;
+        takeBytes(c, path, request.length);
+        if (path[request.length - 1] != 0)
+            return -1;
+    }
+
+    switch (request.type)
+    {
+    case sfsdStat:
+        if ((status = sfs_stat(fs, path, &entry)) == SFS_OK)
+            resultLength = packEntry(&entry, result);
+        break;
+    case sfsdList:
+        reply = malloc(sizeof(_reply));
+        if (reply == NULL)
+        {
+            status = SFS_ENOMEM;
+            break;
+        }
+        reply->fd = c->fd;
+        reply->used = 0;
+        reply->failed = 0;
+        status = sfs_list(fs, path, replyEntry, reply);
+        flushReply(reply);
+        if (reply->failed)
+        {
+            free(reply);
+            return -1;
+        }
+        free(reply);
+        break;
+    case sfsdRead:
+        if (replyFile(c->fd, path, &status) != 0)
+            return -1;
+        break;
+    case sfsdMkdir:
+        status = sfs_mkdir(fs, path);
+        break;
+    case sfsdRemove:
+        status = sfs_remove(fs, path);
+        break;
+    case sfsdCreate:
+        if (collectUpload(c, &upload) != 0)
+        {
+            free(upload.data);
+            return -1;
+        }
+        written = 0;
+        if (upload.tooLarge)
+            status = SFS_ENOMEM;
+        else
+            status = sfs_create_from(fs, path, upload.size, uploadSource, &upload, &written);
+        free(upload.data);
+        memcpy(result, &written, sizeof(written));
+        resultLength = sizeof(written);
+        break;
+    case sfsdUsage:
+        sfs_usage(fs, &usage);
+        resultLength = packUsage(&usage, result);
+        break;
+    case sfsdSurvey:
+        sfs_survey(fs, &survey);
+        resultLength = packSurvey(&survey, result);
+        break;
+    case sfsdCommit:
+        status = sfs_commit(fs);
+        break;
+    case sfsdSync:
+        status = sfs_sync(fs);
+        break;
+    case sfsdReclaim:
+        limit = sfs_reclaim(fs, limit);
+        memcpy(result, &limit, sizeof(limit));
+        resultLength = sizeof(limit);
+        break;
+    default:
+        status = SFS_EINVAL;
+    }
+
+    if (request.type == sfsdMkdir || request.type == sfsdRemove || request.type == sfsdCreate || request.type == sfsdReclaim)
+        __atomic_add_fetch(&changes, 1, __ATOMIC_RELAXED);
+
+    return sendFrame(c->fd, sfsdDone, status, result, resultLength);
+}
+
+// Bind and listen on a Unix domain socket; a socket file left by a daemon that is gone is replaced
+int listenOn(const char *path)
+{
+    struct sockaddr_un address;
+    int fd;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        printf("%s: Socket path too long.\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+    {
+        printf("%s: Another sfsd is serving this socket.\n", path);
+        close(fd);
+        return -1;
+    }
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0)
+    {
+        printf("%s: %s.\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Signal handler; wakes the event loop, which stops the daemon
+void stopRequested(int signum)
+{
+    char byte = 0;
+
+    (void)signum;
+    if (write(stopPipe[1], &byte, 1) < 0)
+        return;
+}
+
+int main(int argc, char *argv[])
+{
+    sfs_options_t options = {.cacheBlocks = 64};
+    char *diskPath = "sfs.disk", *socketPath = sfsdSocket;
+    int workers = defaultWorkers, listenFd, fd, i, n;
+    pthread_t *pool, commitThread;
+    struct epoll_event event, events[maxEvents];
+    struct timeval receiveTimeout = {receiveTimeoutSec, 0};
+    struct sigaction sa;
+    _connection *c;
+    sfs_status status;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            socketPath = argv[++i];
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            options.cacheBlocks = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0)
+            options.mapImage = 1;
+        else if (strcmp(argv[i], "-d") == 0)
+            options.deferredReclaim = 1;
+        else if (strcmp(argv[i], "-z") == 0)
+            options.compress = 1;
+        else if (argv[i][0] != '-' && i == argc - 1)
+            diskPath = argv[i];
+        else
+            workers = 0;
+    }
+    if (workers < 1)
+    {
+        printf("Usage: %s [-s <socket>] [-w <workers>] [-c <cache blocks>] [-m] [-d] [-z] [image]\n", argv[0]);
+        return 1;
+    }
+    deferredReclaim = options.deferredReclaim;
+
+    status = sfs_mount(diskPath, &options, &fs);
+    if (status != SFS_OK)
+    {
+        printf("%s: %s.\n", diskPath, sfs_strerror(status));
+        return 1;
+    }
+
+    listenFd = listenOn(socketPath);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (listenFd == -1 || epollFd == -1 || pipe(stopPipe) != 0)
+    {
+        sfs_unmount(fs);
+        return 1;
+    }
+
+    // a client that goes away makes a write fail rather than kill the daemon
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+    sa.sa_handler = stopRequested;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // the listening socket and the stop pipe are told apart by a NULL and a non-NULL marker
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+    event.data.ptr = stopPipe;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, stopPipe[0], &event);
+
+    pool = malloc(workers * sizeof(pthread_t));
+    for (i = 0; i < workers; i++)
+        pthread_create(&pool[i], NULL, worker, NULL);
+    pthread_create(&commitThread, NULL, committer, NULL);
+    printf("%s: Serving on %s with %d workers.\n", diskPath, socketPath, workers);
+    fflush(stdout);
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED))
+    {
+        n = epoll_wait(epollFd, events, maxEvents, -1);
+        for (i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == stopPipe)
+            {
+                pthread_mutex_lock(&queueLock);
+                __atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+                pthread_cond_broadcast(&queueReady);
+                pthread_mutex_unlock(&queueLock);
+            }
+            else if (events[i].data.ptr == NULL)
+            {
+                fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+                if (fd == -1)
+                    continue;
+                // a worker reading the rest of a request gives up on a client that stopped sending
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &receiveTimeout, sizeof(receiveTimeout));
+                if ((c = openConnection(fd)) == NULL)
+                    continue;
+                event.events = EPOLLIN | EPOLLONESHOT;
+                event.data.ptr = c;
+                if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+                    closeConnection(c);
+            }
+            else
+            {
+                c = events[i].data.ptr;
+                if (readAhead(c) != 0 || requestReady(c) == -1)
+                    closeConnection(c);
+                else if (requestReady(c) == 1)
+                    enqueue(c);
+                else
+                    watch(c);
+            }
+        }
+    }
+
+    // a worker waiting on a client gives up; the operations it started are complete before it returns
+    close(listenFd);
+    unlink(socketPath);
+    pthread_mutex_lock(&connectionsLock);
+    for (c = connections; c != NULL; c = c->up)
+        shutdown(c->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&connectionsLock);
+
+    for (i = 0; i < workers; i++)
+        pthread_join(pool[i], NULL);
+    pthread_join(commitThread, NULL);
+    free(pool);
+
+    while (connections != NULL)
+        closeConnection(connections);
+
+    status = sfs_unmount(fs);
+    if (status != SFS_OK)
+    {
+        printf("%s: %s.\n", diskPath, sfs_strerror(status));
+        return 1;
+    }
+    printf("%s: Stopped.\n", diskPath);
+    return 0;
+}
@@ -0,0 +1,274 @@
+// Protocol between sfsd and its clients
+//
+// Requests and replies are frames on a Unix domain stream socket: an 8
+// byte header followed by length payload bytes. All multi-byte fields are
+// little-endian. A request frame carries its operation in type and its
+// arguments as the payload (a path, NUL included, for most of them).
+// Every request is answered by zero or more reply frames (sfsdData,
+// sfsdEntries) and then one sfsdDone frame carrying the status and, for
+// stat, usage, survey and reclaim, a result. The contents of a file being created
+// follow the create request as sfsdData frames; an empty one ends them.
+// Usage and survey results are lists of 64-bit counters in a fixed order
+// rather than the library's structs, whose layout grows with the library.
+// Counters are only ever added at the end of a list: a client takes the
+// ones it knows and refuses a reply too short to hold them.
+// A client may send its next request before the reply to the last one has
+// arrived; requests on one connection are answered in order.
+
+#ifndef SFSD_PROTO_H
+#define SFSD_PROTO_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libsfs.h"
+
+#define sfsdSocket "sfsd.sock" // default socket path
+#define sfsdMaxPayload 65536   // largest frame payload
+#define sfsdEntrySize 18       // packed entry without its name
+#define sfsdUsageCounters 20   // counters of a packed usage result
+#define sfsdSurveyCounters 26  // counters of a packed survey result
+
+// request types
+#define sfsdStat 1    // path -> entry
+#define sfsdList 2    // path -> sfsdEntries frames
+#define sfsdMkdir 3   // path
+#define sfsdRemove 4  // path
+#define sfsdCreate 5  // path, then sfsdData frames up to an empty one -> bytes written
+#define sfsdRead 6    // path -> sfsdData frames
+#define sfsdUsage 7   // -> usage
+#define sfsdCommit 8  // returns once everything done so far is durable
+#define sfsdSync 9    // commit and write everything home
+#define sfsdReclaim 10 // int32 limit -> freed count
+#define sfsdSurvey 11  // -> survey; the daemon serves nothing else meanwhile
+
+// reply frame types
+#define sfsdData 64    // a piece of file contents
+#define sfsdEntries 65 // packed directory entries
+#define sfsdDone 66    // end of a reply; status holds the sfs_status
+
+// header of a frame
+typedef struct
+{
+    uint32_t length; // payload bytes after the header
+    uint16_t type;   // request or reply frame type
+    uint16_t status; // sfs_status of an sfsdDone frame; 0 otherwise
+} _sfsd_frame;
+
+// Write all of a buffer to a socket; returns 0, or -1 if the peer is gone
+static inline int sendAll(int fd, const void *data, size_t length)
+{
+    const char *p = data;
+    ssize_t n;
+
+    while (length > 0)
+    {
+        n = write(fd, p, length);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+// Read exactly length bytes from a socket; returns 0, or -1 on an error or the end of the stream
+static inline int receiveAll(int fd, void *data, size_t length)
+{
+    char *p = data;
+    ssize_t n;
+
+    while (length > 0)
+    {
+        n = read(fd, p, length);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+// Send a frame header and its payload
+static inline int sendFrame(int fd, int type, int status, const void *payload, size_t length)
+{
+    _sfsd_frame frame = {(uint32_t)length, (uint16_t)type, (uint16_t)status};
+
+    if (sendAll(fd, &frame, sizeof(frame)) != 0)
+        return -1;
+    return length > 0 ? sendAll(fd, payload, length) : 0;
+}
+
+// Pack an entry into out (sfsdEntrySize bytes and the name); returns the bytes used
+static inline size_t packEntry(const sfs_entry_t *entry, char *out)
+{
+    uint8_t nameLength = (uint8_t)strlen(entry->name);
+
+    memcpy(out, &entry->size, 8);
+    memcpy(out + 8, &entry->inode, 4);
+    memcpy(out + 12, &entry->blocks, 4);
+    out[16] = (char)entry->isDirectory;
+    out[17] = (char)nameLength;
+    memcpy(out + sfsdEntrySize, entry->name, nameLength);
+    return sfsdEntrySize + nameLength;
+}
+
+// Unpack an entry from at most length bytes; returns the bytes used, or 0 if they do not hold one
+static inline size_t unpackEntry(const char *in, size_t length, sfs_entry_t *entry)
+{
+    uint8_t nameLength;
+
+    if (length < sfsdEntrySize || length - sfsdEntrySize < (nameLength = (uint8_t)in[17]) || nameLength > SFS_NAME_MAX)
+        return 0;
+
+    memcpy(&entry->size, in, 8);
+    memcpy(&entry->inode, in + 8, 4);
+    memcpy(&entry->blocks, in + 12, 4);
+    entry->isDirectory = in[16];
+    memcpy(entry->name, in + sfsdEntrySize, nameLength);
+    entry->name[nameLength] = 0;
+    return sfsdEntrySize + nameLength;
+}
+
+// Store counter i of a packed result
+static inline void packCounter(char *out, int i, uint64_t value)
+{
+    memcpy(out + (size_t)i * 8, &value, 8);
+}
+
+// Take counter i of a packed result
+static inline uint64_t unpackCounter(const char *in, int i)
+{
+    uint64_t value;
+
+    memcpy(&value, in + (size_t)i * 8, 8);
+    return value;
+}
+
+// Pack usage into out (sfsdUsageCounters counters); returns the bytes used
+static inline size_t packUsage(const sfs_usage_t *usage, char *out)
+{
+    int n = 0;
+
+    packCounter(out, n++, usage->blocks);
+    packCounter(out, n++, usage->freeBlocks);
+    packCounter(out, n++, usage->inodes);
+    packCounter(out, n++, usage->freeInodes);
+    packCounter(out, n++, usage->dentryEntries);
+    packCounter(out, n++, usage->dentryHits);
+    packCounter(out, n++, usage->dentryMisses);
+    packCounter(out, n++, usage->mapped);
+    packCounter(out, n++, usage->cacheBlocks);
+    packCounter(out, n++, usage->cacheHits);
+    packCounter(out, n++, usage->cacheMisses);
+    packCounter(out, n++, usage->cacheEvictions);
+    packCounter(out, n++, usage->cacheWritebacks);
+    packCounter(out, n++, usage->journalBlocks);
+    packCounter(out, n++, usage->journalCommits);
+    packCounter(out, n++, usage->journalLogged);
+    packCounter(out, n++, usage->journalCheckpoints);
+    packCounter(out, n++, usage->journalReplayed);
+    packCounter(out, n++, usage->reclaimWaiting);
+    packCounter(out, n++, usage->reclaimed);
+    return (size_t)n * 8;
+}
+
+// Unpack usage from length bytes; returns 1, or 0 if they are too few
+static inline int unpackUsage(const char *in, size_t length, sfs_usage_t *usage)
+{
+    int n = 0;
+
+    if (length < sfsdUsageCounters * 8)
+        return 0;
+
+    memset(usage, 0, sizeof(*usage));
+    usage->blocks = unpackCounter(in, n++);
+    usage->freeBlocks = unpackCounter(in, n++);
+    usage->inodes = unpackCounter(in, n++);
+    usage->freeInodes = unpackCounter(in, n++);
+    usage->dentryEntries = unpackCounter(in, n++);
+    usage->dentryHits = unpackCounter(in, n++);
+    usage->dentryMisses = unpackCounter(in, n++);
+    usage->mapped = unpackCounter(in, n++);
+    usage->cacheBlocks = unpackCounter(in, n++);
+    usage->cacheHits = unpackCounter(in, n++);
+    usage->cacheMisses = unpackCounter(in, n++);
+    usage->cacheEvictions = unpackCounter(in, n++);
+    usage->cacheWritebacks = unpackCounter(in, n++);
+    usage->journalBlocks = unpackCounter(in, n++);
+    usage->journalCommits = unpackCounter(in, n++);
+    usage->journalLogged = unpackCounter(in, n++);
+    usage->journalCheckpoints = unpackCounter(in, n++);
+    usage->journalReplayed = unpackCounter(in, n++);
+    usage->reclaimWaiting = unpackCounter(in, n++);
+    usage->reclaimed = unpackCounter(in, n++);
+    return 1;
+}
+
+// Pack a survey into out (sfsdSurveyCounters counters); returns the bytes used
+static inline size_t packSurvey(const sfs_survey_t *survey, char *out)
+{
+    int i, n = 0;
+
+    packCounter(out, n++, survey->freeRuns);
+    packCounter(out, n++, survey->largestFreeRun);
+    packCounter(out, n++, survey->files);
+    packCounter(out, n++, survey->directories);
+    packCounter(out, n++, survey->indexedDirectories);
+    packCounter(out, n++, survey->orphans);
+    for (i = 0; i < SFS_SIZE_CLASSES; i++)
+        packCounter(out, n++, survey->filesBySize[i]);
+    packCounter(out, n++, survey->fileBytes);
+    packCounter(out, n++, survey->fileBlocks);
+    packCounter(out, n++, survey->fileExtents);
+    packCounter(out, n++, survey->inlineFiles);
+    packCounter(out, n++, survey->packedFiles);
+    packCounter(out, n++, survey->sharedBlocks);
+    packCounter(out, n++, survey->savedBlocks);
+    for (i = 0; i < SFS_FILL_CLASSES; i++)
+        packCounter(out, n++, survey->directoriesByFill[i]);
+    packCounter(out, n++, survey->entries);
+    packCounter(out, n++, survey->entrySlots);
+    return (size_t)n * 8;
+}
+
+// Unpack a survey from length bytes; returns 1, or 0 if they are too few
+static inline int unpackSurvey(const char *in, size_t length, sfs_survey_t *survey)
+{
+    int i, n = 0;
+
+    if (length < sfsdSurveyCounters * 8)
+        return 0;
+
+    memset(survey, 0, sizeof(*survey));
+    survey->freeRuns = unpackCounter(in, n++);
+    survey->largestFreeRun = unpackCounter(in, n++);
+    survey->files = unpackCounter(in, n++);
+    survey->directories = unpackCounter(in, n++);
+    survey->indexedDirectories = unpackCounter(in, n++);
+    survey->orphans = unpackCounter(in, n++);
+    for (i = 0; i < SFS_SIZE_CLASSES; i++)
+        survey->filesBySize[i] = unpackCounter(in, n++);
+    survey->fileBytes = unpackCounter(in, n++);
+    survey->fileBlocks = unpackCounter(in, n++);
+    survey->fileExtents = unpackCounter(in, n++);
+    survey->inlineFiles = unpackCounter(in, n++);
+    survey->packedFiles = unpackCounter(in, n++);
+    survey->sharedBlocks = unpackCounter(in, n++);
+    survey->savedBlocks = unpackCounter(in, n++);
+    for (i = 0; i < SFS_FILL_CLASSES; i++)
+        survey->directoriesByFill[i] = unpackCounter(in, n++);
+    survey->entries = unpackCounter(in, n++);
+    survey->entrySlots = unpackCounter(in, n++);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,419 @@
+// sfs-replay: run a trace recorded by sfs --trace again, on a copy of an image
+//
+// The image is copied first, so the one the trace is replayed against stays
+// as it was. Commands run through libsfs the way the shell runs them and
+// commits are made where the trace has them. Contents the trace only knows
+// the size of are made up; what display and export would write goes to
+// /dev/null, and recursive imports and exports, which need the host files,
+// are not replayed. Commands run back to back, or with -p as far apart as
+// they were recorded. The throughput is printed, and the latency of each
+// kind of command next to the one recorded in the trace.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsfs.h"
+#include "sfs_trace.h"
+
+// latencies of one kind of command, replayed and as recorded
+typedef struct
+{
+    const char *name; // the command; "commit" for the commits, "other" for the rest
+    long count, failed;
+    long differ;      // outcomes that are not the recorded ones
+    double *replayed; // microseconds
+    double *recorded;
+    long capacity;
+} _kind;
+
+sfs_t *fs = NULL;
+int devNull = -1;
+char *contents = NULL; // made-up contents; grows to the largest payload
+uint64_t contentsSize = 0;
+_kind kinds[] = {{.name = "ls"}, {.name = "cd"}, {.name = "md"}, {.name = "rd"}, {.name = "create"},
+                 {.name = "display"}, {.name = "rm"}, {.name = "import"}, {.name = "export"}, {.name = "append"},
+                 {.name = "write"}, {.name = "truncate"}, {.name = "stats"}, {.name = "sync"}, {.name = "snapshot"},
+                 {.name = "commit"}, {.name = "other"}};
+#define kindCount (int)(sizeof(kinds) / sizeof(kinds[0]))
+
+// function declarations
+int copyImage(const char *, const char *);
+int readRecord(FILE *, _trace_record *, char *);
+double nowUs();
+void countEntry(void *, const sfs_entry_t *);
+void countSnapshot(void *, const sfs_snapshot_t *);
+sfs_status createMadeUp(const char *, uint64_t);
+sfs_status sendAway(const char *);
+sfs_status change(const char *, int, long, const char *);
+int replayCommand(char *, uint64_t);
+_kind *kindOf(const char *);
+void addLatency(_kind *, int, int, double, double);
+int compareDoubles(const void *, const void *);
+double percentile(double *, long, double);
+
+// Copy the image to replay on; returns 0 or -1
+int copyImage(const char *from, const char *to)
+{
+    char buffer[65536];
+    int in = open(from, O_RDONLY), out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    ssize_t n = -1;
+
+    while (in != -1 && out != -1 && (n = read(in, buffer, sizeof(buffer))) != 0)
+    {
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 || write(out, buffer, n) != n)
+            break;
+    }
+
+    if (in != -1)
+        close(in);
+    if (out != -1 && close(out) != 0)
+        n = -1;
+    if (in == -1 || out == -1 || n != 0)
+    {
+        printf("Cannot copy %s to %s.\n", from, to);
+        return -1;
+    }
+    return 0;
+}
+
+// Read the next record and its line (NUL added; line holds UINT16_MAX + 1 bytes); returns 1, or 0 at the end
+int readRecord(FILE *in, _trace_record *record, char *line)
+{
+    if (fread(record, sizeof(*record), 1, in) != 1 || fread(line, 1, record->length, in) != record->length)
+        return 0;
+    line[record->length] = 0;
+    return 1;
+}
+
+// Microseconds on the monotonic clock
+double nowUs()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+void countEntry(void *arg, const sfs_entry_t *entry)
+{
+    (void)entry;
+    (*(long *)arg)++;
+}
+
+// Count a listed snapshot
+void countSnapshot(void *arg, const sfs_snapshot_t *snapshot)
+{
+    (void)snapshot;
+    (*(long *)arg)++;
+}
+
+// Create a file of size made-up bytes
+sfs_status createMadeUp(const char *path, uint64_t size)
+{
+    char *grown;
+
+    if (size > contentsSize)
+    {
+        if ((grown = realloc(contents, size)) == NULL)
+            return SFS_ENOMEM;
+        memset(grown + contentsSize, 'x', size - contentsSize);
+        contents = grown;
+        contentsSize = size;
+    }
+    return sfs_create(fs, path, contents, size);
+}
+
+// Read a file out to /dev/null, as display and export do
+sfs_status sendAway(const char *path)
+{
+    sfs_file_t *file;
+    sfs_status status = sfs_open(fs, path, SFS_O_READ, &file);
+
+    if (status != SFS_OK)
+        return status;
+    status = sfs_sendfile(file, devNull, 0, SFS_LENGTH_UNKNOWN, NULL);
+    sfs_close(file);
+    return status;
+}
+
+// Append text to a file, write it at offset, or (text NULL) cut or extend the file to offset bytes
+sfs_status change(const char *path, int append, long offset, const char *text)
+{
+    sfs_file_t *file;
+    sfs_status status = sfs_open(fs, path, SFS_O_WRITE, &file);
+
+    if (status != SFS_OK)
+        return status;
+    if (text == NULL)
+        status = sfs_truncate(file, offset);
+    else if (append)
+        status = sfs_append(file, text, strlen(text), NULL);
+    else
+        status = sfs_pwrite(file, text, strlen(text), offset, NULL);
+    sfs_close(file);
+    return status;
+}
+
+// Run one recorded command line; returns 1 if it worked, 0 if it failed and -1 if it is not replayed
+// The line is cut into words as the shell does: the command, its first argument and the rest
+int replayCommand(char *line, uint64_t payload)
+{
+    char *words[4], *rest, *end, *p = line;
+    int n = 0, recursive;
+    long number, seen = 0;
+    sfs_entry_t entry;
+    sfs_survey_t survey;
+    sfs_usage_t usage;
+    sfs_status status;
+
+    while (n < 2)
+    {
+        p += strspn(p, " \t");
+        if (*p == 0)
+            break;
+        words[n++] = p;
+        p += strcspn(p, " \t");
+        if (*p != 0)
+            *p++ = 0;
+    }
+    rest = p + strspn(p, " \t");
+    if (n == 0)
+        return -1;
+
+    if (n == 1 && strcmp(words[0], "ls") == 0)
+        status = sfs_list(fs, ".", countEntry, &seen);
+    else if (n == 2 && strcmp(words[0], "ls") == 0)
+        status = sfs_list(fs, words[1], countEntry, &seen);
+    else if (n == 2 && strcmp(words[0], "cd") == 0)
+        status = sfs_chdir(fs, words[1]);
+    else if (n == 1 && strcmp(words[0], "rd") == 0)
+        status = sfs_chdir(fs, "/");
+    else if (n == 2 && strcmp(words[0], "md") == 0)
+        status = sfs_mkdir(fs, words[1]);
+    else if (n == 2 && strcmp(words[0], "create") == 0 && *rest != 0 && *rest != '@')
+        status = sfs_create(fs, words[1], rest, strlen(rest));
+    else if (n == 2 && strcmp(words[0], "create") == 0)
+        status = createMadeUp(words[1], payload);
+    else if (n == 2 && strcmp(words[0], "display") == 0)
+        status = sendAway(words[1]);
+    else if (n == 2 && strcmp(words[0], "rm") == 0)
+        status = sfs_remove(fs, words[1]);
+    else if (n == 2 && strcmp(words[0], "append") == 0)
+        status = change(words[1], 1, 0, rest);
+    else if (n == 2 && strcmp(words[0], "write") == 0 && (number = strtol(rest, &end, 10)) >= 0 && end != rest)
+        status = change(words[1], 0, number, end + strspn(end, " \t"));
+    else if (n == 2 && strcmp(words[0], "truncate") == 0 && (number = strtol(rest, &end, 10)) >= 0 && end != rest)
+        status = change(words[1], 0, number, NULL);
+    else if (n == 2 && (strcmp(words[0], "import") == 0 || strcmp(words[0], "export") == 0))
+    {
+        // the rest is the other path; a recursive copy needs the host tree
+        recursive = strcmp(words[1], "-r") == 0;
+        rest[strcspn(rest, " \t")] = 0;
+        if (recursive || *rest == 0)
+            return -1;
+        if (words[0][0] == 'i')
+        {
+            status = sfs_stat(fs, rest, &entry);
+            if (status == SFS_OK)
+                status = SFS_EEXIST;
+            if (status == SFS_ENOENT)
+                status = createMadeUp(rest, payload);
+        }
+        else
+            status = sendAway(words[1]);
+    }
+    else if (n == 1 && strcmp(words[0], "stats") == 0)
+        status = sfs_usage(fs, &usage);
+    else if (n == 2 && strcmp(words[0], "stats") == 0)
+        status = sfs_survey(fs, &survey);
+    else if (n == 1 && strcmp(words[0], "sync") == 0)
+        status = sfs_sync(fs);
+    else if (n == 1 && strcmp(words[0], "snapshot") == 0)
+        status = sfs_list_snapshots(fs, countSnapshot, &seen);
+    else if (n == 2 && strcmp(words[0], "snapshot") == 0 && strcmp(words[1], "-d") == 0)
+        status = sfs_delete_snapshot(fs, rest);
+    else if (n == 2 && strcmp(words[0], "snapshot") == 0)
+        status = sfs_snapshot(fs, words[1]);
+    else
+        return -1;
+
+    return status == SFS_OK;
+}
+
+// The kind a command line is counted as
+_kind *kindOf(const char *line)
+{
+    size_t length = strcspn(line, " \t");
+    int i;
+
+    for (i = 0; i < kindCount - 1; i++)
+    {
+        if (strlen(kinds[i].name) == length && strncmp(kinds[i].name, line, length) == 0)
+            break;
+    }
+    return &kinds[i];
+}
+
+void addLatency(_kind *kind, int ok, int recordedOk, double replayed, double recorded)
+{
+    if (kind->count == kind->capacity)
+    {
+        kind->capacity = kind->capacity == 0 ? 256 : kind->capacity * 2;
+        kind->replayed = realloc(kind->replayed, kind->capacity * sizeof(double));
+        kind->recorded = realloc(kind->recorded, kind->capacity * sizeof(double));
+        if (kind->replayed == NULL || kind->recorded == NULL)
+        {
+            printf("Out of memory.\n");
+            exit(1);
+        }
+    }
+
+    kind->replayed[kind->count] = replayed;
+    kind->recorded[kind->count] = recorded;
+    kind->count++;
+    kind->failed += !ok;
+    kind->differ += ok != recordedOk;
+}
+
+int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Latency that the given fraction of count sorted values did not exceed
+double percentile(double *values, long count, double fraction)
+{
+    long i = (long)(fraction * count + 0.5) - 1;
+
+    if (count == 0)
+        return 0;
+    return values[i < 0 ? 0 : i];
+}
+
+int main(int argc, char *argv[])
+{
+    sfs_options_t options = {.cacheBlocks = 64};
+    _trace_header header;
+    _trace_record record;
+    char *line = malloc(UINT16_MAX + 1);
+    FILE *in;
+    double first, start, elapsed;
+    long commands = 0, skipped = 0, failed = 0, differ = 0;
+    int paced = 0, ok, i;
+    struct timespec pause;
+    sfs_status status;
+    _kind *kind;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-p") == 0)
+            paced = 1;
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            options.cacheBlocks = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0)
+            options.mapImage = 1;
+        else if (strcmp(argv[i], "-d") == 0)
+            options.deferredReclaim = 1;
+        else if (strcmp(argv[i], "-z") == 0)
+            options.compress = 1;
+        else if (argv[i][0] != '-' && i == argc - 3)
+            break;
+        else
+            i = argc;
+    }
+    if (i != argc - 3)
+    {
+        printf("Usage: %s [-p] [-c <cache blocks>] [-m] [-d] [-z] <trace> <image> <copy>\n", argv[0]);
+        printf("  -p  keep the pacing of the trace instead of running commands back to back\n");
+        return 1;
+    }
+
+    in = fopen(argv[i], "rb");
+    if (in == NULL || fread(&header, sizeof(header), 1, in) != 1 || header.magic != traceMagic || header.version != traceVersion)
+    {
+        printf("%s: Not an sfs trace.\n", argv[i]);
+        return 1;
+    }
+    if (copyImage(argv[i + 1], argv[i + 2]) != 0)
+        return 1;
+
+    status = sfs_mount(argv[i + 2], &options, &fs);
+    if (status != SFS_OK)
+    {
+        printf("%s: %s.\n", argv[i + 2], sfs_strerror(status));
+        return 1;
+    }
+    devNull = open("/dev/null", O_WRONLY);
+
+    first = nowUs();
+    while (readRecord(in, &record, line))
+    {
+        if (paced && (elapsed = record.at - (nowUs() - first)) > 0)
+        {
+            pause.tv_sec = (time_t)(elapsed / 1e6);
+            pause.tv_nsec = (long)(elapsed * 1e3) % 1000000000;
+            nanosleep(&pause, NULL);
+        }
+
+        start = nowUs();
+        if (record.kind == traceCommit)
+        {
+            ok = sfs_commit(fs) == SFS_OK;
+            kind = kindOf("commit");
+        }
+        else
+        {
+            kind = kindOf(line);
+            ok = replayCommand(line, record.payload);
+            if (ok == -1)
+            {
+                skipped++;
+                continue;
+            }
+            commands++;
+        }
+        addLatency(kind, ok, record.ok, nowUs() - start, record.micros);
+        failed += !ok;
+        differ += ok != record.ok;
+    }
+    sfs_commit(fs);
+    elapsed = (nowUs() - first) / 1e6;
+    fclose(in);
+
+    printf("Replayed %ld command%s in %.3f s, %.0f commands/s; %ld not replayed, %ld failed, %ld not as recorded.\n", commands, commands == 1 ? "" : "s", elapsed,
+           elapsed > 0 ? commands / elapsed : 0, skipped, failed, differ);
+    printf("%-9s %7s %7s %9s %9s %9s %11s %11s\n", "command", "count", "failed", "p50 us", "p99 us", "max us", "was p50 us", "was p99 us");
+    for (i = 0; i < kindCount; i++)
+    {
+        kind = &kinds[i];
+        if (kind->count == 0)
+            continue;
+        qsort(kind->replayed, kind->count, sizeof(double), compareDoubles);
+        qsort(kind->recorded, kind->count, sizeof(double), compareDoubles);
+        printf("%-9s %7ld %7ld %9.1f %9.1f %9.1f %11.0f %11.0f\n", kind->name, kind->count, kind->failed, percentile(kind->replayed, kind->count, 0.5),
+               percentile(kind->replayed, kind->count, 0.99), percentile(kind->replayed, kind->count, 1), percentile(kind->recorded, kind->count, 0.5),
+               percentile(kind->recorded, kind->count, 0.99));
+        free(kind->replayed);
+        free(kind->recorded);
+    }
+
+    free(line);
+    free(contents);
+    close(devNull);
+    status = sfs_unmount(fs);
+    if (status != SFS_OK)
+    {
+        printf("%s: %s.\n", argv[argc - 1], sfs_strerror(status));
+        return 1;
+    }
+    return 0;
+}